@@ -0,0 +1,402 @@
+// bench/bench.c - microbenchmarks for the hot paths (make bench)
+//
+// Links against the daemon objects (everything but main.o) and times:
+//   update    ipacct_update_rx/tx throughput, 1..N threads x 10..100k IPs:
+//             a lock per packet, as capture counted before the aggregator
+//             queue; kept as the baseline for batch
+//   batch     ipacct_update_batch throughput, as the capture aggregator drains
+//             its queue (the packet path now)
+//   snapshot  ipacct_snapshot_and_clear latency with every IP dirty
+//   storage   storage_append_daily records/s under each fsync mode
+//   report    reporter scan throughput over a .bin and a .bin.gz day
+// Each result is one JSON object per line on stdout, tagged with the git
+// revision the binary was built from, so runs can be diffed across
+// commits. Library chatter goes to /dev/null; errors stay on stderr.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "netacct.h"
+
+#ifndef BENCH_REV
+#define BENCH_REV "unknown"
+#endif
+
+#define BENCH_UPDATE_BATCH 1024   // ops between stop-flag checks
+
+static FILE *results;
+static double case_secs = 0.5;
+static int max_threads;
+static char scratch[512];
+
+static double now_secs(void) {
+    return (double)histo_now() / 1e9;
+}
+
+/* Silence stderr around calls that log per client. */
+static int saved_stderr = -1;
+
+static void quiet(int on) {
+    fflush(stderr);
+    if (on) {
+        saved_stderr = dup(STDERR_FILENO);
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    } else if (saved_stderr >= 0) {
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+        saved_stderr = -1;
+    }
+}
+
+static uint32_t xorshift(uint32_t *s) {
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+/* n distinct addresses in 10.0.0.0/8, network byte order. */
+static uint32_t *make_ips(int n) {
+    uint32_t *ips = malloc(sizeof(*ips) * n);
+    if (!ips) return NULL;
+    for (int i = 0; i < n; i++) ips[i] = htonl(0x0a000000u + 1 + (uint32_t)i);
+    return ips;
+}
+
+/* ---------- ipacct ---------- */
+
+static struct iface_counters *bench_ic;
+static uint32_t *cur_ips;
+static int cur_nips;
+
+/* Make exactly ips[0..n) the registered clients of bench_ic. */
+static int set_clients(uint32_t *ips, int n) {
+    quiet(1);
+    if (cur_nips) ipacct_del_clients(cur_ips, cur_nips);
+    int rc = ipacct_add_clients(ips, n);
+    quiet(0);
+    cur_ips = ips;
+    cur_nips = n;
+    return rc == n ? 0 : -1;
+}
+
+struct update_arg {
+    pthread_t tid;
+    uint32_t seed;
+    uint64_t ops;
+};
+
+static volatile int update_stop;
+
+static void *update_thread(void *p) {
+    struct update_arg *a = p;
+    uint32_t s = a->seed;
+    uint64_t ops = 0;
+    while (!update_stop) {
+        for (int i = 0; i < BENCH_UPDATE_BATCH; i += 2) {
+            uint32_t ip = cur_ips[xorshift(&s) % cur_nips];
+            ipacct_update_rx(bench_ic, ip, 1500);
+            ipacct_update_tx(bench_ic, ip, 60);
+        }
+        ops += BENCH_UPDATE_BATCH;
+    }
+    a->ops = ops;
+    return NULL;
+}
+
+static void bench_update(int threads, int nips) {
+    struct update_arg args[64];
+    update_stop = 0;
+    double t0 = now_secs();
+    for (int i = 0; i < threads; i++) {
+        args[i].seed = 0x9e3779b9u * (uint32_t)(i + 1);
+        pthread_create(&args[i].tid, NULL, update_thread, &args[i]);
+    }
+    usleep((useconds_t)(case_secs * 1e6));
+    update_stop = 1;
+    uint64_t ops = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(args[i].tid, NULL);
+        ops += args[i].ops;
+    }
+    double dt = now_secs() - t0;
+    fprintf(results, "{\"rev\":\"%s\",\"bench\":\"update\",\"threads\":%d,\"ips\":%d"
+            ",\"ops\":%" PRIu64 ",\"secs\":%.3f,\"ops_per_sec\":%.0f,\"ns_per_op\":%.1f}\n",
+            BENCH_REV, threads, nips, ops, dt, ops / dt, dt * 1e9 * threads / (double)ops);
+}
+
+/* One aggregator draining AGG_BATCH-sized runs of queued tuples. */
+static void bench_batch(int nips) {
+    enum { BATCH = 256 };
+    struct pkt_tuple t[BATCH];
+    uint32_t s = 0x9e3779b9u;
+    uint64_t ops = 0;
+    double t0 = now_secs(), end = t0 + case_secs;
+    while (now_secs() < end) {
+        for (int j = 0; j < BENCH_UPDATE_BATCH; j += BATCH) {
+            for (int i = 0; i < BATCH; i += 2) {
+                uint32_t ip = cur_ips[xorshift(&s) % cur_nips];
+                t[i] = (struct pkt_tuple){ ip, 1500, PKT_RX, -1 };
+                t[i + 1] = (struct pkt_tuple){ ip, 60, PKT_TX, -1 };
+            }
+            ipacct_update_batch(bench_ic, t, BATCH);
+        }
+        ops += BENCH_UPDATE_BATCH;
+    }
+    double dt = now_secs() - t0;
+    fprintf(results, "{\"rev\":\"%s\",\"bench\":\"batch\",\"batch\":%d,\"ips\":%d"
+            ",\"ops\":%" PRIu64 ",\"secs\":%.3f,\"ops_per_sec\":%.0f,\"ns_per_op\":%.1f}\n",
+            BENCH_REV, BATCH, nips, ops, dt, ops / dt, dt * 1e9 / (double)ops);
+}
+
+static void bench_snapshot(int nips) {
+    struct ip_record *buf = NULL;
+    int cap = 0;
+    uint64_t min = UINT64_MAX, max = 0, sum = 0;
+    int iters = 0;
+    double end = now_secs() + case_secs;
+    while (now_secs() < end || iters < 3) {
+        for (int i = 0; i < nips; i++) ipacct_update_rx(bench_ic, cur_ips[i], 1500);
+        uint64_t krx, ktx;
+        uint64_t t0 = histo_now();
+        int n = ipacct_snapshot_and_clear(bench_ic, &krx, &ktx, &buf, &cap);
+        uint64_t dt = histo_now() - t0;
+        if (n != (nips < MAX_FLUSH_ENTRIES ? nips : MAX_FLUSH_ENTRIES)) {
+            fprintf(stderr, "[bench] snapshot returned %d of %d\n", n, nips);
+            break;
+        }
+        if (dt < min) min = dt;
+        if (dt > max) max = dt;
+        sum += dt;
+        iters++;
+    }
+    free(buf);
+    fprintf(results, "{\"rev\":\"%s\",\"bench\":\"snapshot\",\"ips\":%d,\"iters\":%d"
+            ",\"mean_ns\":%" PRIu64 ",\"min_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+            BENCH_REV, nips, iters, iters ? sum / iters : 0, min, max);
+}
+
+/* ---------- storage ---------- */
+
+static void fill_records(struct ip_record *recs, int n, uint32_t seed) {
+    for (int i = 0; i < n; i++) {
+        recs[i].ip = htonl(0x0a000000u + 1 + (uint32_t)i);
+        recs[i].rx = xorshift(&seed) % 10000000;
+        recs[i].tx = xorshift(&seed) % 1000000;
+    }
+}
+
+static void remove_tree(const char *path) {
+    DIR *d = opendir(path);
+    if (!d) {
+        unlink(path);
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char sub[1024];
+        snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+        remove_tree(sub);
+    }
+    closedir(d);
+    rmdir(path);
+}
+
+static void bench_storage(int mode, const char *mode_name, int nips) {
+    char root[600];
+    snprintf(root, sizeof(root), "%s/storage", scratch);
+    remove_tree(root);
+    mkdir(root, 0755);
+
+    struct ip_record *recs = malloc(sizeof(*recs) * nips);
+    if (!recs) return;
+    fill_records(recs, nips, 1);
+    storage_set_fsync(mode);
+
+    // one day, so no rotation/compression lands in the timed loop
+    uint32_t ts = 1700006400;
+    uint64_t n = 0;
+    double t0 = now_secs(), dt = 0;
+    do {
+        if (storage_append_daily(root, "bench0", ts + (uint32_t)(n % 86400), 1000, 1000,
+                                 (uint16_t)nips, recs, sizeof(*recs) * nips) != 0) {
+            fprintf(stderr, "[bench] storage_append_daily failed in %s\n", root);
+            break;
+        }
+        n++;
+        dt = now_secs() - t0;
+    } while (dt < case_secs);
+    storage_set_fsync(FSYNC_ALWAYS);
+    free(recs);
+
+    double bytes = (double)n * (22 + 22.0 * nips);
+    fprintf(results, "{\"rev\":\"%s\",\"bench\":\"storage\",\"fsync\":\"%s\",\"ips\":%d"
+            ",\"records\":%" PRIu64 ",\"secs\":%.3f,\"records_per_sec\":%.0f,\"mb_per_sec\":%.2f}\n",
+            BENCH_REV, mode_name, nips, n, dt, n / dt, bytes / dt / 1e6);
+}
+
+/* ---------- reporter ---------- */
+
+/* Day 1 is written as plain records, then a record on day 2 makes
+ * storage rotate it to .bin.gz; day 2 is then filled as plain .bin. */
+static int make_report_data(const char *root, int nips, int records) {
+    struct ip_record *recs = malloc(sizeof(*recs) * nips);
+    if (!recs) return -1;
+    storage_set_fsync(FSYNC_NEVER);
+    uint32_t day1 = 1700006400, day2 = day1 + 86400;
+    int rc = 0;
+    for (int d = 0; d < 2 && rc == 0; d++) {
+        uint32_t base = d ? day2 : day1;
+        for (int i = 0; i < records && rc == 0; i++) {
+            fill_records(recs, nips, (uint32_t)(i + 1));
+            rc = storage_append_daily(root, "bench0", base + (uint32_t)(i * 86400 / records),
+                                      1000, 1000, (uint16_t)nips, recs, sizeof(*recs) * nips);
+        }
+    }
+    storage_set_fsync(FSYNC_ALWAYS);
+    free(recs);
+    return rc;
+}
+
+static void bench_report(const char *root, const char *day, const char *kind,
+                         int nips, int records) {
+    char *argv[] = { "report", "--iface", "bench0", "--from", (char *)day, "--to", (char *)day,
+                     "--top", "10", (char *)root, "monthly", NULL };
+    int argc = (int)(sizeof(argv) / sizeof(argv[0])) - 1;
+    int runs = 0;
+    double t0 = now_secs(), dt;
+    do {
+        if (reporter_run(argc, argv) != 0) {
+            fprintf(stderr, "[bench] reporter_run failed\n");
+            return;
+        }
+        fflush(stdout);
+        runs++;
+        dt = now_secs() - t0;
+    } while (dt < case_secs);
+
+    double recs = (double)records * runs;
+    double bytes = recs * (22 + 22.0 * nips);
+    fprintf(results, "{\"rev\":\"%s\",\"bench\":\"report\",\"file\":\"%s\",\"ips\":%d"
+            ",\"records\":%d,\"runs\":%d,\"secs\":%.3f,\"records_per_sec\":%.0f,\"mb_per_sec\":%.2f}\n",
+            BENCH_REV, kind, nips, records, runs, dt, recs / dt, bytes / dt / 1e6);
+}
+
+/* ---------- main ---------- */
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-t SECS] [-j THREADS] [-d DIR] [-q]\n"
+            "  -t  seconds per case (default 0.5)\n"
+            "  -j  highest thread count for update (default: CPUs, max 64)\n"
+            "  -d  scratch directory (default: a new one under /tmp)\n"
+            "  -q  quick run: fewer sizes\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int quick = 0;
+    const char *dir = NULL;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    max_threads = ncpu > 0 ? (int)ncpu : 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "t:j:d:q")) != -1) {
+        switch (c) {
+        case 't': case_secs = atof(optarg); break;
+        case 'j': max_threads = atoi(optarg); break;
+        case 'd': dir = optarg; break;
+        case 'q': quick = 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (case_secs <= 0 || max_threads <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (max_threads > 64) max_threads = 64;
+
+    if (dir) {
+        snprintf(scratch, sizeof(scratch), "%s", dir);
+        mkdir(scratch, 0755);
+    } else {
+        snprintf(scratch, sizeof(scratch), "/tmp/netacct-bench.XXXXXX");
+        if (!mkdtemp(scratch)) {
+            perror("mkdtemp");
+            return 1;
+        }
+    }
+
+    // results keep the real stdout; the reporter and flush logs do not
+    results = fdopen(dup(STDOUT_FILENO), "w");
+    if (!results || !freopen("/dev/null", "w", stdout)) {
+        perror("stdout");
+        return 1;
+    }
+    setvbuf(results, NULL, _IOLBF, 0);
+
+    static const int sizes[] = { 10, 1000, 10000, 100000 };
+    int nsizes = quick ? 2 : (int)(sizeof(sizes) / sizeof(sizes[0]));
+    uint32_t *ips = make_ips(sizes[nsizes - 1]);
+    if (!ips) return 1;
+
+    ipacct_init();
+    bench_ic = ipacct_iface_add("bench0");
+    if (!bench_ic) {
+        fprintf(stderr, "[bench] adding the bench interface failed\n");
+        return 1;
+    }
+    for (int s = 0; s < nsizes; s++) {
+        if (set_clients(ips, sizes[s]) != 0) {
+            fprintf(stderr, "[bench] registering %d clients failed\n", sizes[s]);
+            return 1;
+        }
+        for (int t = 1; t <= max_threads; t *= 2) bench_update(t, sizes[s]);
+        if (max_threads & (max_threads - 1)) bench_update(max_threads, sizes[s]);
+        bench_batch(sizes[s]);
+        bench_snapshot(sizes[s]);
+    }
+    set_clients(ips, 0);
+
+    static const struct { int mode; const char *name; } modes[] = {
+        { FSYNC_ALWAYS, "always" }, { FSYNC_DATA, "data" }, { FSYNC_NEVER, "never" },
+    };
+    for (int m = 0; m < 3; m++) {
+        bench_storage(modes[m].mode, modes[m].name, 10);
+        bench_storage(modes[m].mode, modes[m].name, 1000);
+    }
+
+    // a day of one-minute flushes
+    int report_ips = quick ? 100 : 1000, records = 1440;
+    char root[600];
+    snprintf(root, sizeof(root), "%s/report", scratch);
+    remove_tree(root);
+    mkdir(root, 0755);
+    quiet(1);   // rotation logs the compression
+    int rc = make_report_data(root, report_ips, records);
+    quiet(0);
+    if (rc == 0) {
+        bench_report(root, "2023-11-15", "bin.gz", report_ips, records);
+        bench_report(root, "2023-11-16", "bin", report_ips, records);
+    } else {
+        fprintf(stderr, "[bench] writing report data under %s failed\n", root);
+    }
+
+    if (!dir) remove_tree(scratch);
+    free(ips);
+    return 0;
+}
@@ -2,10 +2,17 @@
 #define NETACCT_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <pthread.h>
+#include <time.h>
 
 #define MAX_IFACE_NAME 32
-#define MAX_IP_ENTRIES 64  // safe bound for <=30 IPs
+#define MAX_IP_ENTRIES 64  // initial hash buckets per interface, doubled as it fills
+#define MAX_IFACES 8
+#define MAX_PREFIXES 32
+#define MAX_CLIENTS 256     // static clients in the config file
+#define MAX_FLUSH_ENTRIES 65535  // ip_count is a u16 on disk
+#define MAX_AUTO_ENTRIES MAX_FLUSH_ENTRIES  // prefix auto-accounting stops here
 
 struct ip_record {
     uint32_t ip;      // IPv4 addr (network byte order)
@@ -17,32 +24,185 @@ struct ip_counter {
     uint32_t ip;      // IPv4 addr (network byte order)
     uint64_t rx_bytes;
     uint64_t tx_bytes;
+    uint64_t day_rx;  // flushed so far in the current UTC day
+    uint64_t day_tx;
+    uint64_t sum_rx;  // flushed since start
+    uint64_t sum_tx;
     struct ip_counter *next;
     struct ip_counter *lprev;  // for active list
     struct ip_counter *lnext;  // for active list
 };
 
+/* Per-client traffic classes of the optional flow breakdown (flows.c):
+ * protocol plus the remote end's port. */
+enum {
+    FLOW_WEB,         // TCP 80, 443, 8080, 8443
+    FLOW_QUIC,        // UDP 443
+    FLOW_DNS,         // TCP/UDP 53, 853
+    FLOW_MAIL,        // SMTP, IMAP, POP3 and their TLS ports
+    FLOW_SSH,         // TCP 22
+    FLOW_VPN,         // OpenVPN, IPsec, WireGuard, GRE, ESP
+    FLOW_TCP_LOW,     // other TCP, remote port < 1024
+    FLOW_TCP_HIGH,    // other TCP: P2P, backups, ...
+    FLOW_UDP_LOW,
+    FLOW_UDP_HIGH,
+    FLOW_ICMP,
+    FLOW_OTHER,       // other protocols, fragments
+    FLOW_NCLASSES
+};
+
+#define FLOW_WAYS 8
+#define MAX_FLOW_ENTRIES (1 << 20)
+
+/* 8-way set-associative bucket, three cache lines: a lookup reads the
+ * key line and touches one counter line. */
+struct flow_bucket {
+    uint32_t ip[FLOW_WAYS];
+    uint8_t cls[FLOW_WAYS];
+    uint8_t used;             // bit per way
+    uint8_t ref;              // clock reference bits
+    uint8_t hand;             // next way the clock looks at
+    uint8_t pad[21];
+    uint64_t rx[FLOW_WAYS];
+    uint64_t tx[FLOW_WAYS];
+} __attribute__((aligned(64)));
+
+/* Fixed-size (ip, class) table, allocated up front and never grown: a
+ * miss in a full bucket evicts by clock, and the evicted bytes are only
+ * kept as a per-table sum. */
+struct flow_table {
+    struct flow_bucket *buckets;
+    uint32_t mask;            // bucket count - 1
+    uint64_t evicted_rx;      // bytes of evicted entries since the last drain
+    uint64_t evicted_tx;
+    uint64_t evictions;       // since the last drain
+};
+
+struct flow_record {
+    uint32_t ip;              // network order; 0 = evicted, no client
+    uint8_t cls;
+    uint64_t rx;
+    uint64_t tx;
+};
+
+/* Auto-accounted range: any address inside gets counters on first sight. */
+struct prefix {
+    uint32_t net;     // network byte order, already masked
+    uint32_t mask;    // network byte order
+};
+
 struct iface_counters {
     char name[MAX_IFACE_NAME];
-    struct ip_counter *entries[MAX_IP_ENTRIES];
+    int in_use;       // slot holds a configured interface
+    struct ip_counter **entries;   // nbuckets chains, NULL until the first insert
+    uint32_t nbuckets;
     struct ip_counter *active_head;
     struct ip_counter *active_tail;
+    uint32_t nentries;
+    struct prefix prefixes[MAX_PREFIXES];
+    int nprefixes;
     // kernel totals delta since last flush
     uint64_t kernel_rx_delta;
     uint64_t kernel_tx_delta;
     // last read kernel counters
     uint64_t last_kernel_rx;
     uint64_t last_kernel_tx;
-    pthread_mutex_t lock;
+    // kernel totals flushed so far in the current UTC day
+    uint32_t day_start;
+    uint64_t day_kernel_rx;
+    uint64_t day_kernel_tx;
+    // kernel totals flushed since start
+    uint64_t sum_kernel_rx;
+    uint64_t sum_kernel_tx;
+    // flow breakdown: cur is filled by capture, the other one waits for
+    // the flush that retired it; both NULL-bucketed when disabled
+    struct flow_table flows[2];
+    int flow_cur;
+    uint64_t flow_evictions;  // since start
+    uint64_t auto_overflows;  // prefix hits not counted, table at MAX_AUTO_ENTRIES
+    // sampled capture: per-IP counts are 1 in sample_rate packets and are
+    // scaled at flush so that sampled_bytes matches the kernel delta
+    int sample_rate;          // 1 = every packet
+    uint64_t sampled_bytes;   // IPv4 bytes sampled since the last flush, atomic
+    double flow_scale;        // scale applied by the last snapshot
+    pthread_mutex_t lock;     // keep last: ipacct_iface_add() resets what precedes it
+};
+
+/* Consistent read-only copy of the live counters (control socket queries).
+ * *_today include the unflushed delta. */
+struct ip_view {
+    uint32_t ip;
+    uint64_t rx_delta, tx_delta;
+    uint64_t rx_today, tx_today;
+    uint64_t rx_total, tx_total;   // since daemon start
+};
+
+struct iface_view {
+    char name[MAX_IFACE_NAME];
+    uint32_t day_start;
+    uint64_t rx_delta, tx_delta;
+    uint64_t rx_today, tx_today;
+    uint64_t rx_total, tx_total;   // since daemon start
+    uint64_t flow_evictions;
+    uint64_t auto_overflows;
 };
 
+enum { FSYNC_ALWAYS, FSYNC_DATA, FSYNC_NEVER };
+
+/* Per-client byte caps (rx + tx), see quota.c. */
+enum { QUOTA_DAY, QUOTA_MONTH, QUOTA_NPERIODS };
+#define MAX_QUOTAS 64
+#define MAX_QUOTA_THRESHOLDS 4
+
+struct quota_rule {
+    struct prefix match;  // the most specific matching rule applies
+    int is_default;       // applies to clients no prefix matches
+    int period;           // QUOTA_DAY / QUOTA_MONTH
+    uint64_t limit;       // bytes
+};
+
+/* Daemon configuration (config.c). Loaded at startup and again on SIGHUP;
+ * see etc/netacct.conf.example for the file format. */
 struct cfg {
-    char *iface;
+    char ifaces[MAX_IFACES][MAX_IFACE_NAME];
+    int iface_count;
+    struct prefix prefixes[MAX_PREFIXES];
+    int prefix_count;
+    uint32_t clients[MAX_CLIENTS];  // registered at startup, network order
+    int client_count;
     int poll_interval;   // seconds
     int flush_interval;  // seconds
-    char *root_dir;
+    int ring_size;       // pcap buffer, bytes; 0 = libpcap default
+    int sample_rate;     // capture 1 in N packets, 1 = all
+    int queue_size;      // capture-to-aggregator queue, tuples per interface
+    int fsync_mode;      // FSYNC_*
+    char root_dir[256];
+    char control_sock[108];
+    int metrics_port;
+    struct quota_rule quotas[MAX_QUOTAS];
+    int quota_count;
+    int quota_thresholds[MAX_QUOTA_THRESHOLDS];  // percent, ascending
+    int quota_threshold_count;
+    char quota_hook[256];   // run on threshold crossings, "" = none
+    int flow_entries;    // flow breakdown table per interface, 0 = off
+    int retain_full;     // days kept at flush resolution, 0 = all
+    int retain_hourly;   // days kept hourly before daily totals, 0 = all
+    uint64_t disk_budget;   // bytes of daily files under root_dir, 0 = no limit
+    char path[256];      // file it was loaded from, "" for defaults
+};
+
+/* Daily file record: this header, then ip_count ip_entry_on_disk. */
+struct __attribute__((packed)) record_header {
+    uint32_t ts;          // epoch seconds
+    uint64_t total_rx;
+    uint64_t total_tx;
+    uint16_t ip_count;
 };
 
+/* ipv of the entries of a flow extension record: same layout, pad holds
+ * the FLOW_* class. Readers that only know ipv 4 skip them. */
+#define STORAGE_IPV_FLOW 0x46
+
 struct __attribute__((packed)) ip_entry_on_disk {
     uint8_t ipv;
     uint8_t pad;
@@ -53,21 +213,342 @@ struct __attribute__((packed)) ip_entry_on_disk {
 
 // API
 int collector_init(struct cfg *cfg);
-int collector_run(struct cfg *cfg);
+int collector_run(struct cfg *cfg, int takeover);
+void collector_request_handover(void);
+void collector_root_dir(char *buf, size_t n);
+int collector_poll_interval(void);
 int reporter_run(int argc, char **argv);
+int gen_run(int argc, char **argv);
+int merge_run(int argc, char **argv);
 void *control_thread_fn(void *arg);
+void control_adopt_fd(int fd);
+int control_listen_fd(void);
+void control_disown(int on);
+
+// config
+void config_defaults(struct cfg *cfg);
+int config_load(const char *path, struct cfg *cfg);
 
 // per-IP API
-int ipacct_add_local(const char *iface, uint32_t ip);
-int ipacct_update_rx(const char *iface, uint32_t ip, uint32_t bytes);
-int ipacct_update_tx(const char *iface, uint32_t ip, uint32_t bytes);
+extern struct iface_counters g_ifaces[MAX_IFACES];
+void ipacct_init(void);
+struct iface_counters *ipacct_iface_add(const char *name);
+void ipacct_iface_remove(struct iface_counters *ic);
+struct iface_counters *ipacct_iface_find(const char *name);
+void ipacct_set_prefixes(const struct prefix *p, int n);
+int ipacct_update_rx(struct iface_counters *ic, uint32_t ip, uint32_t bytes);
+int ipacct_update_tx(struct iface_counters *ic, uint32_t ip, uint32_t bytes);
+struct pkt_tuple;
+void ipacct_update_batch(struct iface_counters *ic, const struct pkt_tuple *t, int n);
+int ipacct_set_flow_entries(int entries);
+void ipacct_set_sample_rate(struct iface_counters *ic, int rate);
+int ipacct_snapshot_flows(struct iface_counters *ic, struct flow_record **buf, int *cap);
+int ipacct_accumulate_kernel_delta(struct iface_counters *ic, uint64_t rx_delta, uint64_t tx_delta);
+int ipacct_snapshot_and_clear(struct iface_counters *ic,
+                              uint64_t *out_kernel_rx, uint64_t *out_kernel_tx,
+                              struct ip_record **buf, int *cap);
 void ipacct_add_client(uint32_t ip);
 void ipacct_del_client(uint32_t ip);
+int ipacct_add_clients(const uint32_t *ips, int n);
+int ipacct_del_clients(const uint32_t *ips, int n);
+int ipacct_view(struct iface_counters *ic, struct iface_view *iv, struct ip_view *out, int cap);
+int ipacct_view_alloc(struct iface_counters *ic, struct iface_view *iv,
+                      struct ip_view **buf, int *cap);
+
+/* Unflushed counters and running totals of one interface, as handed to
+ * the daemon that takes over (handover.c). */
+struct ipacct_state {
+    char name[MAX_IFACE_NAME];
+    uint32_t day_start;
+    int32_t sample_rate;
+    uint64_t kernel_rx_delta, kernel_tx_delta;
+    uint64_t day_kernel_rx, day_kernel_tx;
+    uint64_t sum_kernel_rx, sum_kernel_tx;
+    uint64_t sampled_bytes;
+    uint64_t flow_evictions;
+    uint32_t nips;
+    uint32_t nflows;
+};
+
+struct ipacct_ip_state {
+    uint32_t ip;
+    uint32_t pad;
+    uint64_t rx, tx;              // unflushed, as counted (sampled)
+    uint64_t day_rx, day_tx;
+    uint64_t sum_rx, sum_tx;
+};
+
+int ipacct_export(struct iface_counters *ic, struct ipacct_state *st,
+                  struct ipacct_ip_state **ips, int *cap,
+                  struct flow_record **flows, int *fcap);
+void ipacct_import(struct iface_counters *ic, const struct ipacct_state *st,
+                   const struct ipacct_ip_state *ips, const struct flow_record *flows);
+int ipacct_clients(uint32_t **buf, int *cap);
+
+// flow table (flows.c)
+int flow_classify(uint8_t proto, uint16_t remote_port);
+const char *flow_class_name(int cls);
+int flow_table_init(struct flow_table *t, int entries);
+void flow_table_free(struct flow_table *t);
+void flow_table_add(struct flow_table *t, uint32_t ip, int cls, uint64_t rx, uint64_t tx);
+int flow_table_drain(struct flow_table *t, struct flow_record *out, int cap);
+int flow_table_capacity(const struct flow_table *t);
+
+// capture
+enum { PKT_RX, PKT_TX };
+
+/* One side of a captured packet, as queued from the capture thread to
+ * its aggregator (pcap_if.c); eight fit a cache line. */
+struct pkt_tuple {
+    uint32_t ip;          // network byte order
+    uint16_t len;         // IP total length
+    uint8_t dir;          // PKT_RX: ip is the destination, PKT_TX: the source
+    int8_t cls;           // FLOW_* class, -1 = no breakdown
+};
+
+#define QUEUE_SIZE_DEFAULT 65536
+
+struct capture_stats {
+    uint64_t received;    // packets seen by the filter
+    uint64_t dropped;     // dropped for lack of buffer space
+    uint64_t if_dropped;  // dropped by the interface/driver
+    uint64_t queue_size;        // tuples the aggregator queue holds
+    uint64_t queue_high_water;  // most tuples found waiting at once
+    uint64_t queue_overflows;   // tuples lost to a full queue
+};
+int capture_start(struct iface_counters *ic, int ring_size, int sample_rate, int queue_size);
+void capture_stop(const char *iface);
+#define CAPTURE_NEVER UINT64_MAX
+void capture_set_window(uint64_t from_us, uint64_t until_us);
+int pcap_if_stats(const char *iface, struct capture_stats *out);
+
+// latency histograms (histo.c); call sites compile in with -DNETACCT_HISTO
+enum {
+    HISTO_PACKET,       // packet_handler, sampled
+    HISTO_LOCK_WAIT,    // ipacct_update_* lock acquisition, sampled
+    HISTO_SNAPSHOT,     // ipacct_snapshot_and_clear
+    HISTO_STORAGE,      // storage_append_daily, whole call
+    HISTO_FSYNC,        // each fsync in storage_append_daily
+    HISTO_NSTAGES
+};
+
+#define HISTO_SAMPLE_SHIFT 6   // packet path: time 1 call in 64
+
+struct histo_summary {
+    const char *name;
+    uint64_t count;
+    uint64_t p50, p90, p99, p999, max;   // nanoseconds
+};
+
+uint64_t histo_now(void);
+int histo_sample(void);
+void histo_record(int stage, uint64_t ns);
+int histo_enabled(void);
+void histo_summary(int stage, struct histo_summary *out);
+void histo_dump(FILE *out);
+
+#ifdef NETACCT_HISTO
+#define HISTO_BEGIN(t)          uint64_t t = histo_now()
+#define HISTO_BEGIN_SAMPLED(t)  uint64_t t = histo_sample() ? histo_now() : 0
+#define HISTO_END(stage, t)     do { if (t) histo_record((stage), histo_now() - (t)); } while (0)
+#else
+#define HISTO_BEGIN(t)
+#define HISTO_BEGIN_SAMPLED(t)
+#define HISTO_END(stage, t)     do { } while (0)
+#endif
+
+// quotas (quota.c)
+struct quota_view {
+    uint32_t ip;
+    uint64_t used[QUOTA_NPERIODS];    // rx + tx so far in the day / month
+    uint64_t limit[QUOTA_NPERIODS];   // 0 = no quota
+};
+
+void quota_configure(const struct cfg *cfg);
+int quota_load(const char *root_dir, const struct cfg *cfg);
+void quota_account(uint32_t ts, const struct ip_record *ips, int n);
+int quota_checkpoint(const char *root_dir);
+int quota_view_alloc(struct quota_view **buf, int *cap, uint32_t *period_start);
+void control_notify(const char *line);
+
+// metrics exporter
+void *metrics_thread_fn(void *arg);
+void metrics_note_flush(int ok);
+void metrics_adopt_fd(int fd, int port);
+int metrics_listen_fd(void);
+
+// restart handover (handover.c)
+enum { HANDOVER_READY = 1, HANDOVER_WINDOW, HANDOVER_WINDOW_OK, HANDOVER_STATE,
+       HANDOVER_ACK, HANDOVER_ABORT };
+
+#define HANDOVER_MAX_FDS 2
+
+int handover_path(const char *control_sock, char *buf, size_t n);
+int handover_listen(const char *control_sock);
+int handover_request(const char *control_sock);
+int handover_accept(int lfd, int timeout_ms);
+int handover_connect(const char *control_sock);
+int handover_send(int fd, int type, uint64_t arg, const void *payload, size_t len,
+                  const int *fds, int nfds);
+int handover_recv(int fd, int type, uint64_t *arg, void **payload, size_t *len,
+                  int *fds, int *nfds, int timeout_ms);
+int handover_send_state(int fd, int control_fd, int metrics_fd, int metrics_port);
+int handover_recv_state(int fd, int *control_fd, int *metrics_fd, int *metrics_port,
+                        int timeout_ms);
+
+// retention (retention.c)
+int retention_run(const char *root_dir, int full_days, int hourly_days, uint64_t budget,
+                  const volatile int *running);
+
+// per-day index of closed daily files (dayindex.c)
+struct datafile;
+struct dayindex;
+void dayindex_path(const char *daily_dir, const struct datafile *df, char *buf, size_t n);
+int dayindex_build(const char *daily_dir, const struct datafile *df);
+int dayindex_update(const char *root_dir, const volatile int *running);
+struct dayindex *dayindex_open(const char *daily_dir, const struct datafile *df);
+void dayindex_close(struct dayindex *x);
+uint32_t dayindex_count(const struct dayindex *x);
+int dayindex_span(const struct dayindex *x, int h0, int h1, uint64_t *kernel_rx,
+                  uint64_t *kernel_tx, uint32_t *first_ts, uint32_t *last_ts);
+int dayindex_entry(const struct dayindex *x, uint32_t k, int h0, int h1,
+                   uint32_t *ip, uint64_t *rx, uint64_t *tx);
+int dayindex_lookup(const struct dayindex *x, uint32_t ip, int h0, int h1,
+                    uint64_t *rx, uint64_t *tx);
 
 // storage
+int ensure_dir(const char *path);
+void storage_set_fsync(int mode);
+void storage_sync(int fd);
+size_t storage_record_size(uint16_t ip_count);
+size_t storage_encode_record(void *buf, uint32_t ts, uint64_t rx_delta, uint64_t tx_delta,
+                             uint16_t ip_count, const struct ip_record *ips);
 int storage_append_daily(const char *root_dir, const char *iface,
                          uint32_t ts, uint64_t rx_delta, uint64_t tx_delta,
                          uint16_t ip_count, const void *ip_entries, size_t ip_entries_len);
+size_t storage_flows_size(int n);
+size_t storage_encode_flows(void *buf, uint32_t ts, int n, const struct flow_record *flows);
+int storage_append_daily_flows(const char *root_dir, const char *iface,
+                               uint32_t ts, uint64_t rx_delta, uint64_t tx_delta,
+                               uint16_t ip_count, const void *ip_entries, size_t ip_entries_len,
+                               int nflows, const struct flow_record *flows);
+
+// report export (streaming writer)
+enum { EXPORT_TEXT, EXPORT_CSV, EXPORT_JSON, EXPORT_NDJSON };
+
+struct export_writer {
+    FILE *out;
+    int format;
+    const char *iface;
+    char label[32];       // current period
+    uint32_t start, end;  // first/last record ts of the period
+    uint64_t kernel_rx, kernel_tx;
+    unsigned long periods;
+    unsigned long rows;
+    uint32_t step;        // series: bucket width in seconds
+    uint32_t last_ip;     // series: IP of the previous row
+};
+
+int export_parse_format(const char *s);
+void export_begin(struct export_writer *w, FILE *out, int format, const char *iface);
+void export_period_begin(struct export_writer *w, const char *label,
+                         uint32_t start, uint32_t end,
+                         uint64_t kernel_rx, uint64_t kernel_tx);
+void export_ip(struct export_writer *w, uint32_t ip, uint64_t rx, uint64_t tx);
+void export_period_end(struct export_writer *w, uint64_t all_rx, uint64_t all_tx);
+void export_end(struct export_writer *w);
+void export_series_begin(struct export_writer *w, FILE *out, int format,
+                         const char *iface, uint32_t step);
+void export_series_row(struct export_writer *w, uint32_t ip, uint32_t start,
+                       uint64_t rx, uint64_t tx, uint64_t peak_bps);
+void export_series_end(struct export_writer *w);
+
+// k-way merge of daily trees from several hosts (merge.c)
+struct merge;
+
+struct merge_record {
+    const char *host;     // tag of the root the record came from
+    const char *iface;
+    int src;              // stream, 0 .. merge_sources() - 1
+    uint32_t prev_ts;     // previous record of the same stream, 0 = none
+    struct record_header h;
+    const struct ip_entry_on_disk *entries;   // h.ip_count, valid until the next call
+};
+
+struct merge *merge_open(char *const *roots, int nroots, const char *iface,
+                         time_t from, time_t to);
+int merge_next(struct merge *m, struct merge_record *r);
+int merge_sources(const struct merge *m);
+int merge_span(const struct merge *m, time_t *first_day, time_t *last_day);
+void merge_close(struct merge *m);
+
+// arena + open-addressing IPv4 table (iptable.c)
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *head;
+    struct arena_chunk *cur;
+};
+
+struct iptable_slot {
+    uint32_t ip;          // network byte order
+    uint32_t gen;         // live iff == iptable.gen
+    void *val;
+};
+
+struct iptable {
+    struct iptable_slot *slots;
+    uint32_t mask;        // capacity - 1, capacity is a power of two
+    uint32_t count;
+    uint32_t gen;
+    size_t val_size;
+    struct arena arena;
+};
+
+void *arena_alloc(struct arena *a, size_t n);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+int iptable_init(struct iptable *t, size_t val_size, uint32_t initial_cap);
+void *iptable_get(struct iptable *t, uint32_t ip, int *created);
+void *iptable_find(const struct iptable *t, uint32_t ip);
+void *iptable_next(const struct iptable *t, uint32_t *pos);
+void iptable_reset(struct iptable *t);
+void iptable_free(struct iptable *t);
+
+// summing records into one (storage.c), for compaction and downsampling
+struct storage_sum {
+    uint32_t last_ts;           // newest record added
+    uint64_t kernel_rx, kernel_tx;
+    long records;               // added since the last reset
+    struct iptable ips;         // struct ip_record
+    struct iptable classes;     // per-IP bytes by FLOW_* class
+    struct ip_record *recs;     // encode scratch
+    int recs_cap;
+    struct flow_record *flows;
+    int flows_cap;
+    char *buf;
+    size_t buf_cap;
+};
+
+int storage_sum_init(struct storage_sum *s);
+int storage_sum_add(struct storage_sum *s, const struct record_header *h,
+                    const struct ip_entry_on_disk *entries);
+long storage_sum_encode(struct storage_sum *s, uint32_t ts, const char **out);
+void storage_sum_reset(struct storage_sum *s);
+void storage_sum_free(struct storage_sum *s);
+
+// util
+struct datafile {
+    char name[32];        // YYYY-MM-DD.bin[.gz]
+    time_t day;           // UTC start of the day
+    int is_gzip;
+};
+
+int util_parse_time(const char *s, int end_of_day, time_t *out);
+int util_parse_datafile_name(const char *name, time_t *day_start, int *is_gzip);
+int util_list_datafiles(const char *dir, time_t from, time_t to, struct datafile **out);
+uint32_t util_parse_step(const char *s);
 
 #endif // NETACCT_H
 
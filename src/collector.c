@@ -6,105 +6,512 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <sys/time.h>
 
 #include "netacct.h"
 
 // Forwarded functions
-int pcap_start_for_iface_threaded(const char *iface);
 extern void *poller_thread_fn(void *arg);
 extern void *control_thread_fn(void *arg);
-extern void ipacct_snapshot_and_clear(uint64_t*,uint64_t*,struct ip_record*,int*);
-extern int ipacct_accumulate_kernel_delta(uint64_t rx_delta, uint64_t tx_delta);
 
 static volatile int running = 1;
+static volatile sig_atomic_t reload_pending = 0;
+static volatile sig_atomic_t handover_pending = 0;
+static volatile int handed_over = 0;   // counters now belong to the next daemon
 
 void sigint_handler(int sig) { (void)sig; running = 0; }
+static void sighup_handler(int sig) { (void)sig; reload_pending = 1; }
+static void sigusr2_handler(int sig) { (void)sig; handover_pending = 1; }
 
+/* Called by the control thread; the main thread connects to the new
+ * daemon within a second. */
+void collector_request_handover(void) { handover_pending = 1; }
 
-int collector_init(struct cfg *cfg) {
-    // init global structures: set mutex
-    extern struct iface_counters g_iface;
-    memset(&g_iface, 0, sizeof(g_iface));
-    pthread_mutex_init(&g_iface.lock, NULL);
-    g_iface.kernel_rx_delta = 0;
-    g_iface.kernel_tx_delta = 0;
-    g_iface.last_kernel_rx = 0;
-    g_iface.last_kernel_tx = 0;
+/* The running configuration. Only the main thread replaces it (on
+ * SIGHUP); other threads read the fields that may change through the
+ * accessors below. control_sock and metrics_port are fixed at startup. */
+static struct cfg cur_cfg;
+static pthread_mutex_t cfg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void collector_root_dir(char *buf, size_t n) {
+    pthread_mutex_lock(&cfg_lock);
+    snprintf(buf, n, "%s", cur_cfg.root_dir);
+    pthread_mutex_unlock(&cfg_lock);
+}
+
+int collector_poll_interval(void) {
+    pthread_mutex_lock(&cfg_lock);
+    int v = cur_cfg.poll_interval;
+    pthread_mutex_unlock(&cfg_lock);
+    return v;
+}
+
+static int flush_interval(void) {
+    pthread_mutex_lock(&cfg_lock);
+    int v = cur_cfg.flush_interval;
+    pthread_mutex_unlock(&cfg_lock);
+    return v;
+}
+
+static int has_iface(const struct cfg *cfg, const char *name) {
+    for (int i = 0; i < cfg->iface_count; i++)
+        if (strcmp(cfg->ifaces[i], name) == 0) return 1;
     return 0;
 }
 
-void *pcap_thread_fn(void *arg) {
-    struct cfg *cfg = arg;
-    pcap_start_for_iface_threaded(cfg->iface);
-    return NULL;
+static int has_client(const struct cfg *cfg, uint32_t ip) {
+    for (int i = 0; i < cfg->client_count; i++)
+        if (cfg->clients[i] == ip) return 1;
+    return 0;
 }
 
-void *flush_thread_fn(void *arg) {
-    struct cfg *cfg = arg;
-    int interval = cfg->flush_interval;
-    while (running) {
-        sleep(interval);
-
-        time_t now = time(NULL);
-        uint64_t kernel_rx = 0, kernel_tx = 0;
-        struct ip_record ips[MAX_IP_ENTRIES];
-        int ipn = 0;
-        // snapshot and clear
-        ipacct_snapshot_and_clear(&kernel_rx, &kernel_tx, ips, &ipn);
-
-        // append to storage
-        if (kernel_rx == 0 && kernel_tx == 0 && ipn == 0) continue; // nothing to write
-        if (storage_append_daily(cfg->root_dir, cfg->iface, (uint32_t)now,
-                                 kernel_rx, kernel_tx, (uint16_t)ipn,
-                                 ips, sizeof(struct ip_record)*ipn) != 0) {
-            fprintf(stderr, "storage append failed\n");
+int collector_init(struct cfg *cfg) {
+    // init global structures: per-iface slots, prefixes, fsync policy
+    cur_cfg = *cfg;
+    ipacct_init();
+    ipacct_set_prefixes(cfg->prefixes, cfg->prefix_count);
+    if (ipacct_set_flow_entries(cfg->flow_entries) != 0) {
+        fprintf(stderr, "[collector] cannot allocate flow tables\n");
+        return -1;
+    }
+    storage_set_fsync(cfg->fsync_mode);
+    for (int i = 0; i < cfg->iface_count; i++) {
+        if (!ipacct_iface_add(cfg->ifaces[i])) return -1;
+    }
+    quota_configure(cfg);
+    if (quota_load(cfg->root_dir, cfg) != 0) return -1;
+    return 0;
+}
+
+/* ---------- Flushing ---------- */
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ip_record *flush_buf;   // under flush_lock
+static int flush_cap;
+static struct flow_record *flow_buf;
+static int flow_cap;
+
+static void flush_iface(struct iface_counters *ic, const char *name,
+                        const char *root_dir, time_t now) {
+    pthread_mutex_lock(&flush_lock);
+    if (handed_over) {
+        pthread_mutex_unlock(&flush_lock);
+        return;
+    }
+    uint64_t kernel_rx = 0, kernel_tx = 0;
+    // snapshot and clear
+    int ipn = ipacct_snapshot_and_clear(ic, &kernel_rx, &kernel_tx, &flush_buf, &flush_cap);
+    int nflows = ipacct_snapshot_flows(ic, &flow_buf, &flow_cap);
+
+    // append to storage
+    if (kernel_rx || kernel_tx || ipn || nflows) {
+        if (storage_append_daily_flows(root_dir, name, (uint32_t)now,
+                                       kernel_rx, kernel_tx, (uint16_t)ipn,
+                                       flush_buf, sizeof(struct ip_record)*ipn,
+                                       nflows, flow_buf) != 0) {
+            fprintf(stderr, "storage append failed (%s)\n", name);
+            metrics_note_flush(0);
         } else {
-            printf("flushed %u: kernel_rx=%lu kernel_tx=%lu ipn=%d\n",
-                   (unsigned)now, kernel_rx, kernel_tx, ipn);
+            metrics_note_flush(1);
+            quota_account((uint32_t)now, flush_buf, ipn);
+            printf("flushed %s %u: kernel_rx=%lu kernel_tx=%lu ipn=%d\n",
+                   name, (unsigned)now, kernel_rx, kernel_tx, ipn);
         }
     }
-    // final flush before exit
+    pthread_mutex_unlock(&flush_lock);
+}
+
+static void flush_all(void) {
+    if (handed_over) return;
+    char root_dir[256];
+    collector_root_dir(root_dir, sizeof(root_dir));
     time_t now = time(NULL);
-    uint64_t kernel_rx = 0, kernel_tx = 0;
-    struct ip_record ips[MAX_IP_ENTRIES];
-    int ipn = 0;
-    ipacct_snapshot_and_clear(&kernel_rx, &kernel_tx, ips, &ipn);
-    if (kernel_rx || kernel_tx || ipn) {
-        storage_append_daily(cfg->root_dir, cfg->iface, (uint32_t)now,
-                             kernel_rx, kernel_tx, (uint16_t)ipn,
-                             ips, sizeof(struct ip_record)*ipn);
+    for (int i = 0; i < MAX_IFACES; i++) {
+        struct iface_counters *ic = &g_ifaces[i];
+        char name[MAX_IFACE_NAME];
+        pthread_mutex_lock(&ic->lock);
+        int in_use = ic->in_use;
+        memcpy(name, ic->name, sizeof(name));
+        pthread_mutex_unlock(&ic->lock);
+        if (in_use) flush_iface(ic, name, root_dir, now);
     }
+    if (quota_checkpoint(root_dir) != 0)
+        fprintf(stderr, "[collector] cannot write %s/.quota\n", root_dir);
+}
+
+void *flush_thread_fn(void *arg) {
+    (void)arg;
+    time_t last = time(NULL);
+    while (running) {
+        // tick every second so a reloaded interval applies right away
+        sleep(1);
+        if (time(NULL) - last < flush_interval()) continue;
+        last = time(NULL);
+        flush_all();
+    }
+    // final flush before exit, unless another daemon took the counters
+    flush_all();
     return NULL;
 }
 
-int collector_run(struct cfg *cfg) {
+/* ---------- Retention ---------- */
+
+#define RETENTION_PERIOD 3600   // seconds between passes
+
+static volatile sig_atomic_t retention_due = 1;   // first pass right after startup
+
+/* Downsampling, the disk budget and day indexes run here, off the flush
+ * path: the first pass over a long history can take a while. */
+static void *retention_thread_fn(void *arg) {
+    (void)arg;
+    time_t last = 0;
+    while (running) {
+        sleep(1);
+        if (!retention_due && time(NULL) - last < RETENTION_PERIOD) continue;
+        retention_due = 0;
+        last = time(NULL);
+
+        pthread_mutex_lock(&cfg_lock);
+        char root_dir[256];
+        snprintf(root_dir, sizeof(root_dir), "%s", cur_cfg.root_dir);
+        int full = cur_cfg.retain_full, hourly = cur_cfg.retain_hourly;
+        uint64_t budget = cur_cfg.disk_budget;
+        pthread_mutex_unlock(&cfg_lock);
+        if (full || hourly || budget) retention_run(root_dir, full, hourly, budget, &running);
+        // after retention: index what it rewrote, skip what it deleted
+        if (running) dayindex_update(root_dir, &running);
+    }
+    return NULL;
+}
+
+/* ---------- Reload ---------- */
+
+/* Re-read the config file and apply it. Intervals, prefixes, clients,
+ * quotas, the flow table size, retention, fsync policy and the storage
+ * root change in place; capture handles are only reopened for interfaces
+ * that were added, or all of them when ring_size, sample_rate or
+ * queue_size changed. Dropped interfaces get a last flush first. If the
+ * file does not parse, nothing changes. */
+static void collector_reload(void) {
+    if (!cur_cfg.path[0]) {
+        fprintf(stderr, "[collector] SIGHUP: started without a config file, nothing to reload\n");
+        return;
+    }
+    struct cfg next;
+    if (config_load(cur_cfg.path, &next) != 0) {
+        fprintf(stderr, "[collector] SIGHUP: %s invalid, keeping current configuration\n",
+                cur_cfg.path);
+        return;
+    }
+    struct cfg old = cur_cfg;
+
+    if (strcmp(next.control_sock, old.control_sock) != 0 || next.metrics_port != old.metrics_port)
+        fprintf(stderr, "[collector] control_socket/metrics_port changes need a restart\n");
+    memcpy(next.control_sock, old.control_sock, sizeof(next.control_sock));
+    next.metrics_port = old.metrics_port;
+    int reopen_all = next.ring_size != old.ring_size || next.sample_rate != old.sample_rate ||
+                     next.queue_size != old.queue_size;
+
+    // stop captures that go away or need reopening
+    char root_dir[256];
+    collector_root_dir(root_dir, sizeof(root_dir));
+    for (int i = 0; i < old.iface_count; i++) {
+        const char *name = old.ifaces[i];
+        int keep = has_iface(&next, name);
+        if (keep && !reopen_all) continue;
+        capture_stop(name);
+        if (keep) continue;
+        struct iface_counters *ic = ipacct_iface_find(name);
+        if (!ic) continue;
+        flush_iface(ic, name, root_dir, time(NULL));
+        ipacct_iface_remove(ic);
+        fprintf(stderr, "[collector] Stopped monitoring %s\n", name);
+    }
+
+    // counts taken at the old sampling rate, or held by flow tables about
+    // to be replaced, go out first
+    if (next.sample_rate != old.sample_rate || next.flow_entries != old.flow_entries)
+        flush_all();
+
+    // in-place settings
+    if (next.flow_entries != old.flow_entries) {
+        if (ipacct_set_flow_entries(next.flow_entries) != 0) {
+            fprintf(stderr, "[collector] cannot allocate flow tables, keeping flow_entries = %d\n",
+                    old.flow_entries);
+            next.flow_entries = old.flow_entries;
+        }
+    }
+    pthread_mutex_lock(&cfg_lock);
+    cur_cfg = next;
+    pthread_mutex_unlock(&cfg_lock);
+    if (next.retain_full != old.retain_full || next.retain_hourly != old.retain_hourly ||
+        next.disk_budget != old.disk_budget || strcmp(next.root_dir, old.root_dir) != 0)
+        retention_due = 1;
+    ipacct_set_prefixes(next.prefixes, next.prefix_count);
+    storage_set_fsync(next.fsync_mode);
+    quota_configure(&next);
+    // turning quotas on, or moving the root, needs the month so far;
+    // hold off flushes so no record is both replayed and accounted
+    if ((next.quota_count && !old.quota_count) || strcmp(next.root_dir, old.root_dir) != 0) {
+        pthread_mutex_lock(&flush_lock);
+        quota_load(next.root_dir, &next);
+        pthread_mutex_unlock(&flush_lock);
+    }
+
+    uint32_t gone[MAX_CLIENTS];
+    int ngone = 0;
+    for (int i = 0; i < old.client_count; i++)
+        if (!has_client(&next, old.clients[i])) gone[ngone++] = old.clients[i];
+    if (ngone) ipacct_del_clients(gone, ngone);
+    if (next.client_count) ipacct_add_clients(next.clients, next.client_count);
+
+    // (re)open captures
+    for (int i = 0; i < next.iface_count; i++) {
+        const char *name = next.ifaces[i];
+        int existed = has_iface(&old, name);
+        if (existed && !reopen_all) continue;
+        struct iface_counters *ic = existed ? ipacct_iface_find(name) : ipacct_iface_add(name);
+        if (!ic) {
+            fprintf(stderr, "[collector] no free slot for %s\n", name);
+            continue;
+        }
+        if (capture_start(ic, next.ring_size, next.sample_rate, next.queue_size) != 0)
+            fprintf(stderr, "[collector] capture on %s failed, kernel totals only\n", name);
+        else if (!existed)
+            fprintf(stderr, "[collector] Started monitoring %s\n", name);
+    }
+    fprintf(stderr, "[collector] Reloaded %s\n", next.path);
+}
+
+/* ---------- Handover ---------- */
+
+#define HANDOVER_LEAD_US 500000     // the cut, ahead of the WINDOW message
+#define HANDOVER_SLACK_US 100000    // then wait for packets stamped just before it
+#define HANDOVER_TIMEOUT_MS 5000
+
+static pthread_t poll_thread, control_thread, metrics_thread;
+static int poller_running;
+
+static uint64_t now_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);   // the clock pcap stamps packets with
+    return (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+}
+
+static void start_captures(void) {
+    for (int i = 0; i < cur_cfg.iface_count; i++) {
+        struct iface_counters *ic = ipacct_iface_find(cur_cfg.ifaces[i]);
+        if (!ic || capture_start(ic, cur_cfg.ring_size, cur_cfg.sample_rate,
+                                   cur_cfg.queue_size) != 0)
+            fprintf(stderr, "[collector] capture on %s failed, kernel totals only\n",
+                    cur_cfg.ifaces[i]);
+    }
+}
+
+/* Old daemon: hand the counters over to the daemon waiting on
+ * <control_socket>.handover (see handover.c). On success the caller
+ * exits without a last flush; on failure counting goes on here. */
+static int collector_handover(void) {
+    int fd = handover_connect(cur_cfg.control_sock);
+    if (fd < 0) return -1;
+    if (handover_recv(fd, HANDOVER_READY, NULL, NULL, NULL, NULL, NULL,
+                      HANDOVER_TIMEOUT_MS) != 0) {
+        fprintf(stderr, "[collector] handover: new daemon not ready\n");
+        close(fd);
+        return -1;
+    }
+
+    // from T on, packets are the new daemon's
+    uint64_t cut = now_us() + HANDOVER_LEAD_US;
+    capture_set_window(0, cut);
+    if (handover_send(fd, HANDOVER_WINDOW, cut, NULL, 0, NULL, 0) != 0 ||
+        handover_recv(fd, HANDOVER_WINDOW_OK, NULL, NULL, NULL, NULL, NULL,
+                      HANDOVER_TIMEOUT_MS) != 0) {
+        fprintf(stderr, "[collector] handover: cut refused\n");
+        capture_set_window(0, CAPTURE_NEVER);
+        close(fd);
+        return -1;
+    }
+    uint64_t now = now_us();
+    if (now < cut + HANDOVER_SLACK_US) usleep(cut + HANDOVER_SLACK_US - now);
+
+    // capture_stop() drains what the kernel still holds; the poller last
+    // saved .last_counts for what it added, where the new one picks up
+    for (int i = 0; i < cur_cfg.iface_count; i++) capture_stop(cur_cfg.ifaces[i]);
+    if (poller_running) {
+        pthread_cancel(poll_thread);
+        pthread_join(poll_thread, NULL);
+        poller_running = 0;
+    }
+
+    pthread_mutex_lock(&flush_lock);
+    int rc = handover_send_state(fd, control_listen_fd(), metrics_listen_fd(),
+                                 cur_cfg.metrics_port);
+    // the new daemon holds the control socket from here; removing its
+    // file is up to whichever of us exits last owning it
+    if (rc == 0) {
+        control_disown(1);
+        rc = handover_recv(fd, HANDOVER_ACK, NULL, NULL, NULL, NULL, NULL, HANDOVER_TIMEOUT_MS);
+    }
+    if (rc == 0) {
+        handed_over = 1;
+        // stop answering on sockets the new daemon now serves
+        pthread_cancel(control_thread);
+        pthread_cancel(metrics_thread);
+    } else {
+        control_disown(0);
+    }
+    pthread_mutex_unlock(&flush_lock);
+    close(fd);
+    if (rc == 0) {
+        fprintf(stderr, "[collector] handed over, exiting\n");
+        running = 0;
+        return 0;
+    }
+
+    // without an ACK the new daemon does not start; count on here (the
+    // packets between the cut and now are lost)
+    fprintf(stderr, "[collector] handover failed, resuming\n");
+    capture_set_window(0, CAPTURE_NEVER);
+    start_captures();
+    poller_running = pthread_create(&poll_thread, NULL, poller_thread_fn, &cur_cfg) == 0;
+    return -1;
+}
+
+/* New daemon: captures are open and count nothing yet. Ask the daemon
+ * on control_socket to hand over, and take its counters and sockets.
+ * No daemon there means a plain start. Returns -1 if a handover began
+ * and failed; this daemon must then exit without flushing. */
+static int collector_takeover(void) {
+    const char *sock = cur_cfg.control_sock;
+    char path[256];
+    if (handover_path(sock, path, sizeof(path)) != 0) return -1;
+    int lfd = handover_listen(sock);
+    if (lfd < 0) return -1;
+    int rc = handover_request(sock);
+    if (rc != 0) {
+        close(lfd);
+        unlink(path);
+        if (rc < 0) return -1;
+        fprintf(stderr, "[collector] no daemon on %s, starting afresh\n", sock);
+        capture_set_window(0, CAPTURE_NEVER);
+        return 0;
+    }
+    int fd = handover_accept(lfd, HANDOVER_TIMEOUT_MS);
+    close(lfd);
+    unlink(path);
+    if (fd < 0) {
+        fprintf(stderr, "[collector] handover: %s did not connect\n", sock);
+        return -1;
+    }
+
+    uint64_t cut = 0;
+    if (handover_send(fd, HANDOVER_READY, 0, NULL, 0, NULL, 0) != 0 ||
+        handover_recv(fd, HANDOVER_WINDOW, &cut, NULL, NULL, NULL, NULL,
+                      HANDOVER_TIMEOUT_MS) != 0) {
+        close(fd);
+        return -1;
+    }
+    // packets before the window opened here are the old daemon's only
+    // if the cut is still ahead
+    capture_set_window(cut, CAPTURE_NEVER);
+    if (now_us() >= cut) {
+        fprintf(stderr, "[collector] handover: cut already passed\n");
+        handover_send(fd, HANDOVER_ABORT, 0, NULL, 0, NULL, 0);
+        close(fd);
+        return -1;
+    }
+    int cfd, mfd, mport;
+    if (handover_send(fd, HANDOVER_WINDOW_OK, 0, NULL, 0, NULL, 0) != 0 ||
+        handover_recv_state(fd, &cfd, &mfd, &mport,
+                            HANDOVER_TIMEOUT_MS + HANDOVER_LEAD_US / 1000) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // interfaces the old daemon monitored and this one does not get
+    // their last records written here
+    for (int i = 0; i < MAX_IFACES; i++) {
+        struct iface_counters *ic = &g_ifaces[i];
+        char name[MAX_IFACE_NAME];
+        pthread_mutex_lock(&ic->lock);
+        int in_use = ic->in_use;
+        memcpy(name, ic->name, sizeof(name));
+        pthread_mutex_unlock(&ic->lock);
+        if (!in_use || has_iface(&cur_cfg, name)) continue;
+        flush_iface(ic, name, cur_cfg.root_dir, time(NULL));
+        ipacct_iface_remove(ic);
+    }
+    // the old daemon's last flushes happened after collector_init()
+    quota_load(cur_cfg.root_dir, &cur_cfg);
+
+    rc = handover_send(fd, HANDOVER_ACK, 0, NULL, 0, NULL, 0);
+    close(fd);
+    if (rc != 0) {
+        // the old daemon keeps both sockets and the control socket file
+        if (cfd >= 0) close(cfd);
+        if (mfd >= 0) close(mfd);
+        return -1;
+    }
+    if (cfd >= 0) control_adopt_fd(cfd);
+    if (mfd >= 0) metrics_adopt_fd(mfd, mport);
+    fprintf(stderr, "[collector] took over from the daemon on %s\n", sock);
+    return 0;
+}
+
+/* With takeover set, start next to a running daemon and take over from
+ * it (see handover.c). */
+int collector_run(struct cfg *cfg, int takeover) {
+    (void)cfg;
 
     signal(SIGINT, sigint_handler);
     signal(SIGTERM, sigint_handler);
+    signal(SIGHUP, sighup_handler);
+    signal(SIGUSR2, sigusr2_handler);
+
+    if (cur_cfg.client_count) ipacct_add_clients(cur_cfg.clients, cur_cfg.client_count);
+
+    if (takeover) capture_set_window(CAPTURE_NEVER, CAPTURE_NEVER);
+    start_captures();
+    if (takeover && collector_takeover() != 0) {
+        fprintf(stderr, "[collector] takeover failed, the running daemon keeps counting\n");
+        for (int i = 0; i < cur_cfg.iface_count; i++) capture_stop(cur_cfg.ifaces[i]);
+        return -1;
+    }
+
+    pthread_t flush_thread, retention_thread;
+    poller_running = pthread_create(&poll_thread, NULL, poller_thread_fn, &cur_cfg) == 0;
+    pthread_create(&control_thread, NULL, control_thread_fn, &cur_cfg);
+    pthread_create(&flush_thread, NULL, flush_thread_fn, &cur_cfg);
+    pthread_create(&metrics_thread, NULL, metrics_thread_fn, &cur_cfg);
+    pthread_create(&retention_thread, NULL, retention_thread_fn, NULL);
+
+    while (running) {
+        sleep(1);
+        if (reload_pending) {
+            reload_pending = 0;
+            collector_reload();
+        }
+        if (handover_pending) {
+            handover_pending = 0;
+            collector_handover();
+        }
+    }
 
-    // for testing add a local IP (replace with your local IP)
-    uint32_t myip;
-    inet_pton(AF_INET, "172.16.3.66", &myip);
-    ipacct_add_client(myip);
-    /*ipacct_add_local(cfg->iface, myip);*/
-
-    pthread_t pcap_thread, poll_thread, flush_thread, control_thread;
-    pthread_create(&pcap_thread, NULL, pcap_thread_fn, cfg);
-    pthread_create(&poll_thread, NULL, poller_thread_fn, cfg);
-    pthread_create(&control_thread, NULL, control_thread_fn, cfg);
-    pthread_create(&flush_thread, NULL, flush_thread_fn, cfg);
-
-    while (running) sleep(1);
-
-    // attempt graceful shutdown: stop pcap loop by breaking pcap_loop isn't trivial here,
-    // but program exiting will close handle; join threads
-    pthread_cancel(pcap_thread); // best-effort
-    pthread_join(pcap_thread, NULL);
-    pthread_cancel(poll_thread);
-    pthread_join(poll_thread, NULL);
+    // stop capturing first so the final flush sees every counted packet
+    for (int i = 0; i < cur_cfg.iface_count; i++) capture_stop(cur_cfg.ifaces[i]);
+    if (poller_running) {
+        pthread_cancel(poll_thread);
+        pthread_join(poll_thread, NULL);
+    }
     pthread_join(flush_thread, NULL);
-    pthread_cancel(control_thread);
+    pthread_join(retention_thread, NULL);   // stops between files
+    pthread_cancel(control_thread);         // no-op after a handover
     pthread_join(control_thread, NULL);
+    pthread_cancel(metrics_thread);
+    pthread_join(metrics_thread, NULL);
+
+    histo_dump(stderr);
 
     return 0;
 }
@@ -0,0 +1,253 @@
+// src/config.c - netacct.conf parser
+//
+// One "key = value" per line; '#' starts a comment. `interface`, `prefix`
+// and `client` may repeat (or take a comma-separated list), as may
+// `quota`, one rule per line. Unknown keys and bad values are errors so
+// that a typo never silently reverts a setting to its default on reload.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "netacct.h"
+
+#define CONFIG_LINE_MAX 1024
+
+void config_defaults(struct cfg *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    snprintf(cfg->ifaces[0], sizeof(cfg->ifaces[0]), "%s", "enp0s3");
+    cfg->iface_count = 1;
+    cfg->poll_interval = 2;
+    cfg->flush_interval = 10;
+    cfg->ring_size = 0;
+    cfg->sample_rate = 1;
+    cfg->queue_size = QUEUE_SIZE_DEFAULT;
+    cfg->fsync_mode = FSYNC_ALWAYS;
+    snprintf(cfg->root_dir, sizeof(cfg->root_dir), "%s", "./data");
+    snprintf(cfg->control_sock, sizeof(cfg->control_sock), "%s", "/var/run/netacct.sock");
+    cfg->metrics_port = 9477;
+    cfg->quota_thresholds[0] = 80;
+    cfg->quota_thresholds[1] = 100;
+    cfg->quota_threshold_count = 2;
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) s++;
+    char *e = s + strlen(s);
+    while (e > s && isspace((unsigned char)e[-1])) *--e = '\0';
+    return s;
+}
+
+static int parse_int(const char *v, int min, int max, int *out) {
+    char *end;
+    long n = strtol(v, &end, 10);
+    // allow k/m suffixes for sizes
+    if (*end == 'k' || *end == 'K') { n *= 1024; end++; }
+    else if (*end == 'm' || *end == 'M') { n *= 1024 * 1024; end++; }
+    if (end == v || *end || n < min || n > max) return -1;
+    *out = (int)n;
+    return 0;
+}
+
+static int parse_prefix(const char *v, struct prefix *out) {
+    char buf[32];
+    int bits = 32;
+    snprintf(buf, sizeof(buf), "%s", v);
+    char *slash = strchr(buf, '/');
+    if (slash) {
+        *slash = '\0';
+        if (parse_int(slash + 1, 0, 32, &bits) != 0) return -1;
+    }
+    uint32_t addr;
+    if (inet_pton(AF_INET, buf, &addr) != 1) return -1;
+    out->mask = bits ? htonl(0xffffffffu << (32 - bits)) : 0;
+    out->net = addr & out->mask;
+    return 0;
+}
+
+/* Byte count with optional K/M/G/T (powers of 1024). */
+static int parse_bytes(const char *v, uint64_t *out) {
+    char *end;
+    unsigned long long n = strtoull(v, &end, 10);
+    if (end == v || *v == '-') return -1;
+    int shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    case 't': case 'T': shift = 40; end++; break;
+    }
+    if (*end || n == 0 || n > (UINT64_MAX >> shift)) return -1;
+    *out = (uint64_t)n << shift;
+    return 0;
+}
+
+/* quota = <default|ip|prefix> <day|month> <bytes> */
+static int parse_quota(struct cfg *cfg, char *v) {
+    if (cfg->quota_count >= MAX_QUOTAS) return -1;
+    char *who = strtok(v, " \t");
+    char *period = strtok(NULL, " \t");
+    char *limit = strtok(NULL, " \t");
+    if (!who || !period || !limit || strtok(NULL, " \t")) return -1;
+
+    struct quota_rule q = {0};
+    if (strcmp(who, "default") == 0) q.is_default = 1;
+    else if (parse_prefix(who, &q.match) != 0) return -1;
+    if (strcmp(period, "day") == 0) q.period = QUOTA_DAY;
+    else if (strcmp(period, "month") == 0) q.period = QUOTA_MONTH;
+    else return -1;
+    if (parse_bytes(limit, &q.limit) != 0) return -1;
+    cfg->quotas[cfg->quota_count++] = q;
+    return 0;
+}
+
+static int parse_thresholds(struct cfg *cfg, char *v) {
+    int n = 0;
+    for (char *item = strtok(v, ","); item; item = strtok(NULL, ",")) {
+        item = trim(item);
+        if (!*item) continue;
+        if (n >= MAX_QUOTA_THRESHOLDS) return -1;
+        if (parse_int(item, 1, 1000, &cfg->quota_thresholds[n]) != 0) return -1;
+        if (n && cfg->quota_thresholds[n] <= cfg->quota_thresholds[n - 1]) return -1;
+        n++;
+    }
+    if (!n) return -1;
+    cfg->quota_threshold_count = n;
+    return 0;
+}
+
+/* Retention ages: 0 (off) or at least 2 days, so today's and
+ * yesterday's files, which the collector still writes, are never
+ * rewritten. */
+static int parse_days(const char *v, int *out) {
+    int n;
+    if (parse_int(v, 0, 36500, &n) != 0 || n == 1) return -1;
+    *out = n;
+    return 0;
+}
+
+static int set_str(char *dst, size_t n, const char *v) {
+    if (!*v || strlen(v) >= n) return -1;
+    memcpy(dst, v, strlen(v) + 1);
+    return 0;
+}
+
+/* Apply one item of a list-valued key. */
+static int add_item(struct cfg *cfg, const char *key, const char *v) {
+    if (strcmp(key, "interface") == 0) {
+        if (cfg->iface_count >= MAX_IFACES) return -1;
+        for (int i = 0; i < cfg->iface_count; i++)
+            if (strcmp(cfg->ifaces[i], v) == 0) return 0;
+        if (set_str(cfg->ifaces[cfg->iface_count], MAX_IFACE_NAME, v) != 0) return -1;
+        cfg->iface_count++;
+        return 0;
+    }
+    if (strcmp(key, "prefix") == 0) {
+        if (cfg->prefix_count >= MAX_PREFIXES) return -1;
+        return parse_prefix(v, &cfg->prefixes[cfg->prefix_count++]);
+    }
+    // client
+    if (cfg->client_count >= MAX_CLIENTS) return -1;
+    return inet_pton(AF_INET, v, &cfg->clients[cfg->client_count++]) == 1 ? 0 : -1;
+}
+
+static int set_key(struct cfg *cfg, const char *key, char *v) {
+    if (strcmp(key, "interface") == 0 || strcmp(key, "prefix") == 0 ||
+        strcmp(key, "client") == 0) {
+        for (char *item = strtok(v, ","); item; item = strtok(NULL, ",")) {
+            item = trim(item);
+            if (*item && add_item(cfg, key, item) != 0) return -1;
+        }
+        return 0;
+    }
+    if (strcmp(key, "poll_interval") == 0) return parse_int(v, 1, 3600, &cfg->poll_interval);
+    if (strcmp(key, "flush_interval") == 0) return parse_int(v, 1, 86400, &cfg->flush_interval);
+    if (strcmp(key, "ring_size") == 0) return parse_int(v, 0, 1 << 30, &cfg->ring_size);
+    if (strcmp(key, "sample_rate") == 0) return parse_int(v, 1, 65536, &cfg->sample_rate);
+    if (strcmp(key, "queue_size") == 0) return parse_int(v, 1024, 1 << 24, &cfg->queue_size);
+    if (strcmp(key, "root_dir") == 0) return set_str(cfg->root_dir, sizeof(cfg->root_dir), v);
+    if (strcmp(key, "control_socket") == 0)
+        return set_str(cfg->control_sock, sizeof(cfg->control_sock), v);
+    if (strcmp(key, "metrics_port") == 0) return parse_int(v, 0, 65535, &cfg->metrics_port);
+    if (strcmp(key, "flow_entries") == 0)
+        return parse_int(v, 0, MAX_FLOW_ENTRIES, &cfg->flow_entries);
+    if (strcmp(key, "retain_full") == 0) return parse_days(v, &cfg->retain_full);
+    if (strcmp(key, "retain_hourly") == 0) return parse_days(v, &cfg->retain_hourly);
+    if (strcmp(key, "disk_budget") == 0) {
+        if (strcmp(v, "0") == 0) {
+            cfg->disk_budget = 0;
+            return 0;
+        }
+        return parse_bytes(v, &cfg->disk_budget);
+    }
+    if (strcmp(key, "quota") == 0) return parse_quota(cfg, v);
+    if (strcmp(key, "quota_thresholds") == 0) return parse_thresholds(cfg, v);
+    if (strcmp(key, "quota_hook") == 0) return set_str(cfg->quota_hook, sizeof(cfg->quota_hook), v);
+    if (strcmp(key, "fsync") == 0) {
+        if (strcmp(v, "always") == 0) cfg->fsync_mode = FSYNC_ALWAYS;
+        else if (strcmp(v, "data") == 0) cfg->fsync_mode = FSYNC_DATA;
+        else if (strcmp(v, "never") == 0) cfg->fsync_mode = FSYNC_NEVER;
+        else return -1;
+        return 0;
+    }
+    return -2;
+}
+
+/* Load path into *cfg on top of the defaults. On error *cfg is left
+ * untouched and -1 is returned, so a bad edit followed by SIGHUP keeps
+ * the running configuration. */
+int config_load(const char *path, struct cfg *cfg) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "[config] cannot open %s\n", path);
+        return -1;
+    }
+
+    struct cfg next;
+    config_defaults(&next);
+    next.iface_count = 0;   // the default only applies if none are listed
+    snprintf(next.path, sizeof(next.path), "%s", path);
+
+    char line[CONFIG_LINE_MAX];
+    int lineno = 0, rc = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *s = trim(line);
+        if (!*s) continue;
+
+        char *eq = strchr(s, '=');
+        if (!eq) {
+            fprintf(stderr, "[config] %s:%d: expected key = value\n", path, lineno);
+            rc = -1;
+            continue;
+        }
+        *eq = '\0';
+        char *key = trim(s);
+        char *val = trim(eq + 1);
+        int r = set_key(&next, key, val);
+        if (r == -2) {
+            fprintf(stderr, "[config] %s:%d: unknown key '%s'\n", path, lineno, key);
+            rc = -1;
+        } else if (r != 0) {
+            fprintf(stderr, "[config] %s:%d: bad value for '%s'\n", path, lineno, key);
+            rc = -1;
+        }
+    }
+    fclose(f);
+
+    if (rc == 0 && next.iface_count == 0) {
+        fprintf(stderr, "[config] %s: no interface configured\n", path);
+        rc = -1;
+    }
+    if (rc == 0 && next.retain_full && next.retain_hourly &&
+        next.retain_hourly <= next.retain_full) {
+        fprintf(stderr, "[config] %s: retain_hourly must be larger than retain_full\n", path);
+        rc = -1;
+    }
+    if (rc == 0) *cfg = next;
+    return rc;
+}
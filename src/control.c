@@ -1,55 +1,387 @@
 // src/control.c
+//
+// Control socket. Clients may keep the connection open and send any number
+// of newline-delimited JSON commands; each gets one JSON reply line:
+//   {"action":"add","ip":"10.0.0.5"}
+//   {"action":"del","ips":["10.0.0.5","10.0.0.6"]}
+//   -> {"ok":true,"action":"del","count":2,"changed":1}
+// A last command without a trailing newline is still run at EOF, so
+// one-shot clients like hooks/netacct-dnsmasq-hook.sh keep working.
+//
+// Live queries read a snapshot of the in-memory counters (unflushed
+// deltas and today's running totals), no data files are touched:
+//   {"action":"stats"}  {"action":"top","n":10}  {"action":"ip","ip":"..."}
+// and, in NETACCT_HISTO builds, {"action":"histo"} for stage latencies.
+// Replies list each monitored interface with its own "ips"; an optional
+// "iface":"eth0" restricts them to one interface.
+//
+// {"action":"quota"} (optionally with "ip") lists day/month usage against
+// the configured quotas. After {"action":"subscribe"} the connection also
+// receives event lines as they happen, e.g. quota threshold crossings:
+//   {"event":"quota","ip":"...","period":"day","threshold":80,...}
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <cjson/cJSON.h>
 
 #include "netacct.h"
 
-#define CONTROL_SOCK_PATH "/var/run/netacct.sock"
+#define CONTROL_MAX_CONNS 1024
+#define CONTROL_LINE_MAX  (64 * 1024)  // one command, bulk arrays included
+#define CONTROL_MAX_BATCH 4096         // IPs per add/del command
+#define CONTROL_MAX_EVENTS 1024        // queued for subscribers
+#define CONTROL_SUB_BACKLOG (1 << 20)  // unsent bytes before a slow subscriber misses events
+#define CONTROL_OUT_MAX (4 << 20)      // unsent reply bytes before further commands wait
 
+struct conn {
+    int fd;
+    char *in;             // grows up to CONTROL_LINE_MAX
+    size_t in_len;
+    size_t in_cap;
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    size_t out_cap;
+    int eof;
+    int subscribed;
+};
 
-static void handle_command(const char *line) {
-    cJSON *root = cJSON_Parse(line);
-    if (!root) {
-        fprintf(stderr, "[control] JSON parse error\n");
+static void reply(struct conn *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void reply(struct conn *c, const char *fmt, ...) {
+    for (;;) {
+        size_t room = c->out_cap - c->out_len;
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(c->out + c->out_len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < room) {
+            c->out_len += n;
+            return;
+        }
+        size_t cap = c->out_cap ? c->out_cap * 2 : 4096;
+        while (cap - c->out_len <= (size_t)n) cap *= 2;
+        char *nb = realloc(c->out, cap);
+        if (!nb) return;
+        c->out = nb;
+        c->out_cap = cap;
+    }
+}
+
+static void reply_error(struct conn *c, const char *msg) {
+    reply(c, "{\"ok\":false,\"error\":\"%s\"}\n", msg);
+}
+
+/* Collect "ip" and/or "ips":[...] into out[]. Returns the count, or -1
+ * with *err set. */
+static int collect_ips(const cJSON *root, uint32_t *out, const char **err) {
+    int n = 0;
+    const cJSON *ip_item  = cJSON_GetObjectItemCaseSensitive(root, "ip");
+    const cJSON *ips_item = cJSON_GetObjectItemCaseSensitive(root, "ips");
+
+    if (ip_item) {
+        struct in_addr addr;
+        if (!cJSON_IsString(ip_item) || inet_aton(ip_item->valuestring, &addr) == 0) {
+            *err = "invalid ip";
+            return -1;
+        }
+        out[n++] = addr.s_addr;
+    }
+    if (ips_item) {
+        if (!cJSON_IsArray(ips_item)) {
+            *err = "ips must be an array";
+            return -1;
+        }
+        const cJSON *it;
+        cJSON_ArrayForEach(it, ips_item) {
+            struct in_addr addr;
+            if (!cJSON_IsString(it) || inet_aton(it->valuestring, &addr) == 0) {
+                *err = "invalid ip in ips";
+                return -1;
+            }
+            if (n == CONTROL_MAX_BATCH) {
+                *err = "too many ips";
+                return -1;
+            }
+            out[n++] = addr.s_addr;
+        }
+    }
+    if (n == 0) {
+        *err = "missing ip/ips";
+        return -1;
+    }
+    return n;
+}
+
+/* ---------- Live queries ---------- */
+
+static struct ip_view *view_buf;
+static int view_cap;
+static const struct ip_view **pick_buf;
+static int pick_cap;
+
+/* name as the body of a JSON string: '\' and '"' get a backslash, other
+ * control characters a \u00XX escape. Interface names come from the
+ * config and may hold any of them. */
+static void json_escape(char *out, size_t n, const char *name) {
+    size_t o = 0;
+    for (; *name && o + 7 < n; name++) {
+        unsigned char c = (unsigned char)*name;
+        if (c == '\\' || c == '"') {
+            out[o++] = '\\';
+            out[o++] = (char)c;
+        } else if (c < 0x20) {
+            o += (size_t)snprintf(out + o, n - o, "\\u%04x", c);
+        } else {
+            out[o++] = (char)c;
+        }
+    }
+    out[o] = '\0';
+}
+
+static void reply_ip(struct conn *c, const struct ip_view *v) {
+    char ipbuf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &v->ip, ipbuf, sizeof(ipbuf));
+    reply(c, "{\"ip\":\"%s\",\"rx_delta\":%" PRIu64 ",\"tx_delta\":%" PRIu64
+          ",\"rx_today\":%" PRIu64 ",\"tx_today\":%" PRIu64 "}",
+          ipbuf, v->rx_delta, v->tx_delta, v->rx_today, v->tx_today);
+}
+
+static uint64_t view_today(const struct ip_view *v) { return v->rx_today + v->tx_today; }
+
+/* The want heaviest clients of the day so far, heaviest first. The
+ * selection keeps a small sorted array, cheap for the N a dashboard asks. */
+static int pick_top(const struct ip_view **top, int n, int want) {
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        const struct ip_view *v = &view_buf[i];
+        if (k == want && view_today(v) <= view_today(top[k-1])) continue;
+        int j = k < want ? k++ : k - 1;
+        while (j > 0 && view_today(top[j-1]) < view_today(v)) {
+            top[j] = top[j-1];
+            j--;
+        }
+        top[j] = v;
+    }
+    return k;
+}
+
+/* Shared body of stats/top/ip: one object per interface (only the one
+ * named by "iface", if given) with its kernel counters and the selected
+ * clients: all of them (want == 0), the top want, or just ip. Returns the
+ * number of clients listed, or -1 if "iface" matched nothing; in both
+ * the 0 and -1 case the caller may discard the reply. */
+static int reply_live(struct conn *c, const cJSON *root, const char *action,
+                      int want, uint32_t ip) {
+    const cJSON *if_item = cJSON_GetObjectItemCaseSensitive(root, "iface");
+    const char *only = cJSON_IsString(if_item) ? if_item->valuestring : NULL;
+    int ifaces = 0, listed = 0;
+
+    reply(c, "{\"ok\":true,\"action\":\"%s\",\"day_start\":%" PRIu32 ",\"ifaces\":[",
+          action, (uint32_t)(time(NULL) - time(NULL) % 86400));
+    for (int i = 0; i < MAX_IFACES; i++) {
+        struct iface_view iv;
+        int n = ipacct_view_alloc(&g_ifaces[i], &iv, &view_buf, &view_cap);
+        if (n < 0 || (only && strcmp(only, iv.name) != 0)) continue;
+
+        int k = 0;
+        if (want > 0) {
+            if (want > pick_cap) {
+                const struct ip_view **nb = realloc(pick_buf, sizeof(*nb) * want);
+                if (!nb) continue;
+                pick_buf = nb;
+                pick_cap = want;
+            }
+            k = pick_top(pick_buf, n, want);
+        }
+
+        char name[MAX_IFACE_NAME * 6];
+        json_escape(name, sizeof(name), iv.name);
+        reply(c, "%s{\"name\":\"%s\",\"rx_delta\":%" PRIu64 ",\"tx_delta\":%" PRIu64
+              ",\"rx_today\":%" PRIu64 ",\"tx_today\":%" PRIu64 ",\"ips\":[",
+              ifaces++ ? "," : "", name, iv.rx_delta, iv.tx_delta, iv.rx_today, iv.tx_today);
+        int first = 1;
+        for (int j = 0; j < (want > 0 ? k : n); j++) {
+            const struct ip_view *v = want > 0 ? pick_buf[j] : &view_buf[j];
+            if (ip && v->ip != ip) continue;
+            if (!first) reply(c, ",");
+            reply_ip(c, v);
+            first = 0;
+            listed++;
+        }
+        reply(c, "]}");
+    }
+    reply(c, "]}\n");
+    return ifaces ? listed : -1;
+}
+
+/* {"action":"stats"}: every interface and every client. */
+static void cmd_stats(struct conn *c, const cJSON *root) {
+    size_t mark = c->out_len;
+    if (reply_live(c, root, "stats", 0, 0) < 0) {
+        c->out_len = mark;
+        reply_error(c, "unknown iface");
+    }
+}
+
+/* {"action":"top","n":N}: the N heaviest clients of each interface. */
+static void cmd_top(struct conn *c, const cJSON *root) {
+    const cJSON *n_item = cJSON_GetObjectItemCaseSensitive(root, "n");
+    int want = cJSON_IsNumber(n_item) ? n_item->valueint : 10;
+    if (want <= 0 || want > 1000) {
+        reply_error(c, "n must be 1..1000");
         return;
     }
+    size_t mark = c->out_len;
+    if (reply_live(c, root, "top", want, 0) < 0) {
+        c->out_len = mark;
+        reply_error(c, "unknown iface");
+    }
+}
 
-    cJSON *action_item = cJSON_GetObjectItemCaseSensitive(root, "action");
-    cJSON *ip_item     = cJSON_GetObjectItemCaseSensitive(root, "ip");
+/* {"action":"ip","ip":"a.b.c.d"}: one client, on every interface that
+ * counts it. */
+static void cmd_ip(struct conn *c, const cJSON *root) {
+    const cJSON *ip_item = cJSON_GetObjectItemCaseSensitive(root, "ip");
+    struct in_addr addr;
+    if (!cJSON_IsString(ip_item) || inet_aton(ip_item->valuestring, &addr) == 0 ||
+        addr.s_addr == 0) {
+        reply_error(c, "invalid ip");
+        return;
+    }
+    size_t mark = c->out_len;
+    int listed = reply_live(c, root, "ip", 0, addr.s_addr);
+    if (listed <= 0) {
+        c->out_len = mark;
+        reply_error(c, listed < 0 ? "unknown iface" : "unknown ip");
+    }
+}
 
-    if (!cJSON_IsString(action_item) || !cJSON_IsString(ip_item)) {
-        fprintf(stderr, "[control] Invalid JSON (missing fields)\n");
-        cJSON_Delete(root);
+/* {"action":"histo"}: latency percentiles per instrumented stage. */
+static void cmd_histo(struct conn *c) {
+    if (!histo_enabled()) {
+        reply_error(c, "built without NETACCT_HISTO");
         return;
     }
+    reply(c, "{\"ok\":true,\"action\":\"histo\",\"unit\":\"ns\",\"stages\":[");
+    for (int s = 0; s < HISTO_NSTAGES; s++) {
+        struct histo_summary hs;
+        histo_summary(s, &hs);
+        reply(c, "%s{\"stage\":\"%s\",\"count\":%" PRIu64 ",\"p50\":%" PRIu64
+              ",\"p90\":%" PRIu64 ",\"p99\":%" PRIu64 ",\"p999\":%" PRIu64
+              ",\"max\":%" PRIu64 "}",
+              s ? "," : "", hs.name, hs.count, hs.p50, hs.p90, hs.p99, hs.p999, hs.max);
+    }
+    reply(c, "]}\n");
+}
 
-    const char *action = action_item->valuestring;
-    const char *ipstr  = ip_item->valuestring;
+/* {"action":"quota"[,"ip":"a.b.c.d"]}: day and month usage of every
+ * client with a quota, or of one. */
+static struct quota_view *qview_buf;
+static int qview_cap;
 
-    struct in_addr addr;
-    if (inet_aton(ipstr, &addr) == 0) {
-        fprintf(stderr, "[control] Invalid IP: %s\n", ipstr);
+static void cmd_quota(struct conn *c, const cJSON *root) {
+    const cJSON *ip_item = cJSON_GetObjectItemCaseSensitive(root, "ip");
+    struct in_addr addr = { 0 };
+    if (ip_item && (!cJSON_IsString(ip_item) || inet_aton(ip_item->valuestring, &addr) == 0)) {
+        reply_error(c, "invalid ip");
+        return;
+    }
+    uint32_t start[QUOTA_NPERIODS];
+    int n = quota_view_alloc(&qview_buf, &qview_cap, start);
+    if (n < 0) {
+        reply_error(c, "out of memory");
+        return;
+    }
+
+    size_t mark = c->out_len;
+    int listed = 0;
+    reply(c, "{\"ok\":true,\"action\":\"quota\",\"day_start\":%" PRIu32
+          ",\"month_start\":%" PRIu32 ",\"ips\":[", start[QUOTA_DAY], start[QUOTA_MONTH]);
+    for (int i = 0; i < n; i++) {
+        const struct quota_view *v = &qview_buf[i];
+        if (ip_item && v->ip != addr.s_addr) continue;
+        char ipbuf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &v->ip, ipbuf, sizeof(ipbuf));
+        reply(c, "%s{\"ip\":\"%s\",\"day_used\":%" PRIu64 ",\"day_limit\":%" PRIu64
+              ",\"month_used\":%" PRIu64 ",\"month_limit\":%" PRIu64 "}",
+              listed++ ? "," : "", ipbuf, v->used[QUOTA_DAY], v->limit[QUOTA_DAY],
+              v->used[QUOTA_MONTH], v->limit[QUOTA_MONTH]);
+    }
+    reply(c, "]}\n");
+    if (ip_item && !listed) {
+        c->out_len = mark;
+        reply_error(c, "unknown ip");
+    }
+}
+
+/* Handle one command line and queue exactly one reply line for it. All
+ * JSON work happens here, outside the accounting lock; ipacct only sees
+ * the decoded address batch. */
+static void handle_command(struct conn *c, const char *line, size_t len) {
+    cJSON *root = cJSON_ParseWithLength(line, len);
+    if (!root || !cJSON_IsObject(root)) {
+        fprintf(stderr, "[control] JSON parse error\n");
+        reply_error(c, "invalid JSON");
         cJSON_Delete(root);
         return;
     }
 
-    if (strcmp(action, "add") == 0) {
-        ipacct_add_client(addr.s_addr);
-        fprintf(stderr, "[control] Added client %s\n", ipstr);
-    } else if (strcmp(action, "del") == 0) {
-        ipacct_del_client(addr.s_addr);
-        fprintf(stderr, "[control] Removed client %s\n", ipstr);
+    const cJSON *action_item = cJSON_GetObjectItemCaseSensitive(root, "action");
+    if (!cJSON_IsString(action_item)) {
+        fprintf(stderr, "[control] Invalid JSON (missing fields)\n");
+        reply_error(c, "missing action");
+        cJSON_Delete(root);
+        return;
+    }
+    const char *action = action_item->valuestring;
+
+    if (strcmp(action, "add") == 0 || strcmp(action, "del") == 0) {
+        static uint32_t ips[CONTROL_MAX_BATCH];
+        const char *err = NULL;
+        int n = collect_ips(root, ips, &err);
+        if (n < 0) {
+            fprintf(stderr, "[control] %s\n", err);
+            reply_error(c, err);
+        } else {
+            int changed = action[0] == 'a' ? ipacct_add_clients(ips, n)
+                                           : ipacct_del_clients(ips, n);
+            if (changed < 0) reply_error(c, "out of memory");
+            else reply(c, "{\"ok\":true,\"action\":\"%s\",\"count\":%d,\"changed\":%d}\n",
+                       action, n, changed);
+        }
+    } else if (strcmp(action, "stats") == 0) {
+        cmd_stats(c, root);
+    } else if (strcmp(action, "top") == 0) {
+        cmd_top(c, root);
+    } else if (strcmp(action, "ip") == 0) {
+        cmd_ip(c, root);
+    } else if (strcmp(action, "histo") == 0) {
+        cmd_histo(c);
+    } else if (strcmp(action, "quota") == 0) {
+        cmd_quota(c, root);
+    } else if (strcmp(action, "subscribe") == 0) {
+        c->subscribed = 1;
+        reply(c, "{\"ok\":true,\"action\":\"subscribe\"}\n");
+    } else if (strcmp(action, "handover") == 0) {
+        // a new daemon waits on the handover socket; the main thread connects
+        collector_request_handover();
+        reply(c, "{\"ok\":true,\"action\":\"handover\"}\n");
     } else {
         fprintf(stderr, "[control] Unknown action: %s\n", action);
+        reply_error(c, "unknown action");
     }
 
     cJSON_Delete(root);
@@ -92,55 +424,341 @@ static void handle_command(const char *line) {
     json_decref(root);
 }*/
 
-void *control_thread_fn(void *arg) {
-    //struct cfg *cfg = arg;
-    (void)arg;
-    int fd, cfd;
-    struct sockaddr_un addr;
+/* ---------- epoll server ---------- */
+
+static struct conn *conns[CONTROL_MAX_CONNS];
+
+static void conn_close(int ep, struct conn *c) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    for (int i = 0; i < CONTROL_MAX_CONNS; i++) {
+        if (conns[i] == c) conns[i] = NULL;
+    }
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+/* Write as much pending output as the socket takes. Returns -1 if the
+ * peer is gone, 1 if output is still pending, 0 when drained. */
+static int conn_flush(struct conn *c) {
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+        c->out_off += n;
+    }
+    c->out_off = c->out_len = 0;
+    return 0;
+}
+
+static size_t conn_backlog(const struct conn *c) {
+    return c->out_len - c->out_off;
+}
+
+/* Run every complete line in the input buffer. At EOF a trailing line
+ * without '\n' is accepted too, for one-shot clients such as the hook.
+ * A client that sends commands without reading the replies is not
+ * served past CONTROL_OUT_MAX unsent bytes: the remaining lines are held
+ * and 1 is returned, so its output stays bounded by one reply. */
+static int conn_process(struct conn *c) {
+    size_t start = 0;
+    int held = 0;
+    for (size_t i = 0; i < c->in_len; i++) {
+        if (c->in[i] != '\n') continue;
+        if (conn_backlog(c) > CONTROL_OUT_MAX) {
+            held = 1;
+            break;
+        }
+        if (i > start) handle_command(c, c->in + start, i - start);
+        start = i + 1;
+    }
+    if (!held && c->eof && start < c->in_len) {
+        if (conn_backlog(c) > CONTROL_OUT_MAX) {
+            held = 1;
+        } else {
+            size_t len = c->in_len - start;
+            while (len && (c->in[start+len-1] == '\r' || c->in[start+len-1] == ' ')) len--;
+            if (len) handle_command(c, c->in + start, len);
+            start = c->in_len;
+        }
+    }
+    memmove(c->in, c->in + start, c->in_len - start);
+    c->in_len -= start;
+    return held;
+}
+
+/* Read and serve what the client sent. Also called once held-back
+ * output has drained, to go on with the lines it held. While lines are
+ * held nothing more is read, so the socket pushes back on the client. */
+static void conn_readable(int ep, struct conn *c) {
+    int held, pending;
+    do {
+        held = conn_process(c);
+        while (!held && !c->eof) {
+            if (c->in_len == c->in_cap) {
+                size_t cap = c->in_cap ? c->in_cap * 2 : 4096;
+                char *nb = cap <= CONTROL_LINE_MAX ? realloc(c->in, cap) : NULL;
+                if (!nb) {
+                    reply_error(c, "line too long");
+                    conn_flush(c);
+                    conn_close(ep, c);
+                    return;
+                }
+                c->in = nb;
+                c->in_cap = cap;
+            }
+            ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+            if (n > 0) {
+                c->in_len += n;
+                held = conn_process(c);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            c->eof = 1;   // EOF or error
+            held = conn_process(c);
+        }
+        pending = conn_flush(c);
+    } while (held && pending == 0);
+
+    if (pending < 0 || (c->eof && pending == 0)) {
+        conn_close(ep, c);
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | (pending ? EPOLLOUT : 0), .data.ptr = c };
+    if (c->eof || held) ev.events = EPOLLOUT;
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void accept_all(int ep, int lfd) {
+    for (;;) {
+        int cfd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+        int slot = -1;
+        for (int i = 0; i < CONTROL_MAX_CONNS; i++) {
+            if (!conns[i]) { slot = i; break; }
+        }
+        struct conn *c = slot >= 0 ? calloc(1, sizeof(*c)) : NULL;
+        if (!c) {
+            fprintf(stderr, "[control] Too many connections, dropping one\n");
+            close(cfd);
+            continue;
+        }
+        c->fd = cfd;
+        conns[slot] = c;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(cfd);
+            conns[slot] = NULL;
+            free(c);
+        }
+    }
+}
+
+/* ---------- Events ---------- */
+
+/* Other threads queue event lines here; the eventfd wakes the control
+ * thread, which copies them into every subscriber's output buffer. */
+static pthread_mutex_t events_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *events[CONTROL_MAX_EVENTS];
+static int events_head, events_count;
+static int events_fd = -1;
+static char events_marker;   // epoll data.ptr of events_fd
 
-    unlink(CONTROL_SOCK_PATH);
+/* Queue one event line (without '\n') for subscribers. Never blocks on
+ * clients; when nobody drains the queue the oldest events are dropped. */
+void control_notify(const char *line) {
+    char *copy = strdup(line);
+    if (!copy) return;
+    pthread_mutex_lock(&events_lock);
+    if (events_fd < 0) {
+        pthread_mutex_unlock(&events_lock);
+        free(copy);
+        return;
+    }
+    if (events_count == CONTROL_MAX_EVENTS) {
+        free(events[events_head]);
+        events_head = (events_head + 1) % CONTROL_MAX_EVENTS;
+        events_count--;
+    }
+    events[(events_head + events_count++) % CONTROL_MAX_EVENTS] = copy;
+    uint64_t one = 1;
+    if (write(events_fd, &one, sizeof(one)) < 0) { /* counter saturated: already woken */ }
+    pthread_mutex_unlock(&events_lock);
+}
+
+static void events_drain(int ep) {
+    uint64_t v;
+    if (read(events_fd, &v, sizeof(v)) < 0) { /* spurious wakeup */ }
+
+    char *batch[CONTROL_MAX_EVENTS];
+    pthread_mutex_lock(&events_lock);
+    int n = events_count;
+    for (int i = 0; i < n; i++) batch[i] = events[(events_head + i) % CONTROL_MAX_EVENTS];
+    events_head = events_count = 0;
+    pthread_mutex_unlock(&events_lock);
+
+    for (int i = 0; i < CONTROL_MAX_CONNS; i++) {
+        struct conn *c = conns[i];
+        if (!c || !c->subscribed || c->eof) continue;
+        for (int j = 0; j < n; j++) {
+            if (c->out_len - c->out_off > CONTROL_SUB_BACKLOG) break;
+            reply(c, "%s\n", batch[j]);
+        }
+        int pending = conn_flush(c);
+        if (pending < 0) {
+            conn_close(ep, c);
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLIN | (pending ? EPOLLOUT : 0), .data.ptr = c };
+        epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+    for (int i = 0; i < n; i++) free(batch[i]);
+}
+
+static const char *sock_path;
+static int adopted_fd = -1;   // listening socket handed over by the previous daemon
+static int listen_fd = -1;
+static int disowned;          // the socket now belongs to the next daemon
+
+/* Serve on fd, already bound and listening, instead of creating the
+ * socket. Call before starting the control thread. */
+void control_adopt_fd(int fd) {
+    adopted_fd = fd;
+}
+
+int control_listen_fd(void) {
+    return __atomic_load_n(&listen_fd, __ATOMIC_ACQUIRE);
+}
+
+/* With on set, leave the socket file in place on exit: the daemon
+ * taking over serves on it. Cleared again if that handover fails, or the
+ * path would outlive this daemon with nobody listening. */
+void control_disown(int on) {
+    __atomic_store_n(&disowned, on, __ATOMIC_RELEASE);
+}
 
-    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+static void control_cleanup(void *arg) {
+    int *fds = arg;   // { listen fd, epoll fd }
+    for (int i = 0; i < CONTROL_MAX_CONNS; i++) {
+        if (conns[i]) conn_close(fds[1], conns[i]);
+    }
+    pthread_mutex_lock(&events_lock);
+    if (events_fd >= 0) close(events_fd);
+    events_fd = -1;
+    for (; events_count; events_count--) {
+        free(events[events_head]);
+        events_head = (events_head + 1) % CONTROL_MAX_EVENTS;
+    }
+    pthread_mutex_unlock(&events_lock);
+    close(fds[1]);
+    close(fds[0]);
+    if (!__atomic_load_n(&disowned, __ATOMIC_ACQUIRE)) unlink(sock_path);
+}
+
+/* Bind and listen on path, replacing a stale socket file. */
+static int open_listener(const char *path) {
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
         perror("socket");
-        return NULL;
+        return -1;
     }
 
+    struct sockaddr_un addr;
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, CONTROL_SOCK_PATH, sizeof(addr.sun_path)-1);
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
 
     if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind");
         close(fd);
-        return NULL;
+        return -1;
     }
 
-    if (listen(fd, 5) < 0) {
+    if (listen(fd, SOMAXCONN) < 0) {
         perror("listen");
         close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void *control_thread_fn(void *arg) {
+    struct cfg *cfg = arg;
+
+    // fixed for the life of the daemon; a reload does not move the socket
+    sock_path = cfg->control_sock;
+    // an adopted socket kept accepting while it changed hands
+    int fd = adopted_fd >= 0 ? adopted_fd : open_listener(sock_path);
+    if (fd < 0) return NULL;
+    __atomic_store_n(&listen_fd, fd, __ATOMIC_RELEASE);
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        perror("epoll_create1");
+        close(fd);
         return NULL;
     }
+    struct epoll_event lev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &lev);
 
-    fprintf(stderr, "[control] Listening on %s\n", CONTROL_SOCK_PATH);
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd >= 0) {
+        struct epoll_event eev = { .events = EPOLLIN, .data.ptr = &events_marker };
+        epoll_ctl(ep, EPOLL_CTL_ADD, efd, &eev);
+        pthread_mutex_lock(&events_lock);
+        events_fd = efd;
+        pthread_mutex_unlock(&events_lock);
+    } else {
+        perror("eventfd");
+    }
 
-    char buf[512];
+    fprintf(stderr, "[control] Listening on %s\n", sock_path);
+
+    int fds[2] = { fd, ep };
+    pthread_cleanup_push(control_cleanup, fds);
+
+    struct epoll_event evs[64];
     while (1) {
-        cfd = accept(fd, NULL, NULL);
-        if (cfd < 0) {
+        int n = epoll_wait(ep, evs, 64, -1);
+        if (n < 0) {
             if (errno == EINTR) continue;
-            perror("accept");
+            perror("epoll_wait");
             break;
         }
-
-        ssize_t n = read(cfd, buf, sizeof(buf)-1);
-        if (n > 0) {
-            buf[n] = '\0';
-            handle_command(buf);
+        // events go out after the batch: a subscriber they close may
+        // still have an entry further down evs[]
+        int drain = 0;
+        for (int i = 0; i < n; i++) {
+            struct conn *c = evs[i].data.ptr;
+            if (!c) {
+                accept_all(ep, fd);
+            } else if ((void *)c == &events_marker) {
+                drain = 1;
+            } else if (evs[i].events & EPOLLERR) {
+                conn_close(ep, c);
+            } else if (evs[i].events & (EPOLLIN | EPOLLHUP)) {
+                conn_readable(ep, c);
+            } else if (evs[i].events & EPOLLOUT) {
+                int pending = conn_flush(c);
+                if (pending < 0) conn_close(ep, c);
+                else if (pending == 0) conn_readable(ep, c);   // serves held lines, or closes at EOF
+            }
         }
-        close(cfd);
+        if (drain) events_drain(ep);
     }
 
-    close(fd);
-    unlink(CONTROL_SOCK_PATH);
+    pthread_cleanup_pop(1);
     return NULL;
 }
@@ -0,0 +1,378 @@
+// src/dayindex.c - per-day columnar index of the daily files
+//
+// Summing one IP over a quarter means decoding every record of every
+// day. Once a day is closed (older than yesterday, like retention), the
+// daemon writes <daily>/YYYY-MM-DD.idx next to it:
+//
+//   struct dayindex_header
+//   uint32_t ips[nips]                 sorted, network byte order as stored
+//   (padding to 8 bytes)
+//   struct dayindex_total totals[nips] rx/tx of the whole day
+//   uint32_t hour_off[nips + 1]        IP i's hours are hours[off[i]..off[i+1])
+//   (padding to 8 bytes)
+//   struct dayindex_hour hours[nhours] hours with an entry, ascending
+//
+// A report binary-searches ips[] and reads one total, or a few hour
+// entries when --from/--to cut the day on an hour boundary, instead of
+// the day's records. Kernel totals and the span of the records are kept
+// per hour in the header. The index records the size and mtime of the
+// file it was built from; once that file changes (a retention rewrite)
+// the index is ignored until the next pass rebuilds it. Only IPv4
+// per-IP entries are indexed; class breakdowns and series read the file.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "netacct.h"
+
+#define DAYINDEX_MAGIC "NIX1"
+
+struct dayindex_header {
+    char magic[4];
+    uint32_t day;                 // UTC start of the day
+    uint64_t src_size;            // the daily file indexed
+    int64_t src_mtime_ns;
+    uint32_t nips;
+    uint32_t nhours;              // entries in hours[]
+    uint32_t first_ts[24];        // per hour; 0: no record
+    uint32_t last_ts[24];
+    uint64_t kernel_rx[24];
+    uint64_t kernel_tx[24];
+};
+
+struct dayindex_total {
+    uint64_t rx, tx;
+};
+
+struct dayindex_hour {
+    uint64_t rx, tx;
+    uint32_t hour;
+    uint32_t pad;
+};
+
+struct dayindex {
+    void *map;
+    size_t len;
+    const struct dayindex_header *h;
+    const uint32_t *ips;
+    const struct dayindex_total *totals;
+    const uint32_t *hour_off;
+    const struct dayindex_hour *hours;
+};
+
+static size_t pad8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+/* Offsets of the arrays after the header, and the file size. */
+static void layout(uint32_t nips, uint32_t nhours, size_t *ips, size_t *totals,
+                   size_t *hour_off, size_t *hours, size_t *len) {
+    *ips = sizeof(struct dayindex_header);
+    *totals = pad8(*ips + sizeof(uint32_t) * nips);
+    *hour_off = *totals + sizeof(struct dayindex_total) * nips;
+    *hours = pad8(*hour_off + sizeof(uint32_t) * ((size_t)nips + 1));
+    *len = *hours + sizeof(struct dayindex_hour) * nhours;
+}
+
+void dayindex_path(const char *daily_dir, const struct datafile *df, char *buf, size_t n) {
+    snprintf(buf, n, "%s/%.10s.idx", daily_dir, df->name);
+}
+
+static int64_t mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* ---------- Building ---------- */
+
+/* Per-IP accumulator while reading the day: 24 hours, dense. */
+struct ip_hours {
+    uint32_t ip;
+    uint32_t seen;                // bit per hour with an entry
+    struct dayindex_total total;
+    struct dayindex_total hour[24];
+};
+
+static int ip_cmp(const void *a, const void *b) {
+    uint32_t x = (*(struct ip_hours *const *)a)->ip, y = (*(struct ip_hours *const *)b)->ip;
+    return x < y ? -1 : x > y;
+}
+
+static int write_index(const char *path, const struct dayindex_header *hdr,
+                       struct ip_hours **sorted) {
+    size_t o_ips, o_totals, o_off, o_hours, len;
+    layout(hdr->nips, hdr->nhours, &o_ips, &o_totals, &o_off, &o_hours, &len);
+    char *buf = calloc(1, len);
+    if (!buf) return -1;
+    memcpy(buf, hdr, sizeof(*hdr));
+    uint32_t *ips = (uint32_t *)(buf + o_ips);
+    struct dayindex_total *totals = (struct dayindex_total *)(buf + o_totals);
+    uint32_t *off = (uint32_t *)(buf + o_off);
+    struct dayindex_hour *hours = (struct dayindex_hour *)(buf + o_hours);
+    uint32_t k = 0;
+    for (uint32_t i = 0; i < hdr->nips; i++) {
+        const struct ip_hours *e = sorted[i];
+        ips[i] = e->ip;
+        totals[i] = e->total;
+        off[i] = k;
+        for (uint32_t hr = 0; hr < 24; hr++) {
+            if (!(e->seen & 1u << hr)) continue;
+            hours[k].rx = e->hour[hr].rx;
+            hours[k].tx = e->hour[hr].tx;
+            hours[k].hour = hr;
+            k++;
+        }
+    }
+    off[hdr->nips] = k;
+
+    char tmp[1200];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int rc = fd < 0 ? -1 : 0;
+    if (rc == 0 && write(fd, buf, len) != (ssize_t)len) rc = -1;
+    if (fd >= 0) close(fd);
+    // derived data: no fsync, a torn index fails its size check
+    if (rc == 0 && rename(tmp, path) != 0) rc = -1;
+    if (rc != 0) unlink(tmp);
+    free(buf);
+    return rc;
+}
+
+/* Index one closed daily file. Returns 0, or -1 if it cannot be read
+ * (or holds records of another day) and no index was written. */
+int dayindex_build(const char *daily_dir, const struct datafile *df) {
+    char src[1100], path[1100];
+    snprintf(src, sizeof(src), "%s/%s", daily_dir, df->name);
+    dayindex_path(daily_dir, df, path, sizeof(path));
+
+    struct stat st;
+    if (stat(src, &st) != 0) return -1;
+    gzFile in = gzopen(src, "rb");
+    if (!in) return -1;
+    struct iptable t;
+    struct ip_entry_on_disk *ents = malloc(sizeof(*ents) * MAX_FLUSH_ENTRIES);
+    if (!ents || iptable_init(&t, sizeof(struct ip_hours), 1024) != 0) {
+        free(ents);
+        gzclose(in);
+        return -1;
+    }
+
+    struct dayindex_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DAYINDEX_MAGIC, 4);
+    hdr.day = (uint32_t)df->day;
+    hdr.src_size = (uint64_t)st.st_size;
+    hdr.src_mtime_ns = mtime_ns(&st);
+
+    int rc = 0;
+    struct record_header h;
+    while (rc == 0 && gzread(in, &h, sizeof(h)) == (int)sizeof(h)) {
+        int len = (int)(h.ip_count * sizeof(*ents));
+        if (gzread(in, ents, (unsigned)len) != len) break;   // truncated tail, as reports read it
+        if (h.ts < hdr.day || h.ts - hdr.day >= 86400) {
+            rc = -1;
+            break;
+        }
+        int hr = (int)((h.ts - hdr.day) / 3600);
+        if (!hdr.first_ts[hr] || h.ts < hdr.first_ts[hr]) hdr.first_ts[hr] = h.ts;
+        if (h.ts > hdr.last_ts[hr]) hdr.last_ts[hr] = h.ts;
+        hdr.kernel_rx[hr] += h.total_rx;
+        hdr.kernel_tx[hr] += h.total_tx;
+        for (int i = 0; i < h.ip_count; i++) {
+            if (ents[i].ipv != 4) continue;
+            int created;
+            struct ip_hours *e = iptable_get(&t, ents[i].addr, &created);
+            if (!e) {
+                rc = -1;
+                break;
+            }
+            if (created) e->ip = ents[i].addr;
+            e->total.rx += ents[i].rx_delta;
+            e->total.tx += ents[i].tx_delta;
+            e->seen |= 1u << hr;
+            e->hour[hr].rx += ents[i].rx_delta;
+            e->hour[hr].tx += ents[i].tx_delta;
+        }
+    }
+    int err;
+    gzerror(in, &err);
+    if (err != Z_OK && err != Z_BUF_ERROR) rc = -1;
+    gzclose(in);
+    free(ents);
+
+    struct ip_hours **sorted = rc == 0 ? malloc(sizeof(*sorted) * (t.count + 1)) : NULL;
+    if (sorted) {
+        uint32_t pos = 0, n = 0;
+        struct ip_hours *e;
+        while ((e = iptable_next(&t, &pos)) != NULL) {
+            sorted[n++] = e;
+            hdr.nhours += (uint32_t)__builtin_popcount(e->seen);
+        }
+        hdr.nips = n;
+        qsort(sorted, n, sizeof(*sorted), ip_cmp);
+        rc = write_index(path, &hdr, sorted);
+    } else {
+        rc = -1;
+    }
+    free(sorted);
+    iptable_free(&t);
+    if (rc != 0) fprintf(stderr, "[dayindex] cannot index %s\n", src);
+    return rc;
+}
+
+/* Index every closed day of every interface under root_dir that has no
+ * index, or one older than its file. Stops between files once *running
+ * drops. */
+int dayindex_update(const char *root_dir, const volatile int *running) {
+    time_t now = time(NULL);
+    time_t yesterday = now - now % 86400 - 86400;   // still written and compressed
+    DIR *d = opendir(root_dir);
+    if (!d) return -1;
+    int rc = 0, built = 0;
+    struct dirent *de;
+    while (*running && (de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char dir[1024];
+        snprintf(dir, sizeof(dir), "%s/%s/daily", root_dir, de->d_name);
+        struct datafile *files;
+        int n = util_list_datafiles(dir, 0, yesterday - 1, &files);
+        if (n < 0) continue;
+        for (int i = 0; i < n && *running; i++) {
+            struct dayindex *x = dayindex_open(dir, &files[i]);
+            if (x) {
+                dayindex_close(x);
+                continue;
+            }
+            if (dayindex_build(dir, &files[i]) != 0) rc = -1;
+            else built++;
+        }
+        free(files);
+    }
+    closedir(d);
+    if (built) fprintf(stderr, "[dayindex] %s: indexed %d days\n", root_dir, built);
+    return rc;
+}
+
+/* ---------- Lookups ---------- */
+
+/* Map the index of df, if there is one and it matches the file as it is
+ * now. NULL otherwise: read the file instead. */
+struct dayindex *dayindex_open(const char *daily_dir, const struct datafile *df) {
+    char src[1100], path[1100];
+    snprintf(src, sizeof(src), "%s/%s", daily_dir, df->name);
+    dayindex_path(daily_dir, df, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st, sst;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct dayindex_header) ||
+        stat(src, &sst) != 0) {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+
+    const struct dayindex_header *h = map;
+    size_t o_ips, o_totals, o_off, o_hours, len;
+    layout(h->nips, h->nhours, &o_ips, &o_totals, &o_off, &o_hours, &len);
+    const uint32_t *off = (const uint32_t *)((char *)map + o_off);
+    if (memcmp(h->magic, DAYINDEX_MAGIC, 4) != 0 || h->day != (uint32_t)df->day ||
+        h->src_size != (uint64_t)sst.st_size || h->src_mtime_ns != mtime_ns(&sst) ||
+        len != (size_t)st.st_size || off[h->nips] != h->nhours) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    struct dayindex *x = malloc(sizeof(*x));
+    if (!x) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    x->map = map;
+    x->len = len;
+    x->h = h;
+    x->ips = (const uint32_t *)((char *)map + o_ips);
+    x->totals = (const struct dayindex_total *)((char *)map + o_totals);
+    x->hour_off = off;
+    x->hours = (const struct dayindex_hour *)((char *)map + o_hours);
+    // lookups jump around; don't read ahead the whole file
+    madvise(map, len, MADV_RANDOM);
+    return x;
+}
+
+void dayindex_close(struct dayindex *x) {
+    if (!x) return;
+    munmap(x->map, x->len);
+    free(x);
+}
+
+uint32_t dayindex_count(const struct dayindex *x) { return x->h->nips; }
+
+/* Kernel totals and first/last record of hours [h0, h1). Returns 0 if
+ * none of them has a record. */
+int dayindex_span(const struct dayindex *x, int h0, int h1, uint64_t *kernel_rx,
+                  uint64_t *kernel_tx, uint32_t *first_ts, uint32_t *last_ts) {
+    int any = 0;
+    *kernel_rx = *kernel_tx = 0;
+    *first_ts = *last_ts = 0;
+    for (int hr = h0; hr < h1; hr++) {
+        if (!x->h->last_ts[hr]) continue;
+        *kernel_rx += x->h->kernel_rx[hr];
+        *kernel_tx += x->h->kernel_tx[hr];
+        if (!any) *first_ts = x->h->first_ts[hr];
+        *last_ts = x->h->last_ts[hr];
+        any = 1;
+    }
+    return any;
+}
+
+/* Bytes of the k-th IP (in address order) over hours [h0, h1). Returns
+ * 0 if it has no entry in them. */
+static int sum_hours(const struct dayindex *x, uint32_t k, int h0, int h1,
+                     uint64_t *rx, uint64_t *tx) {
+    if (h0 == 0 && h1 == 24) {
+        *rx = x->totals[k].rx;
+        *tx = x->totals[k].tx;
+        return 1;
+    }
+    int any = 0;
+    *rx = *tx = 0;
+    for (uint32_t j = x->hour_off[k]; j < x->hour_off[k + 1]; j++) {
+        const struct dayindex_hour *e = &x->hours[j];
+        if ((int)e->hour < h0) continue;
+        if ((int)e->hour >= h1) break;
+        *rx += e->rx;
+        *tx += e->tx;
+        any = 1;
+    }
+    return any;
+}
+
+/* The k-th IP of the day (k < dayindex_count()) into *ip, and its bytes
+ * over hours [h0, h1). Returns 0 if it has no entry in them. */
+int dayindex_entry(const struct dayindex *x, uint32_t k, int h0, int h1,
+                   uint32_t *ip, uint64_t *rx, uint64_t *tx) {
+    *ip = x->ips[k];
+    return sum_hours(x, k, h0, h1, rx, tx);
+}
+
+/* Bytes of ip over hours [h0, h1). Returns 0 if it has no entry in
+ * them. */
+int dayindex_lookup(const struct dayindex *x, uint32_t ip, int h0, int h1,
+                    uint64_t *rx, uint64_t *tx) {
+    uint32_t lo = 0, hi = x->h->nips;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (x->ips[mid] < ip) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == x->h->nips || x->ips[lo] != ip) return 0;
+    return sum_hours(x, lo, h0, h1, rx, tx);
+}
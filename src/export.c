@@ -0,0 +1,263 @@
+// src/export.c - streaming report writer (text / CSV / JSON / NDJSON)
+//
+// Every call writes its piece of the document straight to the output
+// stream; nothing is buffered beyond stdio, so memory use does not depend
+// on the number of periods or rows emitted.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "netacct.h"
+
+#define MB (1024.0*1024.0)
+
+int export_parse_format(const char *s) {
+    if (strcmp(s, "text") == 0) return EXPORT_TEXT;
+    if (strcmp(s, "csv") == 0) return EXPORT_CSV;
+    if (strcmp(s, "json") == 0) return EXPORT_JSON;
+    if (strcmp(s, "ndjson") == 0) return EXPORT_NDJSON;
+    return -1;
+}
+
+static void json_str(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void csv_str(FILE *out, const char *s) {
+    if (!strpbrk(s, ",\"\n")) {
+        fputs(s, out);
+        return;
+    }
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"') fputc('"', out);
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static const char *ip_str(uint32_t ip, char *buf) {
+    struct in_addr a = { .s_addr = ip };
+    return inet_ntop(AF_INET, &a, buf, INET_ADDRSTRLEN);
+}
+
+void export_begin(struct export_writer *w, FILE *out, int format, const char *iface) {
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    w->format = format;
+    w->iface = iface ? iface : "";
+
+    switch (format) {
+    case EXPORT_CSV:
+        fputs("period,start,end,iface,kind,ip,rx_bytes,tx_bytes\n", out);
+        break;
+    case EXPORT_JSON:
+        fputs("{\"iface\":", out);
+        json_str(out, w->iface);
+        fputs(",\"periods\":[", out);
+        break;
+    default:
+        break;
+    }
+}
+
+void export_period_begin(struct export_writer *w, const char *label,
+                         uint32_t start, uint32_t end,
+                         uint64_t kernel_rx, uint64_t kernel_tx) {
+    FILE *out = w->out;
+    snprintf(w->label, sizeof(w->label), "%s", label);
+    w->start = start;
+    w->end = end;
+    w->kernel_rx = kernel_rx;
+    w->kernel_tx = kernel_tx;
+    w->rows = 0;
+
+    switch (w->format) {
+    case EXPORT_TEXT:
+        fprintf(out, "=== %s ===\n", label);
+        break;
+    case EXPORT_JSON:
+        if (w->periods) fputc(',', out);
+        fputs("\n{\"period\":", out);
+        json_str(out, label);
+        fprintf(out, ",\"start\":%" PRIu32 ",\"end\":%" PRIu32
+                ",\"kernel\":{\"rx_bytes\":%" PRIu64 ",\"tx_bytes\":%" PRIu64 "},\"ips\":[",
+                start, end, kernel_rx, kernel_tx);
+        break;
+    default:
+        break;
+    }
+    w->periods++;
+}
+
+/* Common prefix of a CSV row / NDJSON object for the current period. */
+static void row_head(struct export_writer *w, const char *kind) {
+    FILE *out = w->out;
+    if (w->format == EXPORT_CSV) {
+        csv_str(out, w->label);
+        fprintf(out, ",%" PRIu32 ",%" PRIu32 ",", w->start, w->end);
+        csv_str(out, w->iface);
+        fprintf(out, ",%s,", kind);
+    } else {
+        fputs("{\"period\":", out);
+        json_str(out, w->label);
+        fprintf(out, ",\"start\":%" PRIu32 ",\"end\":%" PRIu32 ",\"iface\":", w->start, w->end);
+        json_str(out, w->iface);
+        fprintf(out, ",\"kind\":\"%s\"", kind);
+    }
+}
+
+static void text_line(FILE *out, const char *name, uint64_t rx, uint64_t tx, uint64_t kernel) {
+    double mb = (double)(rx + tx) / MB;
+    double kernel_mb = (double)kernel / MB;
+    double pct = kernel_mb > 0 ? (mb / kernel_mb) * 100.0 : 0.0;
+    fprintf(out, "  %-15s  RX: %.2f MB  TX: %.2f MB  Total: %.2f MB (%.1f%%)\n",
+            name, (double)rx / MB, (double)tx / MB, mb, pct);
+}
+
+void export_ip(struct export_writer *w, uint32_t ip, uint64_t rx, uint64_t tx) {
+    FILE *out = w->out;
+    char ipbuf[INET_ADDRSTRLEN];
+    ip_str(ip, ipbuf);
+
+    switch (w->format) {
+    case EXPORT_TEXT:
+        text_line(out, ipbuf, rx, tx, w->kernel_rx + w->kernel_tx);
+        break;
+    case EXPORT_CSV:
+        row_head(w, "ip");
+        fprintf(out, "%s,%" PRIu64 ",%" PRIu64 "\n", ipbuf, rx, tx);
+        break;
+    case EXPORT_JSON:
+        if (w->rows) fputc(',', out);
+        fprintf(out, "{\"ip\":\"%s\",\"rx_bytes\":%" PRIu64 ",\"tx_bytes\":%" PRIu64 "}",
+                ipbuf, rx, tx);
+        break;
+    case EXPORT_NDJSON:
+        row_head(w, "ip");
+        fprintf(out, ",\"ip\":\"%s\",\"rx_bytes\":%" PRIu64 ",\"tx_bytes\":%" PRIu64 "}\n",
+                ipbuf, rx, tx);
+        break;
+    }
+    w->rows++;
+}
+
+void export_period_end(struct export_writer *w, uint64_t all_rx, uint64_t all_tx) {
+    FILE *out = w->out;
+    switch (w->format) {
+    case EXPORT_TEXT: {
+        uint64_t kernel = w->kernel_rx + w->kernel_tx;
+        text_line(out, "ALL (per-IP)", all_rx, all_tx, kernel);
+        fprintf(out, "  %-15s  RX: %.2f MB  TX: %.2f MB  Total: %.2f MB (100%% kernel)\n",
+                "KERNEL", (double)w->kernel_rx / MB, (double)w->kernel_tx / MB,
+                (double)kernel / MB);
+        break;
+    }
+    case EXPORT_CSV:
+        row_head(w, "all");
+        fprintf(out, ",%" PRIu64 ",%" PRIu64 "\n", all_rx, all_tx);
+        row_head(w, "kernel");
+        fprintf(out, ",%" PRIu64 ",%" PRIu64 "\n", w->kernel_rx, w->kernel_tx);
+        break;
+    case EXPORT_JSON:
+        fprintf(out, "],\"all\":{\"rx_bytes\":%" PRIu64 ",\"tx_bytes\":%" PRIu64 "}}",
+                all_rx, all_tx);
+        break;
+    case EXPORT_NDJSON:
+        row_head(w, "all");
+        fprintf(out, ",\"rx_bytes\":%" PRIu64 ",\"tx_bytes\":%" PRIu64 "}\n", all_rx, all_tx);
+        row_head(w, "kernel");
+        fprintf(out, ",\"rx_bytes\":%" PRIu64 ",\"tx_bytes\":%" PRIu64 "}\n",
+                w->kernel_rx, w->kernel_tx);
+        break;
+    }
+}
+
+void export_end(struct export_writer *w) {
+    if (w->format == EXPORT_JSON) fputs("\n]}\n", w->out);
+    fflush(w->out);
+}
+
+/* ---------- Time series ---------- */
+
+void export_series_begin(struct export_writer *w, FILE *out, int format,
+                         const char *iface, uint32_t step) {
+    memset(w, 0, sizeof(*w));
+    w->out = out;
+    w->format = format;
+    w->iface = iface ? iface : "";
+    w->step = step;
+
+    switch (format) {
+    case EXPORT_CSV:
+        fputs("iface,ip,start,step,rx_bytes,tx_bytes,peak_bps\n", out);
+        break;
+    case EXPORT_JSON:
+        fputs("{\"iface\":", out);
+        json_str(out, w->iface);
+        fprintf(out, ",\"step\":%" PRIu32 ",\"rows\":[", step);
+        break;
+    default:
+        break;
+    }
+}
+
+/* One bucket [start, start+step) of one IP; peak_bps is the highest
+ * per-flush rate seen inside the bucket, in bytes per second. */
+void export_series_row(struct export_writer *w, uint32_t ip, uint32_t start,
+                       uint64_t rx, uint64_t tx, uint64_t peak_bps) {
+    FILE *out = w->out;
+    char ipbuf[INET_ADDRSTRLEN];
+    ip_str(ip, ipbuf);
+
+    switch (w->format) {
+    case EXPORT_TEXT: {
+        if (w->rows == 0 || w->last_ip != ip) fprintf(out, "=== %s ===\n", ipbuf);
+        char when[32];
+        time_t t = start;
+        struct tm gm;
+        gmtime_r(&t, &gm);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &gm);
+        fprintf(out, "  %s  RX: %.2f MB  TX: %.2f MB  Peak: %.2f Mbit/s\n",
+                when, (double)rx / MB, (double)tx / MB, (double)peak_bps * 8.0 / 1e6);
+        break;
+    }
+    case EXPORT_CSV:
+        csv_str(out, w->iface);
+        fprintf(out, ",%s,%" PRIu32 ",%" PRIu32 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                ipbuf, start, w->step, rx, tx, peak_bps);
+        break;
+    case EXPORT_JSON:
+        if (w->rows) fputc(',', out);
+        fprintf(out, "\n{\"ip\":\"%s\",\"start\":%" PRIu32 ",\"rx_bytes\":%" PRIu64
+                ",\"tx_bytes\":%" PRIu64 ",\"peak_bps\":%" PRIu64 "}",
+                ipbuf, start, rx, tx, peak_bps);
+        break;
+    case EXPORT_NDJSON:
+        fputs("{\"iface\":", out);
+        json_str(out, w->iface);
+        fprintf(out, ",\"ip\":\"%s\",\"start\":%" PRIu32 ",\"step\":%" PRIu32
+                ",\"rx_bytes\":%" PRIu64 ",\"tx_bytes\":%" PRIu64 ",\"peak_bps\":%" PRIu64 "}\n",
+                ipbuf, start, w->step, rx, tx, peak_bps);
+        break;
+    }
+    w->last_ip = ip;
+    w->rows++;
+}
+
+void export_series_end(struct export_writer *w) {
+    if (w->format == EXPORT_JSON) fputs("\n]}\n", w->out);
+    fflush(w->out);
+}
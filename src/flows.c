@@ -0,0 +1,178 @@
+// src/flows.c - per-client protocol/port breakdown
+//
+// Packets of accounted clients are classified by protocol and the
+// remote end's port into one of FLOW_NCLASSES classes and summed per
+// (client, class) in a flow_table. The table is sized once from the
+// config (flow_entries) and allocated outside the packet path; it never
+// grows. Each bucket holds FLOW_WAYS entries, and a miss on a full
+// bucket evicts one of them by clock (second chance), so a port scan or
+// a client spraying every class costs evictions, never memory. The bytes
+// of evicted entries are kept as a table-wide sum and written under
+// address 0.0.0.0, so the classes of a flush still add up.
+//
+// Tables are drained (and emptied) at every flush; see
+// ipacct_snapshot_flows() and the extension records in storage.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "netacct.h"
+
+static const char *class_names[FLOW_NCLASSES] = {
+    "web", "quic", "dns", "mail", "ssh", "vpn",
+    "tcp-low", "tcp-high", "udp-low", "udp-high", "icmp", "other",
+};
+
+const char *flow_class_name(int cls) {
+    return cls >= 0 && cls < FLOW_NCLASSES ? class_names[cls] : "?";
+}
+
+/* proto is the IP protocol number, remote_port in host order (ignored
+ * for protocols without ports). */
+int flow_classify(uint8_t proto, uint16_t remote_port) {
+    switch (proto) {
+    case 1:
+        return FLOW_ICMP;
+    case 47:    // GRE
+    case 50:    // ESP
+        return FLOW_VPN;
+    case 6:
+        switch (remote_port) {
+        case 80: case 443: case 8080: case 8443:
+            return FLOW_WEB;
+        case 53: case 853:
+            return FLOW_DNS;
+        case 25: case 110: case 143: case 465: case 587: case 993: case 995:
+            return FLOW_MAIL;
+        case 22:
+            return FLOW_SSH;
+        case 1194: case 1723:
+            return FLOW_VPN;
+        }
+        return remote_port < 1024 ? FLOW_TCP_LOW : FLOW_TCP_HIGH;
+    case 17:
+        switch (remote_port) {
+        case 443:
+            return FLOW_QUIC;
+        case 53: case 853:
+            return FLOW_DNS;
+        case 500: case 1194: case 4500: case 51820:
+            return FLOW_VPN;
+        }
+        return remote_port < 1024 ? FLOW_UDP_LOW : FLOW_UDP_HIGH;
+    }
+    return FLOW_OTHER;
+}
+
+/* Room for at least entries (ip, class) pairs, rounded up to a power of
+ * two number of buckets. entries <= 0 leaves the table disabled. */
+int flow_table_init(struct flow_table *t, int entries) {
+    memset(t, 0, sizeof(*t));
+    if (entries <= 0) return 0;
+    if (entries > MAX_FLOW_ENTRIES) entries = MAX_FLOW_ENTRIES;
+    uint32_t n = 1;
+    while (n * FLOW_WAYS < (uint32_t)entries) n <<= 1;
+    t->buckets = aligned_alloc(64, sizeof(*t->buckets) * n);
+    if (!t->buckets) return -1;
+    memset(t->buckets, 0, sizeof(*t->buckets) * n);
+    t->mask = n - 1;
+    return 0;
+}
+
+void flow_table_free(struct flow_table *t) {
+    free(t->buckets);
+    memset(t, 0, sizeof(*t));
+}
+
+int flow_table_capacity(const struct flow_table *t) {
+    return t->buckets ? (int)(t->mask + 1) * FLOW_WAYS : 0;
+}
+
+static inline uint32_t flow_hash(uint32_t ip, int cls) {
+    uint32_t h = ip ^ ((uint32_t)cls * 0x9e3779b9U);
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Count bytes for (ip, cls). Never allocates; the caller holds whatever
+ * lock protects t. */
+void flow_table_add(struct flow_table *t, uint32_t ip, int cls, uint64_t rx, uint64_t tx) {
+    if (!t->buckets) return;
+    struct flow_bucket *b = &t->buckets[flow_hash(ip, cls) & t->mask];
+
+    int w;
+    for (w = 0; w < FLOW_WAYS; w++) {
+        if ((b->used >> w & 1) && b->ip[w] == ip && b->cls[w] == cls) {
+            b->ref |= 1u << w;
+            b->rx[w] += rx;
+            b->tx[w] += tx;
+            return;
+        }
+    }
+
+    if (b->used != 0xff) {
+        w = __builtin_ctz(~b->used & 0xffu);
+    } else {
+        // clock: clear reference bits until an unreferenced way comes up
+        while (b->ref >> b->hand & 1) {
+            b->ref &= ~(1u << b->hand);
+            b->hand = (b->hand + 1) % FLOW_WAYS;
+        }
+        w = b->hand;
+        b->hand = (b->hand + 1) % FLOW_WAYS;
+        t->evicted_rx += b->rx[w];
+        t->evicted_tx += b->tx[w];
+        t->evictions++;
+    }
+    b->used |= 1u << w;
+    b->ref |= 1u << w;
+    b->ip[w] = ip;
+    b->cls[w] = (uint8_t)cls;
+    b->rx[w] = rx;
+    b->tx[w] = tx;
+}
+
+/* Move every entry into out[] and empty the table. Evicted bytes come
+ * last, as address 0 / FLOW_OTHER. cap should be flow_table_capacity()
+ * + 1; entries beyond cap are folded into that last record as well.
+ * Returns the number of records. */
+int flow_table_drain(struct flow_table *t, struct flow_record *out, int cap) {
+    if (!t->buckets || cap <= 0) return 0;
+    int n = 0;
+    uint64_t lost_rx = t->evicted_rx, lost_tx = t->evicted_tx;
+    for (uint32_t i = 0; i <= t->mask; i++) {
+        struct flow_bucket *b = &t->buckets[i];
+        if (!b->used) continue;
+        for (int w = 0; w < FLOW_WAYS; w++) {
+            if (!(b->used >> w & 1)) continue;
+            if (n < cap - 1) {
+                out[n].ip = b->ip[w];
+                out[n].cls = b->cls[w];
+                out[n].rx = b->rx[w];
+                out[n].tx = b->tx[w];
+                n++;
+            } else {
+                lost_rx += b->rx[w];
+                lost_tx += b->tx[w];
+            }
+        }
+        b->used = b->ref = 0;
+        b->hand = 0;
+    }
+    if (lost_rx || lost_tx) {
+        out[n].ip = 0;
+        out[n].cls = FLOW_OTHER;
+        out[n].rx = lost_rx;
+        out[n].tx = lost_tx;
+        n++;
+    }
+    t->evicted_rx = t->evicted_tx = 0;
+    t->evictions = 0;
+    return n;
+}
@@ -0,0 +1,312 @@
+// src/gen.c - synthetic daily files for scale-testing storage and reports
+//
+//   netacct gen [--from DAY] [--to DAY] [--iface NAME] [--ips N]
+//               [--interval SECS] [--rate BYTES/S] [--zipf S] [--active FRAC]
+//               [--gzip auto|all|none] [--seed N] <root_dir>
+//
+// Writes <root_dir>/<iface>/daily/YYYY-MM-DD.bin[.gz] with one record
+// every --interval seconds, encoded by storage_encode_record() so the
+// files are byte-for-byte what the collector would write. Client i gets
+// a share of the traffic proportional to 1/i^S (S = 0 is uniform), with
+// per-record noise; kernel totals are the per-IP sum plus a few percent
+// of traffic no client accounts for. The same seed gives the same corpus.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "netacct.h"
+
+enum { GEN_GZ_AUTO, GEN_GZ_ALL, GEN_GZ_NONE };
+
+struct gen_opts {
+    time_t from, to;        // UTC day starts, inclusive
+    const char *iface;
+    int ips;
+    int interval;
+    double rate;            // mean bytes/s over all clients
+    double zipf;
+    double active;          // chance a client has traffic in a record
+    int gzip;
+    uint64_t seed;
+};
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double rng_unit(void) {
+    return (double)(rng_next() >> 11) / 9007199254740992.0;   // [0, 1)
+}
+
+/* Normalized 1/rank^s weights. */
+static double *zipf_weights(int n, double s) {
+    double *w = malloc(sizeof(*w) * n);
+    if (!w) return NULL;
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        w[i] = 1.0 / pow((double)(i + 1), s);
+        sum += w[i];
+    }
+    for (int i = 0; i < n; i++) w[i] /= sum;
+    return w;
+}
+
+struct gen_out {
+    FILE *f;
+    gzFile gz;
+};
+
+static int out_write(struct gen_out *o, const void *buf, size_t len) {
+    if (o->gz) return gzwrite(o->gz, buf, (unsigned)len) == (int)len ? 0 : -1;
+    return fwrite(buf, 1, len, o->f) == len ? 0 : -1;
+}
+
+static int out_close(struct gen_out *o) {
+    if (o->gz) return gzclose(o->gz) == Z_OK ? 0 : -1;
+    return fclose(o->f) == 0 ? 0 : -1;
+}
+
+/* One day file. Returns the number of records written, -1 on error. */
+static long gen_day(const struct gen_opts *o, const char *dir, time_t day, int gz,
+                    const double *weights, struct ip_record *recs, char *buf) {
+    char date[32], path[1280];
+    struct tm gm;
+    gmtime_r(&day, &gm);
+    strftime(date, sizeof(date), "%Y-%m-%d", &gm);
+    snprintf(path, sizeof(path), "%s/%s.bin%s", dir, date, gz ? ".gz" : "");
+
+    char other[1300];
+    snprintf(other, sizeof(other), "%s/%s.bin%s", dir, date, gz ? "" : ".gz");
+    if (access(path, F_OK) == 0 || access(other, F_OK) == 0) {
+        fprintf(stderr, "[gen] %s/%s.bin* already exists\n", dir, date);
+        return -1;
+    }
+
+    struct gen_out out = {0};
+    // zlib's default level: reads the same as storage's -9 output and is
+    // many times faster to produce for a year of files
+    if (gz) out.gz = gzopen(path, "wb");
+    else out.f = fopen(path, "wb");
+    if (!out.f && !out.gz) {
+        perror(path);
+        return -1;
+    }
+
+    long records = 0;
+    double per_record = o->rate * o->interval;
+    for (time_t ts = day + o->interval; ts < day + 86400; ts += o->interval) {
+        int n = 0;
+        uint64_t sum = 0;
+        for (int i = 0; i < o->ips && n < MAX_FLUSH_ENTRIES; i++) {
+            if (o->active < 1.0 && rng_unit() >= o->active) continue;
+            // +-50% noise around the client's share
+            double bytes = per_record * weights[i] * (0.5 + rng_unit());
+            uint64_t total = (uint64_t)bytes;
+            if (total == 0) continue;   // the collector skips idle clients
+            // downloads dominate: 70-95% of a client's bytes are RX
+            uint64_t rx = (uint64_t)((double)total * (0.70 + 0.25 * rng_unit()));
+            recs[n].ip = htonl(0x0a000000u + 1 + (uint32_t)i);
+            recs[n].rx = rx;
+            recs[n].tx = total - rx;
+            sum += total;
+            n++;
+        }
+        // kernel counters also see traffic of unregistered hosts and headers
+        uint64_t kernel = sum + (uint64_t)((double)sum * (0.01 + 0.04 * rng_unit()));
+        uint64_t krx = (uint64_t)((double)kernel * 0.85);
+        size_t len = storage_encode_record(buf, (uint32_t)ts, krx, kernel - krx,
+                                           (uint16_t)n, recs);
+        if (out_write(&out, buf, len) != 0) {
+            fprintf(stderr, "[gen] write error on %s\n", path);
+            out_close(&out);
+            unlink(path);
+            return -1;
+        }
+        records++;
+    }
+    if (out_close(&out) != 0) {
+        fprintf(stderr, "[gen] close error on %s\n", path);
+        unlink(path);
+        return -1;
+    }
+    return records;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] <root_dir>\n"
+            "  --from DAY         first day, YYYY-MM-DD (default: 29 days before --to)\n"
+            "  --to DAY           last day (default: today, UTC)\n"
+            "  --iface NAME       interface directory (default: gen0)\n"
+            "  --ips N            clients, 10.0.0.1 upwards (default: 1000, max %d)\n"
+            "  --interval SECS    flush interval (default: 10)\n"
+            "  --rate BYTES       mean bytes/s over all clients (default: 1000000)\n"
+            "  --zipf S           traffic skew, share of client i ~ 1/i^S (default: 1.0)\n"
+            "  --active FRAC      chance a client has traffic in a record (default: 1.0)\n"
+            "  --gzip MODE        auto: all but the last day .bin.gz, as the collector\n"
+            "                     leaves them; all; none (default: auto)\n"
+            "  --seed N           random seed (default: 1)\n",
+            prog, MAX_FLUSH_ENTRIES);
+}
+
+int gen_run(int argc, char **argv) {
+    static const struct option longopts[] = {
+        { "from",     required_argument, NULL, 'f' },
+        { "to",       required_argument, NULL, 't' },
+        { "iface",    required_argument, NULL, 'i' },
+        { "ips",      required_argument, NULL, 'n' },
+        { "interval", required_argument, NULL, 'I' },
+        { "rate",     required_argument, NULL, 'r' },
+        { "zipf",     required_argument, NULL, 'z' },
+        { "active",   required_argument, NULL, 'a' },
+        { "gzip",     required_argument, NULL, 'g' },
+        { "seed",     required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    struct gen_opts o = {
+        .from = -1, .to = -1, .iface = "gen0", .ips = 1000, .interval = 10,
+        .rate = 1e6, .zipf = 1.0, .active = 1.0, .gzip = GEN_GZ_AUTO, .seed = 1,
+    };
+
+    optind = 1;
+    int c;
+    while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        char *end = NULL;
+        switch (c) {
+        case 'f':
+            if (util_parse_time(optarg, 0, &o.from) != 0) {
+                fprintf(stderr, "Invalid --from: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            if (util_parse_time(optarg, 0, &o.to) != 0) {
+                fprintf(stderr, "Invalid --to: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            o.iface = optarg;
+            break;
+        case 'n':
+            o.ips = atoi(optarg);
+            if (o.ips <= 0 || o.ips > MAX_FLUSH_ENTRIES) {
+                fprintf(stderr, "Invalid --ips: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'I':
+            o.interval = atoi(optarg);
+            if (o.interval <= 0 || o.interval > 86400) {
+                fprintf(stderr, "Invalid --interval: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            o.rate = strtod(optarg, &end);
+            if (*end || o.rate < 0) {
+                fprintf(stderr, "Invalid --rate: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'z':
+            o.zipf = strtod(optarg, &end);
+            if (*end || o.zipf < 0) {
+                fprintf(stderr, "Invalid --zipf: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'a':
+            o.active = strtod(optarg, &end);
+            if (*end || o.active <= 0 || o.active > 1) {
+                fprintf(stderr, "Invalid --active: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            if (strcmp(optarg, "auto") == 0) o.gzip = GEN_GZ_AUTO;
+            else if (strcmp(optarg, "all") == 0) o.gzip = GEN_GZ_ALL;
+            else if (strcmp(optarg, "none") == 0) o.gzip = GEN_GZ_NONE;
+            else {
+                fprintf(stderr, "Invalid --gzip: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            o.seed = strtoull(optarg, &end, 10);
+            if (*end) {
+                fprintf(stderr, "Invalid --seed: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *root = argv[optind];
+
+    // whole UTC days
+    if (o.to < 0) o.to = time(NULL);
+    o.to -= o.to % 86400;
+    if (o.from < 0) o.from = o.to - 29 * 86400;
+    o.from -= o.from % 86400;
+    if (o.from > o.to) {
+        fprintf(stderr, "--from is after --to\n");
+        return 1;
+    }
+
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s/%s/daily", root, o.iface);
+    ensure_dir(dir);
+
+    rng_state = o.seed ? o.seed : 1;
+    double *weights = zipf_weights(o.ips, o.zipf);
+    struct ip_record *recs = malloc(sizeof(*recs) * o.ips);
+    char *buf = malloc(storage_record_size((uint16_t)o.ips));
+    if (!weights || !recs || !buf) {
+        fprintf(stderr, "out of memory\n");
+        free(weights);
+        free(recs);
+        free(buf);
+        return 1;
+    }
+
+    long files = 0, records = 0;
+    int rc = 0;
+    for (time_t day = o.from; day <= o.to; day += 86400) {
+        int gz = o.gzip == GEN_GZ_ALL || (o.gzip == GEN_GZ_AUTO && day < o.to);
+        long n = gen_day(&o, dir, day, gz, weights, recs, buf);
+        if (n < 0) {
+            rc = 1;
+            break;
+        }
+        files++;
+        records += n;
+    }
+    fprintf(stderr, "[gen] %ld files, %ld records in %s\n", files, records, dir);
+
+    free(weights);
+    free(recs);
+    free(buf);
+    return rc;
+}
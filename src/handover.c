@@ -0,0 +1,440 @@
+// src/handover.c - passing a running daemon's state to its replacement
+//
+// `netacct daemon --takeover` starts next to a running daemon and takes
+// over from it without losing or double counting traffic. The new daemon
+// listens on <control_socket>.handover and asks the old one, over the
+// control socket ({"action":"handover"}) or by SIGUSR2 from the operator,
+// to connect. Then, over that connection:
+//
+//   new -> old  READY         captures are open, counting nothing yet
+//   old -> new  WINDOW T      T is a moment ahead; the old daemon now
+//                             counts only packets stamped before T
+//   new -> old  WINDOW_OK     the new one counts from T (before T came)
+//   old -> new  STATE + fds   after T, once the old captures are drained
+//                             and the poller stopped: unflushed counters,
+//                             running totals, registered clients, and the
+//                             control and metrics listening sockets
+//   new -> old  ACK           the old daemon exits without a last flush
+//
+// Either side sends ABORT (or drops the connection) to give up; the old
+// daemon then goes on as before. Past WINDOW_OK that costs data: packets
+// stamped from T until the old daemon reopens its captures are counted
+// by neither side. libpcap cannot adopt another process's
+// capture socket, so the new daemon opens its own and both split the
+// traffic at T by the kernel's packet timestamps. Kernel byte counters
+// carry over through .last_counts, which the old poller has written last.
+//
+// Messages are a struct handover_msg, then len payload bytes; file
+// descriptors travel as SCM_RIGHTS with the header. Both ends are the
+// same build on the same host, so structs go as they are in memory.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "netacct.h"
+
+#define HANDOVER_MAGIC "NHO1"
+#define HANDOVER_MAX_PAYLOAD (1u << 30)
+
+struct handover_msg {
+    char magic[4];
+    uint32_t type;                // HANDOVER_*
+    uint64_t arg;
+    uint64_t len;                 // payload bytes that follow
+};
+
+/* STATE payload: this, nclients addresses, then per interface an
+ * ipacct_state followed by its nips ipacct_ip_state and nflows
+ * flow_record. */
+struct handover_state {
+    uint32_t nclients;
+    uint32_t nifaces;
+    int32_t has_control;          // fds[0] is the control socket
+    int32_t metrics_port;         // > 0: the next fd listens on it
+};
+
+int handover_path(const char *control_sock, char *buf, size_t n) {
+    size_t need = strlen(control_sock) + sizeof(".handover");
+    if (need > n || need > sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        fprintf(stderr, "[handover] %s.handover: path too long\n", control_sock);
+        return -1;
+    }
+    snprintf(buf, n, "%s.handover", control_sock);
+    return 0;
+}
+
+static int unix_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return -1;
+    memcpy(addr->sun_path, path, strlen(path) + 1);
+    return 0;
+}
+
+/* New daemon: listen for the old one. Returns the socket or -1. */
+int handover_listen(const char *control_sock) {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct sockaddr_un addr;
+    if (handover_path(control_sock, path, sizeof(path)) != 0 || unix_addr(path, &addr) != 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("[handover] socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        fprintf(stderr, "[handover] %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* New daemon: ask the daemon serving control_sock to hand over. Returns
+ * 0 once it agreed, 1 if no daemon answers there, -1 on errors. */
+int handover_request(const char *control_sock) {
+    struct sockaddr_un addr;
+    if (unix_addr(control_sock, &addr) != 0) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int rc = errno == ENOENT || errno == ECONNREFUSED ? 1 : -1;
+        close(fd);
+        return rc;
+    }
+    static const char req[] = "{\"action\":\"handover\"}\n";
+    char reply[256];
+    size_t got = 0;
+    if (write(fd, req, sizeof(req) - 1) != (ssize_t)(sizeof(req) - 1)) {
+        close(fd);
+        return -1;
+    }
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (got < sizeof(reply) - 1 && !memchr(reply, '\n', got) && poll(&pfd, 1, 5000) > 0) {
+        ssize_t n = read(fd, reply + got, sizeof(reply) - 1 - got);
+        if (n <= 0) break;
+        got += n;
+    }
+    close(fd);
+    reply[got] = '\0';
+    if (!strstr(reply, "\"ok\":true")) {
+        fprintf(stderr, "[handover] %s refused: %s\n", control_sock, reply);
+        return -1;
+    }
+    return 0;
+}
+
+/* New daemon: wait up to timeout_ms for the old one to connect. */
+int handover_accept(int lfd, int timeout_ms) {
+    struct pollfd pfd = { .fd = lfd, .events = POLLIN };
+    int r;
+    while ((r = poll(&pfd, 1, timeout_ms)) < 0 && errno == EINTR) {
+    }
+    if (r <= 0) return -1;
+    return accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+}
+
+/* Old daemon: connect to the daemon taking over. */
+int handover_connect(const char *control_sock) {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct sockaddr_un addr;
+    if (handover_path(control_sock, path, sizeof(path)) != 0 || unix_addr(path, &addr) != 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "[handover] %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len, int timeout_ms) {
+    char *p = buf;
+    while (len) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int r = poll(&pfd, 1, timeout_ms);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int handover_send(int fd, int type, uint64_t arg, const void *payload, size_t len,
+                  const int *fds, int nfds) {
+    struct handover_msg m;
+    memcpy(m.magic, HANDOVER_MAGIC, 4);
+    m.type = (uint32_t)type;
+    m.arg = arg;
+    m.len = len;
+
+    struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0) {
+        memset(&ctl, 0, sizeof(ctl));
+        mh.msg_control = ctl.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+    ssize_t n;
+    while ((n = sendmsg(fd, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR) {
+    }
+    if (n < 0) return -1;
+    if (n < (ssize_t)sizeof(m) && write_all(fd, (char *)&m + n, sizeof(m) - n) != 0) return -1;
+    return len ? write_all(fd, payload, len) : 0;
+}
+
+/* Receive one message, which must be of the given type (ABORT and
+ * anything else fail). The payload is malloc()ed into *payload when
+ * asked for; fds, if given, receive up to HANDOVER_MAX_FDS descriptors. */
+int handover_recv(int fd, int type, uint64_t *arg, void **payload, size_t *len,
+                  int *fds, int *nfds, int timeout_ms) {
+    struct handover_msg m;
+    struct iovec iov = { .iov_base = &m, .iov_len = sizeof(m) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+        struct cmsghdr align;
+    } ctl;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+    if (nfds) *nfds = 0;
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) <= 0) return -1;
+    ssize_t n;
+    while ((n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) return -1;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        int k = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        int got[HANDOVER_MAX_FDS];
+        memcpy(got, CMSG_DATA(cm), sizeof(int) * k);
+        for (int i = 0; i < k; i++) {
+            if (fds && nfds && *nfds < HANDOVER_MAX_FDS) fds[(*nfds)++] = got[i];
+            else close(got[i]);
+        }
+    }
+    if (n < (ssize_t)sizeof(m) && read_all(fd, (char *)&m + n, sizeof(m) - n, timeout_ms) != 0)
+        return -1;
+    if (memcmp(m.magic, HANDOVER_MAGIC, 4) != 0 || m.len > HANDOVER_MAX_PAYLOAD) return -1;
+
+    void *buf = NULL;
+    if (m.len) {
+        buf = malloc(m.len);
+        if (!buf || read_all(fd, buf, m.len, timeout_ms) != 0) {
+            free(buf);
+            return -1;
+        }
+    }
+    if (m.type != (uint32_t)type) {
+        free(buf);
+        return -1;
+    }
+    if (arg) *arg = m.arg;
+    if (payload) *payload = buf;
+    else free(buf);
+    if (len) *len = m.len;
+    return 0;
+}
+
+/* ---------- State ---------- */
+
+struct blob {
+    char *buf;
+    size_t len, cap;
+};
+
+static int blob_put(struct blob *b, const void *p, size_t n) {
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 65536;
+        while (cap < b->len + n) cap *= 2;
+        char *nb = realloc(b->buf, cap);
+        if (!nb) return -1;
+        b->buf = nb;
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->len, p, n);
+    b->len += n;
+    return 0;
+}
+
+/* Old daemon: send every interface's counters and the registered
+ * clients as a STATE message, with the listening sockets (-1: none). */
+int handover_send_state(int fd, int control_fd, int metrics_fd, int metrics_port) {
+    struct blob b = {0};
+    struct handover_state hs = {0};
+    uint32_t *clients = NULL;
+    int ccap = 0;
+    int nclients = ipacct_clients(&clients, &ccap);
+    struct ipacct_ip_state *ips = NULL;
+    int cap = 0;
+    struct flow_record *flows = NULL;
+    int fcap = 0;
+    struct ipacct_state st[MAX_IFACES];
+    int nst = 0;
+
+    int rc = nclients < 0 ? -1 : blob_put(&b, &hs, sizeof(hs));   // patched below
+    if (rc == 0) rc = blob_put(&b, clients, sizeof(*clients) * nclients);
+    for (int i = 0; i < MAX_IFACES && rc == 0; i++) {
+        if (ipacct_export(&g_ifaces[i], &st[nst], &ips, &cap, &flows, &fcap) != 0) continue;
+        if (blob_put(&b, &st[nst], sizeof(st[nst])) != 0 ||
+            blob_put(&b, ips, sizeof(*ips) * st[nst].nips) != 0 ||
+            blob_put(&b, flows, sizeof(*flows) * st[nst].nflows) != 0)
+            rc = -1;
+        nst++;
+    }
+    if (rc == 0) {
+        int fds[HANDOVER_MAX_FDS], nfds = 0;
+        hs.nclients = (uint32_t)nclients;
+        hs.nifaces = (uint32_t)nst;
+        hs.has_control = control_fd >= 0;
+        if (control_fd >= 0) fds[nfds++] = control_fd;
+        if (metrics_fd >= 0) {
+            hs.metrics_port = metrics_port;
+            fds[nfds++] = metrics_fd;
+        }
+        memcpy(b.buf, &hs, sizeof(hs));
+        rc = handover_send(fd, HANDOVER_STATE, 0, b.buf, b.len, fds, nfds);
+    }
+    if (rc == 0) {
+        for (int i = 0; i < nst; i++)
+            fprintf(stderr, "[handover] %s: sent %u clients, %u flow entries\n",
+                    st[i].name, st[i].nips, st[i].nflows);
+    }
+    free(b.buf);
+    free(clients);
+    free(ips);
+    free(flows);
+    return rc;
+}
+
+/* Add the counters of a STATE payload and register its clients.
+ * Interfaces this daemon does not monitor get a slot of their own for
+ * the caller to flush and release. A malformed payload is refused
+ * before anything is applied. */
+static int import_state(const char *p, size_t len, struct handover_state *hs) {
+    const char *end = p + len;
+    if (len < sizeof(*hs)) return -1;
+    memcpy(hs, p, sizeof(*hs));
+    p += sizeof(*hs);
+
+    if ((size_t)(end - p) / sizeof(uint32_t) < hs->nclients) return -1;
+    const char *q = p + (size_t)hs->nclients * sizeof(uint32_t);
+    for (uint32_t i = 0; i < hs->nifaces; i++) {
+        struct ipacct_state st;
+        if ((size_t)(end - q) < sizeof(st)) return -1;
+        memcpy(&st, q, sizeof(st));
+        q += sizeof(st);
+        size_t need = (size_t)st.nips * sizeof(struct ipacct_ip_state) +
+                      (size_t)st.nflows * sizeof(struct flow_record);
+        if ((size_t)(end - q) < need) return -1;
+        q += need;
+    }
+    if (q != end) return -1;
+
+    if (hs->nclients) {
+        uint32_t *clients = malloc(sizeof(*clients) * hs->nclients);
+        if (!clients) return -1;
+        memcpy(clients, p, sizeof(*clients) * hs->nclients);
+        ipacct_add_clients(clients, (int)hs->nclients);
+        free(clients);
+    }
+    p += (size_t)hs->nclients * sizeof(uint32_t);
+
+    for (uint32_t i = 0; i < hs->nifaces; i++) {
+        struct ipacct_state st;
+        memcpy(&st, p, sizeof(st));
+        p += sizeof(st);
+        st.name[sizeof(st.name) - 1] = '\0';
+        size_t ilen = (size_t)st.nips * sizeof(struct ipacct_ip_state);
+        size_t flen = (size_t)st.nflows * sizeof(struct flow_record);
+        // copies: the payload gives no alignment guarantees
+        struct ipacct_ip_state *ips = malloc(ilen ? ilen : 1);
+        struct flow_record *flows = malloc(flen ? flen : 1);
+        struct iface_counters *ic = ipacct_iface_find(st.name);
+        if (!ic) ic = ipacct_iface_add(st.name);
+        if (ips && flows && ic) {
+            memcpy(ips, p, ilen);
+            memcpy(flows, p + ilen, flen);
+            ipacct_import(ic, &st, ips, flows);
+            fprintf(stderr, "[handover] %s: took over %u clients, %u flow entries\n",
+                    st.name, st.nips, st.nflows);
+        } else {
+            fprintf(stderr, "[handover] %s: cannot take over counters, dropped\n", st.name);
+        }
+        free(ips);
+        free(flows);
+        p += ilen + flen;
+    }
+    return 0;
+}
+
+/* New daemon: receive and apply the STATE message. The listening
+ * sockets it carried come back in *control_fd and *metrics_fd (-1 if
+ * none), with the port the latter is bound to. */
+int handover_recv_state(int fd, int *control_fd, int *metrics_fd, int *metrics_port,
+                        int timeout_ms) {
+    void *payload = NULL;
+    size_t len = 0;
+    int fds[HANDOVER_MAX_FDS], nfds = 0;
+    *control_fd = *metrics_fd = -1;
+    *metrics_port = 0;
+    if (handover_recv(fd, HANDOVER_STATE, NULL, &payload, &len, fds, &nfds, timeout_ms) != 0)
+        return -1;
+
+    struct handover_state hs;
+    int rc = import_state(payload, len, &hs);
+    free(payload);
+    int next = 0;
+    if (rc == 0 && hs.has_control && next < nfds) *control_fd = fds[next++];
+    if (rc == 0 && hs.metrics_port > 0 && next < nfds) {
+        *metrics_fd = fds[next++];
+        *metrics_port = hs.metrics_port;
+    }
+    for (; next < nfds; next++) close(fds[next]);
+    if (rc != 0) fprintf(stderr, "[handover] malformed state message\n");
+    return rc;
+}
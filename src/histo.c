@@ -0,0 +1,124 @@
+// src/histo.c - log-linear latency histograms for the hot paths
+//
+// Values (nanoseconds) below 2^HISTO_SUB_BITS get one bucket each; above
+// that every power of two is split into 2^HISTO_SUB_BITS linear buckets,
+// so any recorded value is known to within ~6% while a stage costs a
+// fixed 8 KB. Recording is a relaxed atomic increment, safe from any
+// thread. Call sites only exist when built with NETACCT_HISTO (make
+// HISTO=1); otherwise the HISTO_* macros expand to nothing.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "netacct.h"
+
+#define HISTO_SUB_BITS 4
+#define HISTO_SUB      (1u << HISTO_SUB_BITS)
+#define HISTO_BUCKETS  ((64 - HISTO_SUB_BITS + 1) * HISTO_SUB)
+
+struct histo {
+    uint64_t buckets[HISTO_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+
+static struct histo stages[HISTO_NSTAGES];
+
+static const char *stage_names[HISTO_NSTAGES] = {
+    [HISTO_PACKET]       = "packet_handler",
+    [HISTO_LOCK_WAIT]    = "ipacct_lock_wait",
+    [HISTO_SNAPSHOT]     = "snapshot_and_clear",
+    [HISTO_STORAGE]      = "storage_append",
+    [HISTO_FSYNC]        = "storage_fsync",
+};
+
+static __thread uint32_t sample_tick;
+
+uint64_t histo_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+int histo_sample(void) {
+    return (++sample_tick & ((1u << HISTO_SAMPLE_SHIFT) - 1)) == 0;
+}
+
+static unsigned bucket_of(uint64_t v) {
+    if (v < HISTO_SUB) return (unsigned)v;
+    unsigned msb = 63 - __builtin_clzll(v);
+    unsigned shift = msb - HISTO_SUB_BITS;
+    return ((shift + 1) << HISTO_SUB_BITS) | (unsigned)((v >> shift) & (HISTO_SUB - 1));
+}
+
+/* Highest value that maps to bucket b. */
+static uint64_t bucket_high(unsigned b) {
+    if (b < HISTO_SUB) return b;
+    unsigned shift = (b >> HISTO_SUB_BITS) - 1;
+    uint64_t mant = (b & (HISTO_SUB - 1)) | HISTO_SUB;
+    return ((mant + 1) << shift) - 1;
+}
+
+void histo_record(int stage, uint64_t ns) {
+    struct histo *h = &stages[stage];
+    __atomic_add_fetch(&h->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&h->count, 1, __ATOMIC_RELAXED);
+    uint64_t cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ns > cur && !__atomic_compare_exchange_n(&h->max, &cur, ns, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+int histo_enabled(void) {
+#ifdef NETACCT_HISTO
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+/* Summarise one stage. Buckets are read without stopping writers, so the
+ * figures are a close, not an exact, snapshot. */
+void histo_summary(int stage, struct histo_summary *out) {
+    static const double qs[] = { 0.50, 0.90, 0.99, 0.999 };
+    const struct histo *h = &stages[stage];
+    uint64_t counts[HISTO_BUCKETS];
+    uint64_t total = 0;
+
+    for (unsigned b = 0; b < HISTO_BUCKETS; b++) {
+        counts[b] = __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        total += counts[b];
+    }
+    memset(out, 0, sizeof(*out));
+    out->name = stage_names[stage];
+    out->count = total;
+    out->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if (total == 0) return;
+
+    uint64_t *dst[] = { &out->p50, &out->p90, &out->p99, &out->p999 };
+    uint64_t seen = 0;
+    unsigned q = 0;
+    for (unsigned b = 0; b < HISTO_BUCKETS && q < 4; b++) {
+        seen += counts[b];
+        while (q < 4 && (double)seen >= qs[q] * (double)total) {
+            uint64_t v = bucket_high(b);
+            *dst[q++] = v < out->max ? v : out->max;
+        }
+    }
+}
+
+void histo_dump(FILE *out) {
+    if (!histo_enabled()) return;
+    fprintf(out, "[histo] stage                  count        p50        p90        p99      p99.9        max (ns)\n");
+    for (int s = 0; s < HISTO_NSTAGES; s++) {
+        struct histo_summary hs;
+        histo_summary(s, &hs);
+        fprintf(out, "[histo] %-18s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+                " %10" PRIu64 " %10" PRIu64 "\n",
+                hs.name, hs.count, hs.p50, hs.p90, hs.p99, hs.p999, hs.max);
+    }
+}
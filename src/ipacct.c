@@ -1,45 +1,61 @@
-// simple per-iface single global implementation
+// per-iface counter tables
+//
+// g_ifaces[] is a fixed array of slots, one per configured interface, so
+// pointers handed to capture/poller threads stay valid across reloads; a
+// slot is live while in_use is set (checked under its lock). Registered
+// clients are kept in g_registry too, so an interface added by a reload
+// starts with the full client list.
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <time.h>
 #include "netacct.h"
 
 
-struct iface_counters g_iface;
-//static struct iface_counters g_iface;
+struct iface_counters g_ifaces[MAX_IFACES];
+static struct iface_counters g_registry;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;  // add/del/iface add
 
-// Expose the snapshot function symbol for storage/flush
-//int __attribute__((weak)) ipacct_snapshot_and_clear(uint64_t*,uint64_t*,struct ip_counter*,int*);
+// prefixes applied to interfaces added later
+static struct prefix cur_prefixes[MAX_PREFIXES];
+static int cur_nprefixes;
+static int cur_flow_entries;   // flow table size for interfaces added later
 
 //extern struct ip_counter *g_iface.entries[];
 
-/* Simple hash */
-static size_t ip_hash(uint32_t ip) {
-    return (ip ^ (ip >> 16)) % MAX_IP_ENTRIES;
+/* Bucket of ip in a table of nbuckets (a power of two). The mix spreads
+ * addresses that differ only in the host byte of a prefix. */
+static size_t ip_hash(uint32_t ip, uint32_t nbuckets) {
+    ip ^= ip >> 16;
+    ip *= 0x45d9f3bu;
+    ip ^= ip >> 16;
+    return ip & (nbuckets - 1);
 }
 
-static void list_add(struct ip_counter *e) {
-    e->lprev = g_iface.active_tail;
+static void list_add(struct iface_counters *ic, struct ip_counter *e) {
+    e->lprev = ic->active_tail;
     e->lnext = NULL;
-    if (g_iface.active_tail) g_iface.active_tail->lnext = e;
-    else g_iface.active_head = e;
-    g_iface.active_tail = e;
+    if (ic->active_tail) ic->active_tail->lnext = e;
+    else ic->active_head = e;
+    ic->active_tail = e;
 }
 
-static void list_remove(struct ip_counter *e) {
+static void list_remove(struct iface_counters *ic, struct ip_counter *e) {
     if (e->lprev) e->lprev->lnext = e->lnext;
-    else g_iface.active_head = e->lnext;
+    else ic->active_head = e->lnext;
     if (e->lnext) e->lnext->lprev = e->lprev;
-    else g_iface.active_tail = e->lprev;
+    else ic->active_tail = e->lprev;
 }
 
 /* Lookup entry by IP */
-static struct ip_counter *lookup(uint32_t ip) {
-    size_t h = ip_hash(ip);
-    struct ip_counter *e = g_iface.entries[h];
+static struct ip_counter *lookup(struct iface_counters *ic, uint32_t ip) {
+    if (!ic->nbuckets) return NULL;
+    size_t h = ip_hash(ip, ic->nbuckets);
+    struct ip_counter *e = ic->entries[h];
     while (e) {
         if (e->ip == ip) return e;
         e = e->next;
@@ -47,106 +63,754 @@ static struct ip_counter *lookup(uint32_t ip) {
     return NULL;
 }
 
-void ipacct_add_client(uint32_t ip) {
-    pthread_mutex_lock(&g_iface.lock);
-    if (lookup(ip)) {
-        pthread_mutex_unlock(&g_iface.lock);
-        return; // already present
-    }
-    size_t h = ip_hash(ip);
-    struct ip_counter *e = calloc(1, sizeof(*e));
-    if (!e) {
-        pthread_mutex_unlock(&g_iface.lock);
-        return;
+/* Rechain every entry into n buckets. The active list holds them all,
+ * so the old array is not walked. */
+static int rehash(struct iface_counters *ic, uint32_t n) {
+    struct ip_counter **b = calloc(n, sizeof(*b));
+    if (!b) return -1;
+    for (struct ip_counter *e = ic->active_head; e; e = e->lnext) {
+        size_t h = ip_hash(e->ip, n);
+        e->next = b[h];
+        b[h] = e;
     }
-    e->ip = ip;
-    e->rx_bytes = 0;
-    e->tx_bytes = 0;
-    e->next = g_iface.entries[h];
-    g_iface.entries[h] = e;
-    list_add(e);
+    free(ic->entries);
+    ic->entries = b;
+    ic->nbuckets = n;
+    return 0;
+}
+
+/* Link e into the table, doubling the buckets past two entries per
+ * bucket. A failed resize keeps the current (longer) chains; only a
+ * table that has no buckets at all yet fails. */
+static int insert(struct iface_counters *ic, struct ip_counter *e) {
+    if (!ic->nbuckets) {
+        if (rehash(ic, MAX_IP_ENTRIES) != 0) return -1;
+    } else if (ic->nentries >= ic->nbuckets * 2) {
+        rehash(ic, ic->nbuckets * 2);
+    }
+    size_t h = ip_hash(e->ip, ic->nbuckets);
+    e->next = ic->entries[h];
+    ic->entries[h] = e;
+    list_add(ic, e);
+    ic->nentries++;
+    return 0;
+}
+
+static void free_entries(struct iface_counters *ic) {
+    struct ip_counter *e = ic->active_head;
+    while (e) {
+        struct ip_counter *n = e->lnext;
+        free(e);
+        e = n;
+    }
+    free(ic->entries);
+    ic->entries = NULL;
+    ic->nbuckets = 0;
+    ic->active_head = ic->active_tail = NULL;
+    ic->nentries = 0;
+}
+
+static int in_prefixes(const struct iface_counters *ic, uint32_t ip) {
+    for (int i = 0; i < ic->nprefixes; i++) {
+        if ((ip & ic->prefixes[i].mask) == ic->prefixes[i].net) return 1;
+    }
+    return 0;
+}
+
+void ipacct_init(void) {
+    memset(g_ifaces, 0, sizeof(g_ifaces));
+    for (int i = 0; i < MAX_IFACES; i++) pthread_mutex_init(&g_ifaces[i].lock, NULL);
+    memset(&g_registry, 0, sizeof(g_registry));
+    pthread_mutex_init(&g_registry.lock, NULL);
+}
+
+/* ---------- Interfaces ---------- */
+
+struct iface_counters *ipacct_iface_find(const char *name) {
+    for (int i = 0; i < MAX_IFACES; i++) {
+        struct iface_counters *ic = &g_ifaces[i];
+        pthread_mutex_lock(&ic->lock);
+        int match = ic->in_use && strcmp(ic->name, name) == 0;
+        pthread_mutex_unlock(&ic->lock);
+        if (match) return ic;
+    }
+    return NULL;
+}
+
+/* Claim a free slot for iface, pre-populated with every registered client
+ * and the current prefixes. Returns NULL when all slots are taken. */
+struct iface_counters *ipacct_iface_add(const char *name) {
+    pthread_mutex_lock(&clients_lock);
+    struct flow_table flows[2];
+    if (flow_table_init(&flows[0], cur_flow_entries) != 0 ||
+        flow_table_init(&flows[1], cur_flow_entries) != 0) {
+        flow_table_free(&flows[0]);
+        pthread_mutex_unlock(&clients_lock);
+        return NULL;
+    }
+    struct iface_counters *ic = NULL;
+    for (int i = 0; i < MAX_IFACES && !ic; i++) {
+        pthread_mutex_lock(&g_ifaces[i].lock);
+        if (!g_ifaces[i].in_use) ic = &g_ifaces[i];
+        else pthread_mutex_unlock(&g_ifaces[i].lock);
+    }
+    if (!ic) {
+        pthread_mutex_unlock(&clients_lock);
+        flow_table_free(&flows[0]);
+        flow_table_free(&flows[1]);
+        return NULL;
+    }
+
+    // slot lock held: reset everything but the mutex, which comes last
+    // and must not be copied while readers may be waiting on it
+    memset(ic, 0, offsetof(struct iface_counters, lock));
+    snprintf(ic->name, sizeof(ic->name), "%s", name);
+    ic->sample_rate = 1;
+    ic->flow_scale = 1.0;
+    memcpy(ic->prefixes, cur_prefixes, sizeof(cur_prefixes));
+    ic->nprefixes = cur_nprefixes;
+    memcpy(ic->flows, flows, sizeof(flows));
+
+    pthread_mutex_lock(&g_registry.lock);
+    for (struct ip_counter *r = g_registry.active_head; r; r = r->lnext) {
+        struct ip_counter *e = calloc(1, sizeof(*e));
+        if (!e) break;
+        e->ip = r->ip;
+        if (insert(ic, e) != 0) {
+            free(e);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_registry.lock);
+
+    ic->in_use = 1;
+    pthread_mutex_unlock(&ic->lock);
+    pthread_mutex_unlock(&clients_lock);
+    return ic;
+}
+
+/* Release a slot. Capture for it must be stopped and its last deltas
+ * flushed by the caller; anything left is dropped. */
+void ipacct_iface_remove(struct iface_counters *ic) {
+    pthread_mutex_lock(&clients_lock);
+    pthread_mutex_lock(&ic->lock);
+    ic->in_use = 0;
+    ic->nprefixes = 0;
+    free_entries(ic);
+    flow_table_free(&ic->flows[0]);
+    flow_table_free(&ic->flows[1]);
+    pthread_mutex_unlock(&ic->lock);
+    pthread_mutex_unlock(&clients_lock);
+}
+
+/* Replace the auto-accounted prefixes on every interface. Addresses
+ * already picked up through an old prefix keep their counters. */
+void ipacct_set_prefixes(const struct prefix *p, int n) {
+    pthread_mutex_lock(&clients_lock);
+    memset(cur_prefixes, 0, sizeof(cur_prefixes));
+    memcpy(cur_prefixes, p, sizeof(*p) * n);
+    cur_nprefixes = n;
+    for (int i = 0; i < MAX_IFACES; i++) {
+        struct iface_counters *ic = &g_ifaces[i];
+        pthread_mutex_lock(&ic->lock);
+        if (ic->in_use) {
+            memcpy(ic->prefixes, cur_prefixes, sizeof(cur_prefixes));
+            ic->nprefixes = n;
+        }
+        pthread_mutex_unlock(&ic->lock);
+    }
+    pthread_mutex_unlock(&clients_lock);
+}
+
+/* Resize (or with 0, drop) the flow tables of every interface. Tables
+ * are allocated for the slots in use only, under clients_lock (which
+ * keeps that set fixed) but before any interface lock, so capture is
+ * held up only for the swap. Unflushed flow counts are dropped.
+ * Returns -1 and changes nothing if memory runs out. */
+int ipacct_set_flow_entries(int entries) {
+    pthread_mutex_lock(&clients_lock);
+    if (entries == cur_flow_entries) {
+        pthread_mutex_unlock(&clients_lock);
+        return 0;
+    }
+    struct flow_table fresh[MAX_IFACES][2];
+    memset(fresh, 0, sizeof(fresh));
+    int rc = 0;
+    for (int i = 0; i < MAX_IFACES && rc == 0; i++) {
+        if (!g_ifaces[i].in_use) continue;
+        for (int k = 0; k < 2 && rc == 0; k++)
+            rc = flow_table_init(&fresh[i][k], entries);
+    }
+    if (rc != 0) {
+        for (int i = 0; i < MAX_IFACES; i++) {
+            flow_table_free(&fresh[i][0]);
+            flow_table_free(&fresh[i][1]);
+        }
+        pthread_mutex_unlock(&clients_lock);
+        return -1;
+    }
+
+    cur_flow_entries = entries;
+    for (int i = 0; i < MAX_IFACES; i++) {
+        struct iface_counters *ic = &g_ifaces[i];
+        struct flow_table old[2];
+        if (!ic->in_use) continue;
+        pthread_mutex_lock(&ic->lock);
+        memcpy(old, ic->flows, sizeof(old));
+        memcpy(ic->flows, fresh[i], sizeof(old));
+        ic->flow_cur = 0;
+        pthread_mutex_unlock(&ic->lock);
+        flow_table_free(&old[0]);
+        flow_table_free(&old[1]);
+    }
+    pthread_mutex_unlock(&clients_lock);
+    return 0;
+}
+
+/* Record the sampling rate capture uses for ic (1 = every packet). */
+void ipacct_set_sample_rate(struct iface_counters *ic, int rate) {
+    pthread_mutex_lock(&ic->lock);
+    ic->sample_rate = rate > 1 ? rate : 1;
+    __atomic_store_n(&ic->sampled_bytes, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ic->lock);
+}
+
+/* ---------- Clients ---------- */
+
+/* Insert a batch into one table under a single lock acquisition. Nodes
+ * are allocated before taking the lock. When added[] is given, it records
+ * which addresses were new. Returns the number added, -1 on ENOMEM. */
+static int table_add(struct iface_counters *ic, const uint32_t *ips, int n, char *added) {
+    struct ip_counter **nodes = calloc(n, sizeof(*nodes));
+    if (!nodes) return -1;
+    for (int i = 0; i < n; i++) {
+        nodes[i] = calloc(1, sizeof(**nodes));
+        if (!nodes[i]) {
+            while (i--) free(nodes[i]);
+            free(nodes);
+            return -1;
+        }
+    }
+
+    int count = 0;
+    pthread_mutex_lock(&ic->lock);
+    if (ic == &g_registry || ic->in_use) {
+        for (int i = 0; i < n; i++) {
+            if (added) added[i] = 0;
+            if (lookup(ic, ips[i])) continue;
+            nodes[i]->ip = ips[i];
+            if (insert(ic, nodes[i]) != 0) break;
+            nodes[i] = NULL;   // now owned by the table
+            if (added) added[i] = 1;
+            count++;
+        }
+    }
+    pthread_mutex_unlock(&ic->lock);
+
+    for (int i = 0; i < n; i++) free(nodes[i]);
+    free(nodes);
+    return count;
+}
+
+/* Unlink a batch from one table; the removed nodes are returned as a
+ * list through ->next so they can be freed outside the lock. */
+static int table_del(struct iface_counters *ic, const uint32_t *ips, int n,
+                     struct ip_counter **victims) {
+    int removed = 0;
+    pthread_mutex_lock(&ic->lock);
+    for (int i = 0; i < n; i++) {
+        if (!ic->nbuckets) break;
+        size_t h = ip_hash(ips[i], ic->nbuckets);
+        struct ip_counter **pp = &ic->entries[h];
+        while (*pp) {
+            if ((*pp)->ip == ips[i]) {
+                struct ip_counter *victim = *pp;
+                *pp = victim->next;
+                list_remove(ic, victim);
+                ic->nentries--;
+                victim->next = *victims;
+                *victims = victim;
+                removed++;
+                break;
+            }
+            pp = &(*pp)->next;
+        }
+    }
+    pthread_mutex_unlock(&ic->lock);
+    return removed;
+}
+
+/* Register a batch of clients on every interface, one lock acquisition
+ * per table. Logging happens after the locks are released, so a few
+ * hundred clients reconnecting at once do not stall capture.
+ * Returns the number of clients that were not registered yet. */
+int ipacct_add_clients(const uint32_t *ips, int n) {
+    char *added = calloc(n, 1);
+    if (!added) return -1;
+
+    pthread_mutex_lock(&clients_lock);
+    int count = table_add(&g_registry, ips, n, added);
+    if (count > 0) {
+        for (int i = 0; i < MAX_IFACES; i++) table_add(&g_ifaces[i], ips, n, NULL);
+    }
+    pthread_mutex_unlock(&clients_lock);
+
+    for (int i = 0; i < n && count > 0; i++) {
+        if (!added[i]) continue;
+        char ipbuf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &ips[i], ipbuf, sizeof(ipbuf));
+        fprintf(stderr, "[ipacct] Registered client %s\n", ipbuf);
+    }
+    free(added);
+    return count;
+}
 
-    char ipbuf[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &ip, ipbuf, sizeof(ipbuf));
-    fprintf(stderr, "[ipacct] Registered client %s\n", ipbuf);
+/* Unregister a batch of clients; returns how many were registered. Their
+ * unflushed deltas are dropped, as before. */
+int ipacct_del_clients(const uint32_t *ips, int n) {
+    struct ip_counter *reg = NULL;
+    struct ip_counter *victims = NULL;
 
-    pthread_mutex_unlock(&g_iface.lock);
+    pthread_mutex_lock(&clients_lock);
+    int removed = table_del(&g_registry, ips, n, &reg);
+    for (int i = 0; i < MAX_IFACES; i++) table_del(&g_ifaces[i], ips, n, &victims);
+    pthread_mutex_unlock(&clients_lock);
+
+    while (reg) {
+        struct ip_counter *r = reg;
+        reg = r->next;
+        free(r);
+    }
+    while (victims) {
+        struct ip_counter *victim = victims;
+        victims = victim->next;
+
+        // flush stats before free (TODO: call into flush logic if needed)
+        char ipbuf[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &victim->ip, ipbuf, sizeof(ipbuf));
+        fprintf(stderr, "[ipacct] Removed client %s (rx=%lu, tx=%lu)\n",
+                ipbuf, victim->rx_bytes, victim->tx_bytes);
+        free(victim);
+    }
+    return removed;
+}
+
+void ipacct_add_client(uint32_t ip) {
+    ipacct_add_clients(&ip, 1);
 }
 
 void ipacct_del_client(uint32_t ip) {
-    pthread_mutex_lock(&g_iface.lock);
-    size_t h = ip_hash(ip);
-    struct ip_counter **pp = &g_iface.entries[h];
-    while (*pp) {
-        if ((*pp)->ip == ip) {
-            struct ip_counter *victim = *pp;
-            *pp = victim->next;
-            list_remove(victim);
-
-            // flush stats before free (TODO: call into flush logic if needed)
-            char ipbuf[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &ip, ipbuf, sizeof(ipbuf));
-            fprintf(stderr, "[ipacct] Removed client %s (rx=%lu, tx=%lu)\n",
-                    ipbuf, victim->rx_bytes, victim->tx_bytes);
-
-            free(victim);
-            pthread_mutex_unlock(&g_iface.lock);
-            return;
-        }
-        pp = &(*pp)->next;
-    }
-    pthread_mutex_unlock(&g_iface.lock);
-}
-
-int ipacct_accumulate_kernel_delta(uint64_t rx_delta, uint64_t tx_delta) {
-    pthread_mutex_lock(&g_iface.lock);
-    g_iface.kernel_rx_delta += rx_delta;
-    g_iface.kernel_tx_delta += tx_delta;
-    pthread_mutex_unlock(&g_iface.lock);
+    ipacct_del_clients(&ip, 1);
+}
+
+/* ---------- Counting ---------- */
+
+int ipacct_accumulate_kernel_delta(struct iface_counters *ic, uint64_t rx_delta, uint64_t tx_delta) {
+    pthread_mutex_lock(&ic->lock);
+    if (ic->in_use) {
+        ic->kernel_rx_delta += rx_delta;
+        ic->kernel_tx_delta += tx_delta;
+    }
+    pthread_mutex_unlock(&ic->lock);
     return 0;
 }
 
-int ipacct_update_rx(const char *iface, uint32_t ip, uint32_t bytes) {
-    (void)iface;
-    pthread_mutex_lock(&g_iface.lock);
-    //struct ip_counter *e = find_entry(ip);
-    struct ip_counter *e = lookup(ip);
-    if (e) e->rx_bytes += bytes;
-    pthread_mutex_unlock(&g_iface.lock);
+/* Entry for ip, created on first sight if it falls in a configured
+ * prefix. Past MAX_AUTO_ENTRIES the packet is not counted per IP, so a
+ * scan across a wide prefix cannot grow the table without bound.
+ * Called with the lock held. */
+static struct ip_counter *find_entry(struct iface_counters *ic, uint32_t ip) {
+    struct ip_counter *e = lookup(ic, ip);
+    if (e || ic->nprefixes == 0 || !in_prefixes(ic, ip)) return e;
+    if (ic->nentries >= MAX_AUTO_ENTRIES) {
+        ic->auto_overflows++;
+        return NULL;
+    }
+    e = calloc(1, sizeof(*e));
+    if (!e) return NULL;
+    e->ip = ip;
+    if (insert(ic, e) != 0) {
+        free(e);
+        return NULL;
+    }
+    return e;
+}
+
+/* Count one packet for a client; cls < 0 skips the flow breakdown. */
+static void count(struct iface_counters *ic, uint32_t ip, uint32_t bytes, int cls, int tx) {
+    HISTO_BEGIN_SAMPLED(t0);
+    pthread_mutex_lock(&ic->lock);
+    HISTO_END(HISTO_LOCK_WAIT, t0);
+    struct ip_counter *e = find_entry(ic, ip);
+    if (e) {
+        if (tx) e->tx_bytes += bytes;
+        else e->rx_bytes += bytes;
+        if (cls >= 0)
+            flow_table_add(&ic->flows[ic->flow_cur], ip, cls, tx ? 0 : bytes, tx ? bytes : 0);
+    }
+    pthread_mutex_unlock(&ic->lock);
+}
+
+int ipacct_update_rx(struct iface_counters *ic, uint32_t ip, uint32_t bytes) {
+    count(ic, ip, bytes, -1, 0);
     return 0;
 }
 
-int ipacct_update_tx(const char *iface, uint32_t ip, uint32_t bytes) {
-    (void)iface;
-    pthread_mutex_lock(&g_iface.lock);
-    //struct ip_counter *e = find_entry(ip);
-    struct ip_counter *e = lookup(ip);
-    if (e) e->tx_bytes += bytes;
-    pthread_mutex_unlock(&g_iface.lock);
+int ipacct_update_tx(struct iface_counters *ic, uint32_t ip, uint32_t bytes) {
+    count(ic, ip, bytes, -1, 1);
     return 0;
 }
 
-// helpers for poller/flush to access snapshot
-void ipacct_snapshot_and_clear(uint64_t *out_kernel_rx, uint64_t *out_kernel_tx,
-                               struct ip_record *out_ips, int *out_ip_count) {
-    pthread_mutex_lock(&g_iface.lock);
-    if (out_kernel_rx) *out_kernel_rx = g_iface.kernel_rx_delta;
-    if (out_kernel_tx) *out_kernel_tx = g_iface.kernel_tx_delta;
+/* Count a batch drained from a capture queue under one lock acquisition.
+ * Each packet queues a PKT_TX and a PKT_RX tuple; its bytes count once
+ * towards the sampled total, through the PKT_TX one. */
+void ipacct_update_batch(struct iface_counters *ic, const struct pkt_tuple *t, int n) {
+    uint64_t sampled = 0;
+    HISTO_BEGIN_SAMPLED(t0);
+    pthread_mutex_lock(&ic->lock);
+    HISTO_END(HISTO_LOCK_WAIT, t0);
+    struct flow_table *ft = &ic->flows[ic->flow_cur];
+    for (int i = 0; i < n; i++) {
+        int tx = t[i].dir == PKT_TX;
+        if (tx) sampled += t[i].len;
+        struct ip_counter *e = find_entry(ic, t[i].ip);
+        if (!e) continue;
+        if (tx) e->tx_bytes += t[i].len;
+        else e->rx_bytes += t[i].len;
+        if (t[i].cls >= 0)
+            flow_table_add(ft, t[i].ip, t[i].cls, tx ? 0 : t[i].len, tx ? t[i].len : 0);
+    }
+    if (ic->sample_rate > 1) __atomic_add_fetch(&ic->sampled_bytes, sampled, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ic->lock);
+}
+
+static uint32_t utc_day(time_t t) {
+    return (uint32_t)(t - t % 86400);
+}
+
+/* Copy the live counters of one interface for a query. The lock is held
+ * only for a flat copy of the active list; formatting is left to the
+ * caller. Returns the number of active clients, which may exceed cap
+ * (only cap are copied), or -1 if the slot is not in use. */
+int ipacct_view(struct iface_counters *ic, struct iface_view *iv, struct ip_view *out, int cap) {
+    uint32_t today = utc_day(time(NULL));
+    int n = 0;
+
+    pthread_mutex_lock(&ic->lock);
+    if (!ic->in_use) {
+        pthread_mutex_unlock(&ic->lock);
+        return -1;
+    }
+    // day totals of a previous day are stale until the first flush of today
+    int fresh = ic->day_start == today;
+    if (iv) {
+        memcpy(iv->name, ic->name, sizeof(iv->name));
+        iv->day_start = today;
+        iv->rx_delta = ic->kernel_rx_delta;
+        iv->tx_delta = ic->kernel_tx_delta;
+        iv->rx_today = (fresh ? ic->day_kernel_rx : 0) + iv->rx_delta;
+        iv->tx_today = (fresh ? ic->day_kernel_tx : 0) + iv->tx_delta;
+        iv->rx_total = ic->sum_kernel_rx + iv->rx_delta;
+        iv->tx_total = ic->sum_kernel_tx + iv->tx_delta;
+        iv->flow_evictions = ic->flow_evictions + ic->flows[ic->flow_cur].evictions;
+        iv->auto_overflows = ic->auto_overflows;
+    }
+    // unflushed sampled counts: the nominal rate is the best guess yet
+    uint64_t mul = ic->sample_rate > 1 ? (uint64_t)ic->sample_rate : 1;
+    for (struct ip_counter *e = ic->active_head; e; e = e->lnext, n++) {
+        if (n >= cap) continue;
+        out[n].ip = e->ip;
+        out[n].rx_delta = e->rx_bytes * mul;
+        out[n].tx_delta = e->tx_bytes * mul;
+        out[n].rx_today = (fresh ? e->day_rx : 0) + out[n].rx_delta;
+        out[n].tx_today = (fresh ? e->day_tx : 0) + out[n].tx_delta;
+        out[n].rx_total = e->sum_rx + out[n].rx_delta;
+        out[n].tx_total = e->sum_tx + out[n].tx_delta;
+    }
+    pthread_mutex_unlock(&ic->lock);
+    return n;
+}
+
+/* ipacct_view() into a caller-owned buffer that grows as clients are
+ * added. Returns the number of entries in *buf, or -1 for a free slot. */
+int ipacct_view_alloc(struct iface_counters *ic, struct iface_view *iv,
+                      struct ip_view **buf, int *cap) {
+    for (;;) {
+        int n = ipacct_view(ic, iv, *buf, *cap);
+        if (n <= *cap) return n;
+        int ncap = n + n / 4 + 16;
+        struct ip_view *nb = realloc(*buf, sizeof(*nb) * ncap);
+        if (!nb) return *cap;
+        *buf = nb;
+        *cap = ncap;
+    }
+}
+
+/* Factor from sampled to estimated bytes for this flush. Scaling by the
+ * ratio of the kernel delta to all sampled IPv4 bytes, rather than by
+ * the nominal rate, makes the estimates of all hosts add up to what the
+ * interface counted (L2 overhead and non-IPv4 traffic are spread over
+ * them in proportion). Without kernel counters or samples the nominal
+ * rate is used. Called with the lock held. */
+static double flush_scale(struct iface_counters *ic) {
+    if (ic->sample_rate <= 1) return 1.0;
+    uint64_t sampled = __atomic_exchange_n(&ic->sampled_bytes, 0, __ATOMIC_RELAXED);
+    uint64_t kernel = ic->kernel_rx_delta + ic->kernel_tx_delta;
+    if (!sampled || !kernel) return ic->sample_rate;
+    return (double)kernel / (double)sampled;
+}
+
+static uint64_t scaled(uint64_t bytes, double scale) {
+    return scale == 1.0 ? bytes : (uint64_t)((double)bytes * scale + 0.5);
+}
+
+/* Take this flush's deltas and zero them. Only clients with traffic are
+ * copied, into *buf (grown outside the lock as needed, at most
+ * MAX_FLUSH_ENTRIES per record); clients that did not fit keep their
+ * deltas for the next flush. With sampled capture the copies are
+ * estimates, see flush_scale(). Returns the number of records copied. */
+int ipacct_snapshot_and_clear(struct iface_counters *ic,
+                              uint64_t *out_kernel_rx, uint64_t *out_kernel_tx,
+                              struct ip_record **buf, int *cap) {
+    pthread_mutex_lock(&ic->lock);
+    int want = ic->nentries < MAX_FLUSH_ENTRIES ? (int)ic->nentries : MAX_FLUSH_ENTRIES;
+    pthread_mutex_unlock(&ic->lock);
+    if (want > *cap) {
+        struct ip_record *nb = realloc(*buf, sizeof(*nb) * want);
+        if (nb) {
+            *buf = nb;
+            *cap = want;
+        }
+    }
+    struct ip_record *out_ips = *buf;
+
+    uint32_t today = utc_day(time(NULL));
+    HISTO_BEGIN(t0);
+    pthread_mutex_lock(&ic->lock);
+    if (!ic->in_use) {
+        pthread_mutex_unlock(&ic->lock);
+        if (out_kernel_rx) *out_kernel_rx = 0;
+        if (out_kernel_tx) *out_kernel_tx = 0;
+        return 0;
+    }
+    // this flush lands in today's daily file: roll the running day totals
+    int new_day = ic->day_start != today;
+    ic->day_start = today;
+    if (new_day) {
+        ic->day_kernel_rx = 0;
+        ic->day_kernel_tx = 0;
+        for (struct ip_counter *e = ic->active_head; e; e = e->lnext) e->day_rx = e->day_tx = 0;
+    }
+    ic->day_kernel_rx += ic->kernel_rx_delta;
+    ic->day_kernel_tx += ic->kernel_tx_delta;
+    ic->sum_kernel_rx += ic->kernel_rx_delta;
+    ic->sum_kernel_tx += ic->kernel_tx_delta;
+    if (out_kernel_rx) *out_kernel_rx = ic->kernel_rx_delta;
+    if (out_kernel_tx) *out_kernel_tx = ic->kernel_tx_delta;
+    double scale = flush_scale(ic);
+    ic->flow_scale = scale;
     // copy ip counters
-    size_t n = 0;
-    for (struct ip_counter *e = g_iface.active_head; e && n < MAX_IP_ENTRIES; e = e->lnext) {
+    int n = 0;
+    for (struct ip_counter *e = ic->active_head; e && n < *cap; e = e->lnext) {
+        if (e->rx_bytes == 0 && e->tx_bytes == 0) continue;
+        uint64_t rx = scaled(e->rx_bytes, scale);
+        uint64_t tx = scaled(e->tx_bytes, scale);
         out_ips[n].ip = e->ip;
-        out_ips[n].rx = e->rx_bytes;
-        out_ips[n].tx = e->tx_bytes;
+        out_ips[n].rx = rx;
+        out_ips[n].tx = tx;
+        e->day_rx += rx;
+        e->day_tx += tx;
+        e->sum_rx += rx;
+        e->sum_tx += tx;
         // zero per-flush deltas after snapshot
         e->rx_bytes = 0;
         e->tx_bytes = 0;
         n++;
     }
 
-    if (out_ip_count) *out_ip_count = n;
     // zero kernel deltas
-    g_iface.kernel_rx_delta = 0;
-    g_iface.kernel_tx_delta = 0;
-    pthread_mutex_unlock(&g_iface.lock);
+    ic->kernel_rx_delta = 0;
+    ic->kernel_tx_delta = 0;
+    // retire this flush's flow table; ipacct_snapshot_flows() drains it
+    if (ic->flows[0].buckets) ic->flow_cur ^= 1;
+    pthread_mutex_unlock(&ic->lock);
+    HISTO_END(HISTO_SNAPSHOT, t0);
+    return n;
+}
+
+/* Per-(client, class) bytes of the flush interval that the last
+ * ipacct_snapshot_and_clear() closed, moved into *buf (grown outside the
+ * lock). Returns the number of records, 0 when flows are off. */
+int ipacct_snapshot_flows(struct iface_counters *ic, struct flow_record **buf, int *cap) {
+    pthread_mutex_lock(&ic->lock);
+    int want = flow_table_capacity(&ic->flows[ic->flow_cur ^ 1]) + 1;
+    pthread_mutex_unlock(&ic->lock);
+    if (want == 1) return 0;
+    if (want > *cap) {
+        struct flow_record *nb = realloc(*buf, sizeof(*nb) * want);
+        if (nb) {
+            *buf = nb;
+            *cap = want;
+        }
+    }
+
+    pthread_mutex_lock(&ic->lock);
+    struct flow_table *t = &ic->flows[ic->flow_cur ^ 1];
+    ic->flow_evictions += t->evictions;
+    int n = ic->in_use ? flow_table_drain(t, *buf, *cap) : 0;
+    double scale = ic->flow_scale;
+    pthread_mutex_unlock(&ic->lock);
+    for (int i = 0; scale != 1.0 && i < n; i++) {
+        (*buf)[i].rx = scaled((*buf)[i].rx, scale);
+        (*buf)[i].tx = scaled((*buf)[i].tx, scale);
+    }
+    return n;
+}
+
+/* ---------- Handover ---------- */
+
+/* Copy the unflushed counters and running totals of ic for a daemon
+ * taking over, leaving them in place (the flow table is drained and
+ * refilled). *ips and *flows grow outside the lock as needed. Returns
+ * 0, or -1 for a free slot or when memory runs out. */
+int ipacct_export(struct iface_counters *ic, struct ipacct_state *st,
+                  struct ipacct_ip_state **ips, int *cap,
+                  struct flow_record **flows, int *fcap) {
+    for (;;) {
+        pthread_mutex_lock(&ic->lock);
+        int want = (int)ic->nentries;
+        int fwant = flow_table_capacity(&ic->flows[ic->flow_cur]) + 1;
+        pthread_mutex_unlock(&ic->lock);
+        if (want > *cap) {
+            struct ipacct_ip_state *nb = realloc(*ips, sizeof(*nb) * want);
+            if (!nb) return -1;
+            *ips = nb;
+            *cap = want;
+        }
+        if (fwant > *fcap) {
+            struct flow_record *nf = realloc(*flows, sizeof(*nf) * fwant);
+            if (!nf) return -1;
+            *flows = nf;
+            *fcap = fwant;
+        }
+
+        pthread_mutex_lock(&ic->lock);
+        if (!ic->in_use) {
+            pthread_mutex_unlock(&ic->lock);
+            return -1;
+        }
+        struct flow_table *t = &ic->flows[ic->flow_cur];
+        if ((int)ic->nentries > *cap || flow_table_capacity(t) + 1 > *fcap) {
+            pthread_mutex_unlock(&ic->lock);   // a client was added meanwhile
+            continue;
+        }
+        memset(st, 0, sizeof(*st));
+        memcpy(st->name, ic->name, sizeof(st->name));
+        st->day_start = ic->day_start;
+        st->sample_rate = ic->sample_rate;
+        st->kernel_rx_delta = ic->kernel_rx_delta;
+        st->kernel_tx_delta = ic->kernel_tx_delta;
+        st->day_kernel_rx = ic->day_kernel_rx;
+        st->day_kernel_tx = ic->day_kernel_tx;
+        st->sum_kernel_rx = ic->sum_kernel_rx;
+        st->sum_kernel_tx = ic->sum_kernel_tx;
+        st->sampled_bytes = __atomic_load_n(&ic->sampled_bytes, __ATOMIC_RELAXED);
+        st->flow_evictions = ic->flow_evictions + t->evictions;
+        int n = 0;
+        for (struct ip_counter *e = ic->active_head; e; e = e->lnext, n++) {
+            struct ipacct_ip_state *s = &(*ips)[n];
+            s->ip = e->ip;
+            s->pad = 0;
+            s->rx = e->rx_bytes;
+            s->tx = e->tx_bytes;
+            s->day_rx = e->day_rx;
+            s->day_tx = e->day_tx;
+            s->sum_rx = e->sum_rx;
+            s->sum_tx = e->sum_tx;
+        }
+        st->nips = (uint32_t)n;
+        uint64_t evictions = t->evictions;
+        int nf = flow_table_drain(t, *flows, *fcap);
+        for (int i = 0; i < nf; i++) {
+            const struct flow_record *f = &(*flows)[i];
+            flow_table_add(t, f->ip, f->cls, f->rx, f->tx);
+        }
+        t->evictions = evictions;
+        st->nflows = (uint32_t)nf;
+        pthread_mutex_unlock(&ic->lock);
+        return 0;
+    }
+}
+
+/* Add the counters a previous daemon exported for this interface. Its
+ * running totals are taken over as they are (this daemon has not
+ * flushed yet), its unflushed counts are added to what capture counted
+ * here since the cut. Counts taken at another sampling rate are
+ * converted to this one. */
+void ipacct_import(struct iface_counters *ic, const struct ipacct_state *st,
+                   const struct ipacct_ip_state *ips, const struct flow_record *flows) {
+    pthread_mutex_lock(&ic->lock);
+    if (!ic->in_use) {
+        pthread_mutex_unlock(&ic->lock);
+        return;
+    }
+    double f = 1.0;
+    if (st->sample_rate > 0 && st->sample_rate != ic->sample_rate)
+        f = (double)st->sample_rate / (double)ic->sample_rate;
+    if (st->day_start >= ic->day_start) {
+        ic->day_start = st->day_start;
+        ic->day_kernel_rx += st->day_kernel_rx;
+        ic->day_kernel_tx += st->day_kernel_tx;
+    }
+    ic->kernel_rx_delta += st->kernel_rx_delta;
+    ic->kernel_tx_delta += st->kernel_tx_delta;
+    ic->sum_kernel_rx += st->sum_kernel_rx;
+    ic->sum_kernel_tx += st->sum_kernel_tx;
+    ic->flow_evictions += st->flow_evictions;
+    __atomic_add_fetch(&ic->sampled_bytes, scaled(st->sampled_bytes, f), __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < st->nips; i++) {
+        struct ip_counter *e = lookup(ic, ips[i].ip);
+        if (!e) {
+            e = calloc(1, sizeof(*e));
+            if (!e) break;
+            e->ip = ips[i].ip;
+            if (insert(ic, e) != 0) {
+                free(e);
+                break;
+            }
+        }
+        e->rx_bytes += scaled(ips[i].rx, f);
+        e->tx_bytes += scaled(ips[i].tx, f);
+        if (st->day_start == ic->day_start) {
+            e->day_rx += ips[i].day_rx;
+            e->day_tx += ips[i].day_tx;
+        }
+        e->sum_rx += ips[i].sum_rx;
+        e->sum_tx += ips[i].sum_tx;
+    }
+    struct flow_table *t = &ic->flows[ic->flow_cur];
+    for (uint32_t i = 0; i < st->nflows; i++)
+        flow_table_add(t, flows[i].ip, flows[i].cls, scaled(flows[i].rx, f),
+                       scaled(flows[i].tx, f));
+    pthread_mutex_unlock(&ic->lock);
+}
+
+/* Registered clients (config and control socket) into a caller-owned
+ * buffer. Returns their number, -1 when memory runs out. */
+int ipacct_clients(uint32_t **buf, int *cap) {
+    pthread_mutex_lock(&g_registry.lock);
+    for (;;) {
+        int n = (int)g_registry.nentries;
+        if (n <= *cap) break;
+        pthread_mutex_unlock(&g_registry.lock);
+        uint32_t *nb = realloc(*buf, sizeof(*nb) * n);
+        if (!nb) return -1;
+        *buf = nb;
+        *cap = n;
+        pthread_mutex_lock(&g_registry.lock);
+    }
+    int n = 0;
+    for (struct ip_counter *r = g_registry.active_head; r; r = r->lnext) (*buf)[n++] = r->ip;
+    pthread_mutex_unlock(&g_registry.lock);
+    return n;
 }
@@ -0,0 +1,173 @@
+// src/iptable.c - arena allocator + open-addressing IPv4 table
+//
+// Values live in a chunked bump arena and never move; the table itself is
+// a power-of-two array of {ip, generation, value} slots probed linearly.
+// Resetting bumps the generation and rewinds the arena, so clearing a
+// table with 100k entries costs the same as clearing an empty one.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "netacct.h"
+
+#define ARENA_CHUNK (256 * 1024)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t cap;
+    unsigned char data[];
+};
+
+/* ---------- Arena ---------- */
+
+void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    struct arena_chunk *c = a->cur;
+    while (c && c->used + n > c->cap) {
+        // reuse chunks kept from before the last reset
+        c = c->next;
+        if (c) c->used = 0;
+    }
+    if (!c) {
+        size_t cap = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        c = malloc(sizeof(*c) + cap);
+        if (!c) return NULL;
+        c->next = NULL;
+        c->used = 0;
+        c->cap = cap;
+        if (a->cur) {
+            c->next = a->cur->next;
+            a->cur->next = c;
+        } else {
+            a->head = c;
+        }
+    }
+    a->cur = c;
+    void *p = c->data + c->used;
+    c->used += n;
+    return p;
+}
+
+void arena_reset(struct arena *a) {
+    a->cur = a->head;
+    if (a->head) a->head->used = 0;
+}
+
+void arena_free(struct arena *a) {
+    struct arena_chunk *c = a->head;
+    while (c) {
+        struct arena_chunk *n = c->next;
+        free(c);
+        c = n;
+    }
+    a->head = a->cur = NULL;
+}
+
+/* ---------- Table ---------- */
+
+/* murmur3 finalizer: every input bit affects every output bit, so the
+ * low bits used as index depend on the whole address and not just on its
+ * first octet (addresses are kept in network byte order). */
+static inline uint32_t ip_mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static int alloc_slots(struct iptable *t, uint32_t cap) {
+    t->slots = calloc(cap, sizeof(*t->slots));
+    if (!t->slots) return -1;
+    t->mask = cap - 1;
+    return 0;
+}
+
+int iptable_init(struct iptable *t, size_t val_size, uint32_t initial_cap) {
+    memset(t, 0, sizeof(*t));
+    uint32_t cap = 64;
+    while (cap < initial_cap) cap <<= 1;
+    t->val_size = val_size;
+    t->gen = 1;   // calloc'd slots have gen 0 = empty
+    return alloc_slots(t, cap);
+}
+
+static int grow(struct iptable *t) {
+    struct iptable_slot *old = t->slots;
+    uint32_t old_cap = t->mask + 1;
+    if (alloc_slots(t, old_cap * 2) != 0) {
+        t->slots = old;
+        return -1;
+    }
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (old[i].gen != t->gen) continue;
+        uint32_t j = ip_mix(old[i].ip) & t->mask;
+        while (t->slots[j].gen == t->gen) j = (j + 1) & t->mask;
+        t->slots[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+void *iptable_find(const struct iptable *t, uint32_t ip) {
+    uint32_t i = ip_mix(ip) & t->mask;
+    while (t->slots[i].gen == t->gen) {
+        if (t->slots[i].ip == ip) return t->slots[i].val;
+        i = (i + 1) & t->mask;
+    }
+    return NULL;
+}
+
+void *iptable_get(struct iptable *t, uint32_t ip, int *created) {
+    if (created) *created = 0;
+    uint32_t i = ip_mix(ip) & t->mask;
+    while (t->slots[i].gen == t->gen) {
+        if (t->slots[i].ip == ip) return t->slots[i].val;
+        i = (i + 1) & t->mask;
+    }
+
+    // keep the load factor under 3/4 so probe chains stay short
+    if ((t->count + 1) * 4 > (t->mask + 1) * 3) {
+        if (grow(t) != 0) return NULL;
+        return iptable_get(t, ip, created);
+    }
+
+    void *v = arena_alloc(&t->arena, t->val_size);
+    if (!v) return NULL;
+    memset(v, 0, t->val_size);
+    t->slots[i].ip = ip;
+    t->slots[i].gen = t->gen;
+    t->slots[i].val = v;
+    t->count++;
+    if (created) *created = 1;
+    return v;
+}
+
+void iptable_reset(struct iptable *t) {
+    t->count = 0;
+    if (++t->gen == 0) {
+        // generation wrapped: stale slots could look live again
+        memset(t->slots, 0, sizeof(*t->slots) * (t->mask + 1));
+        t->gen = 1;
+    }
+    arena_reset(&t->arena);
+}
+
+void iptable_free(struct iptable *t) {
+    free(t->slots);
+    t->slots = NULL;
+    arena_free(&t->arena);
+}
+
+/* Iterate live values: start with *pos = 0, stop on NULL. */
+void *iptable_next(const struct iptable *t, uint32_t *pos) {
+    while (*pos <= t->mask) {
+        const struct iptable_slot *s = &t->slots[(*pos)++];
+        if (s->gen == t->gen) return s->val;
+    }
+    return NULL;
+}
@@ -4,20 +4,49 @@
 
 #include "netacct.h"
 
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [daemon] [-c|--config FILE] [--takeover]\n"
+            "       %s report ...\n"
+            "       %s gen ...\n"
+            "       %s merge ...\n", prog, prog, prog, prog);
+}
+
 int main(int argc, char **argv) {
     struct cfg cfg;
-    cfg.iface = "enp0s3";
-    cfg.poll_interval = 2;
-    cfg.flush_interval = 10;
-    cfg.root_dir = "./data";
+    config_defaults(&cfg);
 
     if (argc > 1 && strcmp(argv[1], "report") == 0) {
         return reporter_run(argc-1, argv+1);
-    } else {
-        collector_init(&cfg);
-        printf("netacct starting for iface=%s\n", cfg.iface);
-        collector_run(&cfg);
-        printf("netacct stopped\n");
     }
+    if (argc > 1 && strcmp(argv[1], "gen") == 0) {
+        return gen_run(argc-1, argv+1);
+    }
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) {
+        return merge_run(argc-1, argv+1);
+    }
+
+    int i = 1, takeover = 0;
+    if (i < argc && strcmp(argv[i], "daemon") == 0) i++;
+    for (; i < argc; i++) {
+        if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) && i + 1 < argc) {
+            if (config_load(argv[++i], &cfg) != 0) return 1;
+        } else if (strcmp(argv[i], "--takeover") == 0) {
+            takeover = 1;   // replace the daemon on the same control socket
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (collector_init(&cfg) != 0) {
+        fprintf(stderr, "netacct: init failed\n");
+        return 1;
+    }
+    printf("netacct starting for iface=%s", cfg.ifaces[0]);
+    for (int j = 1; j < cfg.iface_count; j++) printf(",%s", cfg.ifaces[j]);
+    printf("\n");
+    if (collector_run(&cfg, takeover) != 0) return 1;
+    printf("netacct stopped\n");
     return 0;
 }
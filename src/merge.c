@@ -0,0 +1,623 @@
+// src/merge.c - k-way merge of daily trees from several hosts
+//
+//   netacct merge [--from WHEN] [--to WHEN] [--iface NAME] [--format csv|ndjson]
+//                 [--out DIR [--name NAME] [--step N[smhd]]] [HOST=]ROOT...
+//
+// Each ROOT is a storage root as copied from one host (ROOT/<iface>/daily);
+// HOST defaults to the last component of ROOT. Every (host, iface) pair
+// is one stream: its daily files oldest first, read through a block
+// buffer that records are decoded from in place. A min-heap on the record
+// timestamp interleaves the streams, so records come out in time order
+// while each stream holds one block and one record, however many days
+// or hosts are merged.
+//
+// Without --out every record is printed as rows tagged with its host and
+// interface. With --out the records of all streams are summed into
+// --step buckets and written as one daily tree, DIR/<name>/daily, that
+// `netacct report` reads like any other. `netacct report --root` runs the
+// same merge to report over several roots at once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "netacct.h"
+
+#define MERGE_BLOCK (1 << 16)   // initial block; grows to the largest record
+
+struct merge_stream {
+    char host[64];
+    char iface[MAX_IFACE_NAME];
+    char dir[1024];         // <root>/<iface>/daily
+    struct datafile *files;
+    int nfiles, next;
+    gzFile gz;              // current file, NULL between files
+    unsigned char *blk;
+    size_t cap, len, off;
+    struct record_header h; // current record
+    const struct ip_entry_on_disk *entries;
+    uint32_t last_ts;       // last record handed out
+};
+
+struct merge {
+    struct merge_stream *s;
+    int n, cap;
+    int *heap;              // stream indices ordered by (h.ts, index)
+    int nheap;
+    int pending;            // stream of the record returned last, -1 = none
+    time_t from, to;
+    time_t first_day, last_day;
+};
+
+/* Host and interface tags are printed unquoted in CSV rows. */
+static int valid_tag(const char *s) {
+    if (!*s) return 0;
+    for (; *s; s++) {
+        char c = *s;
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+              c == '.' || c == '_' || c == '-'))
+            return 0;
+    }
+    return 1;
+}
+
+/* Daily files of s inside [from, to], oldest first. */
+static int list_files(struct merge *m, struct merge_stream *s) {
+    int n = util_list_datafiles(s->dir, m->from, m->to, &s->files);
+    if (n < 0) {
+        fprintf(stderr, "[merge] cannot open %s\n", s->dir);
+        return -1;
+    }
+    s->nfiles = n;
+    if (n) {
+        if (m->first_day < 0 || s->files[0].day < m->first_day) m->first_day = s->files[0].day;
+        if (s->files[n-1].day > m->last_day) m->last_day = s->files[n-1].day;
+    }
+    return 0;
+}
+
+/* n contiguous bytes of the current file, refilling the block as needed.
+ * NULL at the end of the file, on a truncated tail or a read error. The
+ * pointer is good until the next call. */
+static const unsigned char *stream_take(struct merge_stream *s, size_t n) {
+    if (s->len - s->off < n) {
+        if (n > s->cap) {
+            size_t cap = s->cap;
+            while (cap < n) cap *= 2;
+            unsigned char *nb = realloc(s->blk, cap);
+            if (!nb) {
+                fprintf(stderr, "[merge] out of memory\n");
+                return NULL;
+            }
+            s->blk = nb;
+            s->cap = cap;
+        }
+        memmove(s->blk, s->blk + s->off, s->len - s->off);
+        s->len -= s->off;
+        s->off = 0;
+        while (s->len < n) {
+            int r = gzread(s->gz, s->blk + s->len, (unsigned)(s->cap - s->len));
+            if (r <= 0) return NULL;
+            s->len += (size_t)r;
+        }
+    }
+    const unsigned char *p = s->blk + s->off;
+    s->off += n;
+    return p;
+}
+
+/* Load the next record of s inside [from, to]. Returns 1, 0 once its
+ * last file is done (the block is released then), -1 on error. */
+static int stream_advance(struct merge *m, struct merge_stream *s) {
+    for (;;) {
+        if (!s->gz) {
+            if (s->next == s->nfiles) {
+                free(s->blk);
+                s->blk = NULL;
+                s->cap = 0;
+                return 0;
+            }
+            char path[1100];
+            snprintf(path, sizeof(path), "%s/%s", s->dir, s->files[s->next++].name);
+            // gzread() passes plain files through, so .bin takes this path too
+            s->gz = gzopen(path, "rb");
+            if (!s->gz) {
+                fprintf(stderr, "[merge] cannot open %s\n", path);
+                continue;
+            }
+            if (!s->blk) {
+                s->blk = malloc(MERGE_BLOCK);
+                if (!s->blk) {
+                    fprintf(stderr, "[merge] out of memory\n");
+                    return -1;
+                }
+                s->cap = MERGE_BLOCK;
+            }
+            s->len = s->off = 0;
+        }
+
+        const unsigned char *p = stream_take(s, sizeof(s->h));
+        if (p) {
+            memcpy(&s->h, p, sizeof(s->h));
+            p = stream_take(s, (size_t)s->h.ip_count * sizeof(struct ip_entry_on_disk));
+        }
+        if (!p) {
+            gzclose(s->gz);
+            s->gz = NULL;
+            continue;
+        }
+        if ((time_t)s->h.ts < m->from || (time_t)s->h.ts > m->to) continue;
+        s->entries = (const struct ip_entry_on_disk *)p;
+        return 1;
+    }
+}
+
+static int stream_before(const struct merge *m, int a, int b) {
+    uint32_t ta = m->s[a].h.ts, tb = m->s[b].h.ts;
+    return ta != tb ? ta < tb : a < b;
+}
+
+static void heap_down(struct merge *m, int i) {
+    for (;;) {
+        int l = 2*i + 1, r = l + 1, x = i;
+        if (l < m->nheap && stream_before(m, m->heap[l], m->heap[x])) x = l;
+        if (r < m->nheap && stream_before(m, m->heap[r], m->heap[x])) x = r;
+        if (x == i) return;
+        int t = m->heap[i]; m->heap[i] = m->heap[x]; m->heap[x] = t;
+        i = x;
+    }
+}
+
+static void heap_up(struct merge *m, int i) {
+    while (i > 0) {
+        int p = (i - 1) / 2;
+        if (!stream_before(m, m->heap[i], m->heap[p])) return;
+        int t = m->heap[i]; m->heap[i] = m->heap[p]; m->heap[p] = t;
+        i = p;
+    }
+}
+
+static int add_stream(struct merge *m, const char *host, const char *root, const char *iface) {
+    if (!valid_tag(iface)) {
+        fprintf(stderr, "[merge] skipping %s/%s: unsupported interface name\n", root, iface);
+        return 0;
+    }
+    if (m->n == m->cap) {
+        int cap = m->cap ? m->cap * 2 : 16;
+        struct merge_stream *ns = realloc(m->s, sizeof(*ns) * cap);
+        if (!ns) return -1;
+        m->s = ns;
+        m->cap = cap;
+    }
+    struct merge_stream *s = &m->s[m->n++];
+    memset(s, 0, sizeof(*s));
+    snprintf(s->host, sizeof(s->host), "%s", host);
+    snprintf(s->iface, sizeof(s->iface), "%s", iface);
+    snprintf(s->dir, sizeof(s->dir), "%s/%s/daily", root, iface);
+    return 0;
+}
+
+static int stream_iface_cmp(const void *a, const void *b) {
+    return strcmp(((const struct merge_stream *)a)->iface, ((const struct merge_stream *)b)->iface);
+}
+
+/* One root: "HOST=DIR" or "DIR", tagged with DIR's last component. */
+static int add_root(struct merge *m, const char *spec, const char *iface) {
+    char host[64];
+    const char *root = spec;
+    const char *eq = strchr(spec, '=');
+    const char *slash = strchr(spec, '/');
+    if (eq && (!slash || eq < slash)) {
+        snprintf(host, sizeof(host), "%.*s", (int)(eq - spec), spec);
+        root = eq + 1;
+    } else {
+        size_t len = strlen(spec);
+        while (len > 1 && spec[len-1] == '/') len--;
+        size_t b = len;
+        while (b > 0 && spec[b-1] != '/') b--;
+        snprintf(host, sizeof(host), "%.*s", (int)(len - b), spec + b);
+    }
+    if (!valid_tag(host) || strcmp(host, ".") == 0 || strcmp(host, "..") == 0) {
+        fprintf(stderr, "[merge] %s: no usable host name, use HOST=%s\n", spec, root);
+        return -1;
+    }
+    for (int i = 0; i < m->n; i++) {
+        if (strcmp(m->s[i].host, host) == 0) {
+            fprintf(stderr, "[merge] host %s given twice\n", host);
+            return -1;
+        }
+    }
+
+    if (iface) {
+        char dir[1100];
+        struct stat st;
+        snprintf(dir, sizeof(dir), "%s/%s/daily", root, iface);
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "[merge] %s: no %s/daily, skipped\n", root, iface);
+            return 0;
+        }
+        return add_stream(m, host, root, iface);
+    }
+
+    DIR *d = opendir(root);
+    if (!d) {
+        fprintf(stderr, "[merge] cannot open %s\n", root);
+        return -1;
+    }
+    int first = m->n;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char dir[1100];
+        struct stat st;
+        snprintf(dir, sizeof(dir), "%s/%s/daily", root, de->d_name);
+        if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode)) continue;
+        if (add_stream(m, host, root, de->d_name) != 0) {
+            closedir(d);
+            return -1;
+        }
+    }
+    closedir(d);
+    // readdir order is arbitrary; keep ties between streams reproducible
+    qsort(m->s + first, m->n - first, sizeof(*m->s), stream_iface_cmp);
+    return 0;
+}
+
+/* Open every root (all interfaces, or only iface) and position each
+ * stream on its first record inside [from, to]. NULL on error. */
+struct merge *merge_open(char *const *roots, int nroots, const char *iface,
+                         time_t from, time_t to) {
+    struct merge *m = calloc(1, sizeof(*m));
+    if (!m) return NULL;
+    m->from = from;
+    m->to = to;
+    m->pending = -1;
+    m->first_day = m->last_day = -1;
+
+    for (int i = 0; i < nroots; i++) {
+        if (add_root(m, roots[i], iface) != 0) {
+            merge_close(m);
+            return NULL;
+        }
+    }
+    if (m->n == 0) fprintf(stderr, "[merge] no daily directories found\n");
+
+    m->heap = malloc(sizeof(*m->heap) * (m->n ? m->n : 1));
+    if (!m->heap) {
+        merge_close(m);
+        return NULL;
+    }
+    for (int i = 0; i < m->n; i++) {
+        int rc = list_files(m, &m->s[i]);
+        if (rc == 0) rc = stream_advance(m, &m->s[i]);
+        if (rc < 0) {
+            merge_close(m);
+            return NULL;
+        }
+        if (rc) {
+            m->heap[m->nheap] = i;
+            heap_up(m, m->nheap++);
+        }
+    }
+    return m;
+}
+
+/* The next record in time order over all streams: 1, 0 at the end, -1 on
+ * error. The stream of the previous record is only moved on here, so
+ * r->entries stays valid until the next call. */
+int merge_next(struct merge *m, struct merge_record *r) {
+    if (m->pending >= 0) {
+        int rc = stream_advance(m, &m->s[m->pending]);
+        m->pending = -1;
+        if (rc < 0) return -1;
+        if (rc == 0) m->heap[0] = m->heap[--m->nheap];
+        if (m->nheap) heap_down(m, 0);
+    }
+    if (m->nheap == 0) return 0;
+
+    int i = m->heap[0];
+    struct merge_stream *s = &m->s[i];
+    r->host = s->host;
+    r->iface = s->iface;
+    r->src = i;
+    r->prev_ts = s->last_ts;
+    r->h = s->h;
+    r->entries = s->entries;
+    s->last_ts = s->h.ts;
+    m->pending = i;
+    return 1;
+}
+
+int merge_sources(const struct merge *m) {
+    return m->n;
+}
+
+/* First and last UTC day with a file in range; -1 if there is none. */
+int merge_span(const struct merge *m, time_t *first_day, time_t *last_day) {
+    if (m->first_day < 0) return -1;
+    *first_day = m->first_day;
+    *last_day = m->last_day;
+    return 0;
+}
+
+void merge_close(struct merge *m) {
+    if (!m) return;
+    for (int i = 0; i < m->n; i++) {
+        if (m->s[i].gz) gzclose(m->s[i].gz);
+        free(m->s[i].blk);
+        free(m->s[i].files);
+    }
+    free(m->s);
+    free(m->heap);
+    free(m);
+}
+
+/* ---------- netacct merge ---------- */
+
+enum { MERGE_CSV, MERGE_NDJSON };
+
+static void print_record(FILE *out, int format, const struct merge_record *r) {
+    char ip[INET_ADDRSTRLEN];
+    // flow extension records carry no kernel totals of their own
+    int kernel = r->h.total_rx || r->h.total_tx || r->h.ip_count == 0;
+    if (kernel && format == MERGE_CSV) {
+        fprintf(out, "%" PRIu32 ",%s,%s,kernel,,,%" PRIu64 ",%" PRIu64 "\n",
+                r->h.ts, r->host, r->iface, r->h.total_rx, r->h.total_tx);
+    } else if (kernel) {
+        fprintf(out, "{\"ts\":%" PRIu32 ",\"host\":\"%s\",\"iface\":\"%s\",\"kind\":\"kernel\","
+                "\"rx_bytes\":%" PRIu64 ",\"tx_bytes\":%" PRIu64 "}\n",
+                r->h.ts, r->host, r->iface, r->h.total_rx, r->h.total_tx);
+    }
+    for (int i = 0; i < r->h.ip_count; i++) {
+        const struct ip_entry_on_disk *e = &r->entries[i];
+        const char *kind = e->ipv == 4 ? "ip" : "class";
+        const char *cls = "";
+        if (e->ipv == STORAGE_IPV_FLOW) cls = flow_class_name(e->pad);
+        else if (e->ipv != 4) continue;
+        uint32_t addr = e->addr;
+        inet_ntop(AF_INET, &addr, ip, sizeof(ip));
+        if (format == MERGE_CSV) {
+            fprintf(out, "%" PRIu32 ",%s,%s,%s,%s,%s,%" PRIu64 ",%" PRIu64 "\n",
+                    r->h.ts, r->host, r->iface, kind, ip, cls, e->rx_delta, e->tx_delta);
+        } else {
+            fprintf(out, "{\"ts\":%" PRIu32 ",\"host\":\"%s\",\"iface\":\"%s\",\"kind\":\"%s\","
+                    "\"ip\":\"%s\"", r->h.ts, r->host, r->iface, kind, ip);
+            if (*cls) fprintf(out, ",\"class\":\"%s\"", cls);
+            fprintf(out, ",\"rx_bytes\":%" PRIu64 ",\"tx_bytes\":%" PRIu64 "}\n",
+                    e->rx_delta, e->tx_delta);
+        }
+    }
+}
+
+/* --out: sums of all streams per bucket of step seconds, stamped with
+ * the bucket's end like a flush covering the same interval. Records come
+ * in time order, so only the open bucket is held. */
+struct compact {
+    char dir[1100];             // <out>/<name>/daily
+    uint32_t step;
+    uint32_t bucket;            // end of the open bucket, 0 = none
+    struct storage_sum sum;
+    gzFile gz;
+    time_t day;                 // of the open file
+    long files, records;
+};
+
+static int compact_open_day(struct compact *c, time_t day) {
+    if (c->gz) {
+        if (gzclose(c->gz) != Z_OK) {
+            c->gz = NULL;
+            fprintf(stderr, "[merge] close error in %s\n", c->dir);
+            return -1;
+        }
+        c->gz = NULL;
+    }
+    char date[32], path[1200];
+    struct tm gm;
+    gmtime_r(&day, &gm);
+    strftime(date, sizeof(date), "%Y-%m-%d", &gm);
+    snprintf(path, sizeof(path), "%s/%s.bin", c->dir, date);
+    if (access(path, F_OK) == 0) {
+        fprintf(stderr, "[merge] %s already exists\n", path);
+        return -1;
+    }
+    strcat(path, ".gz");
+    if (access(path, F_OK) == 0) {
+        fprintf(stderr, "[merge] %s already exists\n", path);
+        return -1;
+    }
+    c->gz = gzopen(path, "wb");
+    if (!c->gz) {
+        perror(path);
+        return -1;
+    }
+    c->day = day;
+    c->files++;
+    return 0;
+}
+
+/* Write the open bucket to the file of its day. */
+static int compact_flush(struct compact *c) {
+    if (!c->bucket) return 0;
+    time_t day = (time_t)c->bucket - c->bucket % 86400;
+    if (!c->gz || day != c->day) {
+        if (compact_open_day(c, day) != 0) return -1;
+    }
+    const char *buf;
+    long len = storage_sum_encode(&c->sum, c->bucket, &buf);
+    if (len < 0) {
+        fprintf(stderr, "[merge] out of memory\n");
+        return -1;
+    }
+    if (gzwrite(c->gz, buf, (unsigned)len) != (int)len) {
+        fprintf(stderr, "[merge] write error in %s\n", c->dir);
+        return -1;
+    }
+    c->records++;
+    c->bucket = 0;
+    return 0;
+}
+
+/* The last bucket of a day ends at its final second rather than past
+ * midnight, so a record never moves into the next day's file. */
+static int compact_add(struct compact *c, const struct merge_record *r) {
+    uint32_t end = r->h.ts + (c->step - r->h.ts % c->step) % c->step;
+    uint32_t day_last = r->h.ts - r->h.ts % 86400 + 86399;
+    if (end > day_last) end = day_last;
+    if (c->bucket && end != c->bucket && compact_flush(c) != 0) return -1;
+    c->bucket = end;
+    if (storage_sum_add(&c->sum, &r->h, r->entries) != 0) {
+        fprintf(stderr, "[merge] out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] [HOST=]ROOT...\n"
+            "  ROOT               storage root copied from one host (ROOT/<iface>/daily);\n"
+            "                     HOST tags its rows, default: ROOT's last component\n"
+            "  --from WHEN        first day/time to include (YYYY-MM-DD[THH:MM[:SS]], UTC)\n"
+            "  --to WHEN          last day/time to include\n"
+            "  --iface NAME       only this interface of each root (default: all)\n"
+            "  --format FMT       csv or ndjson rows tagged with host and interface\n"
+            "                     (default: ndjson)\n"
+            "  --out DIR          instead of rows, write the sum of all roots to\n"
+            "                     DIR/<name>/daily as regular daily files\n"
+            "  --name NAME        interface directory under --out (default: merged)\n"
+            "  --step N[smhd]     --out record interval (default: 5m)\n",
+            prog);
+}
+
+int merge_run(int argc, char **argv) {
+    static const struct option longopts[] = {
+        { "from",   required_argument, NULL, 'f' },
+        { "to",     required_argument, NULL, 't' },
+        { "iface",  required_argument, NULL, 'i' },
+        { "format", required_argument, NULL, 'o' },
+        { "out",    required_argument, NULL, 'O' },
+        { "name",   required_argument, NULL, 'n' },
+        { "step",   required_argument, NULL, 's' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    time_t from = 0, to = (time_t)INT64_MAX;
+    const char *iface = NULL, *out_dir = NULL, *name = "merged";
+    int format = MERGE_NDJSON;
+    uint32_t step = 300;
+
+    optind = 1;
+    int c;
+    while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'f':
+            if (util_parse_time(optarg, 0, &from) != 0) {
+                fprintf(stderr, "Invalid --from: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            if (util_parse_time(optarg, 1, &to) != 0) {
+                fprintf(stderr, "Invalid --to: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            iface = optarg;
+            break;
+        case 'o':
+            if (strcmp(optarg, "csv") == 0) format = MERGE_CSV;
+            else if (strcmp(optarg, "ndjson") == 0) format = MERGE_NDJSON;
+            else {
+                fprintf(stderr, "Unknown --format: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'O':
+            out_dir = optarg;
+            break;
+        case 'n':
+            if (!valid_tag(optarg)) {
+                fprintf(stderr, "Invalid --name: %s\n", optarg);
+                return 1;
+            }
+            name = optarg;
+            break;
+        case 's':
+            step = util_parse_step(optarg);
+            if (step == 0 || step > 86400 || 86400 % step != 0) {
+                fprintf(stderr, "Invalid --step: %s (must divide a day)\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct merge *m = merge_open(argv + optind, argc - optind, iface, from, to);
+    if (!m) return 1;
+
+    struct compact cp;
+    memset(&cp, 0, sizeof(cp));
+    if (out_dir) {
+        cp.step = step;
+        snprintf(cp.dir, sizeof(cp.dir), "%s/%s/daily", out_dir, name);
+        if (ensure_dir(cp.dir) != 0) {
+            fprintf(stderr, "[merge] cannot create %s: %s\n", cp.dir, strerror(errno));
+            merge_close(m);
+            return 1;
+        }
+        if (storage_sum_init(&cp.sum) != 0) {
+            fprintf(stderr, "out of memory\n");
+            merge_close(m);
+            return 1;
+        }
+    } else {
+        static char outbuf[1 << 16];
+        setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+        if (format == MERGE_CSV) fputs("ts,host,iface,kind,ip,class,rx_bytes,tx_bytes\n", stdout);
+    }
+
+    struct merge_record r;
+    long records = 0;
+    int rc;
+    while ((rc = merge_next(m, &r)) > 0) {
+        records++;
+        if (!out_dir) print_record(stdout, format, &r);
+        else if (compact_add(&cp, &r) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    if (out_dir) {
+        if (rc == 0) rc = compact_flush(&cp);
+        if (cp.gz && gzclose(cp.gz) != Z_OK && rc == 0) {
+            fprintf(stderr, "[merge] close error in %s\n", cp.dir);
+            rc = -1;
+        }
+        if (rc == 0) {
+            fprintf(stderr, "[merge] %ld records from %d streams into %ld records, %ld files in %s\n",
+                    records, merge_sources(m), cp.records, cp.files, cp.dir);
+        }
+        storage_sum_free(&cp.sum);
+    }
+    fflush(stdout);
+    merge_close(m);
+    return rc < 0 ? 1 : 0;
+}
@@ -0,0 +1,303 @@
+// src/metrics.c - Prometheus text exporter
+//
+// One thread owns both the listening socket and the rendered page. It
+// re-renders the page from ipacct_view() of every interface and the
+// capture counters every poll interval, and scrapes only copy that
+// pre-built buffer out, so a scrape never touches the accounting lock.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "netacct.h"
+
+#define METRICS_ADDR "127.0.0.1"
+
+static uint64_t flushes;
+static uint64_t flush_failures;
+static int adopted_fd = -1, adopted_port;   // from the previous daemon
+static int listen_fd = -1;
+
+void metrics_note_flush(int ok) {
+    __atomic_add_fetch(ok ? &flushes : &flush_failures, 1, __ATOMIC_RELAXED);
+}
+
+/* Serve on fd, a socket the previous daemon listened on for port. Kept
+ * only if metrics_port is still port; call before starting the thread. */
+void metrics_adopt_fd(int fd, int port) {
+    adopted_fd = fd;
+    adopted_port = port;
+}
+
+int metrics_listen_fd(void) {
+    return __atomic_load_n(&listen_fd, __ATOMIC_ACQUIRE);
+}
+
+/* Bind and listen on METRICS_ADDR:port. */
+static int open_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, METRICS_ADDR, &addr.sin_addr);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("[metrics] bind/listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+struct page {
+    char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static void emit(struct page *p, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void emit(struct page *p, const char *fmt, ...) {
+    for (;;) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(p->buf + p->len, p->cap - p->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < p->cap - p->len) {
+            p->len += n;
+            return;
+        }
+        size_t cap = p->cap ? p->cap * 2 : 16384;
+        while (cap - p->len <= (size_t)n) cap *= 2;
+        char *nb = realloc(p->buf, cap);
+        if (!nb) return;
+        p->buf = nb;
+        p->cap = cap;
+    }
+}
+
+/* Per-slot copy of the live counters taken at the start of a render. */
+struct snap {
+    int live;
+    struct iface_view iv;
+    char label[MAX_IFACE_NAME * 2];   // iv.name escaped for a label value
+    struct ip_view *ips;
+    int n;
+    int cap;
+    uint64_t ip_rx, ip_tx;
+    int have_cs;
+    struct capture_stats cs;
+};
+
+/* Copy name into out as a label value: backslash, double quote and
+ * newline are escaped as the text exposition format requires. */
+static void label_escape(char *out, size_t n, const char *name) {
+    size_t o = 0;
+    for (; *name && o + 2 < n; name++) {
+        char c = *name;
+        if (c == '\\' || c == '"' || c == '\n') {
+            out[o++] = '\\';
+            c = c == '\n' ? 'n' : c;
+        }
+        out[o++] = c;
+    }
+    out[o] = '\0';
+}
+
+/* One metric family of the given type: HELP/TYPE once, then a sample per
+ * interface. pcap families skip interfaces whose capture is not open. */
+static void emit_iface_family(struct page *p, const struct snap *snaps, const char *name,
+                              const char *type, const char *help, size_t off, int pcap) {
+    emit(p, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (int i = 0; i < MAX_IFACES; i++) {
+        const struct snap *s = &snaps[i];
+        if (!s->live || (pcap && !s->have_cs)) continue;
+        emit(p, "%s{iface=\"%s\"} %" PRIu64 "\n", name, s->label,
+             *(const uint64_t *)((const char *)s + off));
+    }
+}
+
+static void render(struct page *p, struct snap *snaps) {
+    p->len = 0;
+    for (int i = 0; i < MAX_IFACES; i++) {
+        struct snap *s = &snaps[i];
+        s->n = ipacct_view_alloc(&g_ifaces[i], &s->iv, &s->ips, &s->cap);
+        s->live = s->n >= 0;
+        if (!s->live) continue;
+        s->ip_rx = s->ip_tx = 0;
+        for (int j = 0; j < s->n; j++) {
+            s->ip_rx += s->ips[j].rx_total;
+            s->ip_tx += s->ips[j].tx_total;
+        }
+        label_escape(s->label, sizeof(s->label), s->iv.name);
+        s->have_cs = pcap_if_stats(s->iv.name, &s->cs) == 0;
+    }
+
+    emit_iface_family(p, snaps, "netacct_iface_rx_bytes_total", "counter",
+                      "Kernel interface RX bytes since start.", offsetof(struct snap, iv.rx_total), 0);
+    emit_iface_family(p, snaps, "netacct_iface_tx_bytes_total", "counter",
+                      "Kernel interface TX bytes since start.", offsetof(struct snap, iv.tx_total), 0);
+
+    emit(p, "# HELP netacct_ip_rx_bytes_total Captured RX bytes per client since start.\n"
+            "# TYPE netacct_ip_rx_bytes_total counter\n");
+    for (int i = 0; i < MAX_IFACES; i++) {
+        const struct snap *s = &snaps[i];
+        for (int j = 0; s->live && j < s->n; j++) {
+            char ipbuf[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &s->ips[j].ip, ipbuf, sizeof(ipbuf));
+            emit(p, "netacct_ip_rx_bytes_total{iface=\"%s\",ip=\"%s\"} %" PRIu64 "\n",
+                 s->label, ipbuf, s->ips[j].rx_total);
+        }
+    }
+    emit(p, "# HELP netacct_ip_tx_bytes_total Captured TX bytes per client since start.\n"
+            "# TYPE netacct_ip_tx_bytes_total counter\n");
+    for (int i = 0; i < MAX_IFACES; i++) {
+        const struct snap *s = &snaps[i];
+        for (int j = 0; s->live && j < s->n; j++) {
+            char ipbuf[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &s->ips[j].ip, ipbuf, sizeof(ipbuf));
+            emit(p, "netacct_ip_tx_bytes_total{iface=\"%s\",ip=\"%s\"} %" PRIu64 "\n",
+                 s->label, ipbuf, s->ips[j].tx_total);
+        }
+    }
+
+    // share of the authoritative kernel bytes that per-IP accounting saw
+    emit(p, "# HELP netacct_ip_kernel_ratio Sum of per-IP bytes divided by kernel interface bytes.\n"
+            "# TYPE netacct_ip_kernel_ratio gauge\n");
+    for (int i = 0; i < MAX_IFACES; i++) {
+        const struct snap *s = &snaps[i];
+        if (!s->live) continue;
+        uint64_t kernel = s->iv.rx_total + s->iv.tx_total;
+        emit(p, "netacct_ip_kernel_ratio{iface=\"%s\"} %.6f\n", s->label,
+             kernel ? (double)(s->ip_rx + s->ip_tx) / (double)kernel : 0.0);
+    }
+
+    emit_iface_family(p, snaps, "netacct_pcap_received_total", "counter",
+                      "Packets received by the capture filter.", offsetof(struct snap, cs.received), 1);
+    emit_iface_family(p, snaps, "netacct_pcap_dropped_total", "counter",
+                      "Packets dropped by the capture buffer.", offsetof(struct snap, cs.dropped), 1);
+    emit_iface_family(p, snaps, "netacct_pcap_if_dropped_total", "counter",
+                      "Packets dropped by the interface.", offsetof(struct snap, cs.if_dropped), 1);
+    emit_iface_family(p, snaps, "netacct_capture_queue_size", "gauge",
+                      "Entries of the queue between capture and counting (two per packet).",
+                      offsetof(struct snap, cs.queue_size), 1);
+    emit_iface_family(p, snaps, "netacct_capture_queue_high_water", "gauge",
+                      "Most queue entries found waiting at once since the capture opened.",
+                      offsetof(struct snap, cs.queue_high_water), 1);
+    emit_iface_family(p, snaps, "netacct_capture_queue_overflows_total", "counter",
+                      "Queue entries dropped because the queue was full.",
+                      offsetof(struct snap, cs.queue_overflows), 1);
+    emit_iface_family(p, snaps, "netacct_flow_evictions_total", "counter",
+                      "Flow breakdown entries evicted from a full table bucket.",
+                      offsetof(struct snap, iv.flow_evictions), 0);
+    emit_iface_family(p, snaps, "netacct_auto_overflows_total", "counter",
+                      "Auto-accounted prefix packets not counted per IP, table full.",
+                      offsetof(struct snap, iv.auto_overflows), 0);
+
+    emit(p, "# HELP netacct_flushes_total Flush records written.\n"
+            "# TYPE netacct_flushes_total counter\n"
+            "netacct_flushes_total %" PRIu64 "\n",
+         __atomic_load_n(&flushes, __ATOMIC_RELAXED));
+    emit(p, "# HELP netacct_flush_failures_total Flush records that failed to write.\n"
+            "# TYPE netacct_flush_failures_total counter\n"
+            "netacct_flush_failures_total %" PRIu64 "\n",
+         __atomic_load_n(&flush_failures, __ATOMIC_RELAXED));
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void serve(int cfd, const struct page *p) {
+    // the request itself is ignored beyond the path
+    char req[1024];
+    ssize_t n = recv(cfd, req, sizeof(req) - 1, 0);
+    if (n <= 0) return;
+    req[n] = '\0';
+
+    char head[256];
+    if (strncmp(req, "GET /metrics", 12) != 0 && strncmp(req, "GET / ", 6) != 0) {
+        static const char nf[] = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        write_all(cfd, nf, sizeof(nf) - 1);
+        return;
+    }
+    int hl = snprintf(head, sizeof(head),
+                      "HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: %zu\r\n\r\n", p->len);
+    write_all(cfd, head, hl);
+    write_all(cfd, p->buf, p->len);
+}
+
+void *metrics_thread_fn(void *arg) {
+    struct cfg *cfg = arg;
+    int fd = -1;
+    if (adopted_fd >= 0 && adopted_port == cfg->metrics_port) fd = adopted_fd;
+    else if (adopted_fd >= 0) close(adopted_fd);
+    if (cfg->metrics_port == 0) return NULL;   // disabled
+    if (fd < 0 && (fd = open_listener(cfg->metrics_port)) < 0) return NULL;
+    __atomic_store_n(&listen_fd, fd, __ATOMIC_RELEASE);
+    fprintf(stderr, "[metrics] Listening on http://%s:%d/metrics\n", METRICS_ADDR, cfg->metrics_port);
+
+    struct page page = {0};
+    static struct snap snaps[MAX_IFACES];
+    render(&page, snaps);
+    time_t next = time(NULL) + collector_poll_interval();
+
+    while (1) {
+        int wait_ms = (int)(next - time(NULL)) * 1000;
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int r = poll(&pfd, 1, wait_ms > 0 ? wait_ms : 0);
+        if (r < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (r > 0) {
+            int cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+            if (cfd >= 0) {
+                // a stuck scraper must not hold up rendering for long
+                struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+                setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                serve(cfd, &page);
+                close(cfd);
+            }
+        }
+        if (time(NULL) >= next) {
+            render(&page, snaps);
+            next = time(NULL) + collector_poll_interval();
+        }
+    }
+
+    for (int i = 0; i < MAX_IFACES; i++) free(snaps[i].ips);
+    free(page.buf);
+    close(fd);
+    return NULL;
+}
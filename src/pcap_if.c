@@ -2,20 +2,141 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/if_ether.h>
 #include <netinet/ip.h>
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
 
 #include "netacct.h"
 
-extern int ipacct_update_rx(const char *iface, uint32_t ip, uint32_t bytes);
-extern int ipacct_update_tx(const char *iface, uint32_t ip, uint32_t bytes);
+/* Kernel BPF load of a random u32 (SKF_AD_OFF + SKF_AD_RANDOM in
+ * <linux/filter.h>, not included to keep clear of pcap/bpf.h). */
+#define SAMPLE_AD_RANDOM ((uint32_t)(-0x1000 + 56))
 
-static const char *g_iface = NULL;
-static pcap_t *pcap_handle = NULL;
+#ifdef __linux__
+/* struct sock_fprog; struct bpf_insn has the layout of sock_filter. */
+struct sample_fprog {
+    unsigned short len;
+    struct bpf_insn *filter;
+};
+#endif
+
+/* Capture only parses: the pcap_loop thread turns each packet into a
+ * PKT_TX tuple for its source and a PKT_RX one for its destination and
+ * queues them on a pkt_ring. An aggregator thread per capture drains the
+ * ring in batches into the counter table, taking the interface lock once
+ * per batch, so a stall in accounting fills the ring instead of the
+ * kernel buffer. A full ring drops tuples and counts them (overflows);
+ * high_water, the largest backlog the aggregator found, tells how close
+ * the ring came to that. Both are exported through pcap_if_stats(). */
+#define AGG_BATCH 256             // tuples counted per lock acquisition
+#define AGG_IDLE_MIN_US 1000      // aggregator poll on an empty ring, doubling
+#define AGG_IDLE_MAX_US 16000     // up to this while it stays empty
+#define CAPTURE_DRAIN_MS 200      // reading the kernel buffer after a stop
+
+/* Single-producer, single-consumer ring of pkt_tuple. Indices run freely
+ * and are masked on use. Each side's index sits on a cache line of its
+ * own; the producer re-reads the consumer's only when the ring looks full
+ * and the consumer reads the producer's once per drain. */
+struct pkt_ring {
+    // producer: capture thread
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t tail_cache;          // last tail seen
+    uint64_t overflows;           // written by the producer only
+    // consumer: aggregator thread
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t high_water;          // written by the consumer only
+    // fixed while the capture runs
+    struct pkt_tuple *slots __attribute__((aligned(64)));
+    uint32_t mask;                // size - 1, size a power of two
+};
+
+/* One capture handle, its pcap_loop thread and its aggregator per
+ * monitored interface. Handles are opened and closed individually so a
+ * reload only touches the interfaces whose settings changed. */
+struct capture {
+    struct pkt_ring ring;
+    char iface[MAX_IFACE_NAME];
+    pcap_t *handle;
+    pthread_t thread;
+    pthread_t aggregator;
+    int active;
+    int stopping;
+    int drain_and_exit;           // set once the capture thread has returned
+    uint64_t from_us, until_us;   // count packets stamped in [from, until), atomic
+    struct iface_counters *ic;
+    int sample_rate;              // 1 = every packet
+    uint32_t sample_below;        // user-space sampling: keep if rand < this, 0 = off
+    uint32_t rng;                 // xorshift32 state
+    struct pcap_stat last;        // for widening the 32-bit counters
+    struct capture_stats acc;
+};
+
+static struct capture captures[MAX_IFACES];
+static pthread_mutex_t captures_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t window_from, window_until = CAPTURE_NEVER;   // under captures_lock
+
+static int ring_init(struct pkt_ring *r, int size) {
+    uint32_t n = 1;
+    while (n < (uint32_t)size) n <<= 1;
+    r->slots = aligned_alloc(64, sizeof(*r->slots) * n);
+    if (!r->slots) return -1;
+    r->mask = n - 1;
+    return 0;
+}
+
+/* Queue both sides of a packet, or neither. */
+static void ring_push2(struct pkt_ring *r, struct pkt_tuple tx, struct pkt_tuple rx) {
+    uint32_t head = r->head;
+    if (head + 2 - r->tail_cache > r->mask + 1) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head + 2 - r->tail_cache > r->mask + 1) {
+            __atomic_store_n(&r->overflows, r->overflows + 2, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+    r->slots[head & r->mask] = tx;
+    r->slots[(head + 1) & r->mask] = rx;
+    __atomic_store_n(&r->head, head + 2, __ATOMIC_RELEASE);
+}
+
+/* Count everything queued so far. Returns the number of tuples taken. */
+static uint32_t ring_drain(struct pkt_ring *r, struct iface_counters *ic) {
+    uint32_t tail = r->tail;
+    uint32_t n = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail;
+    if (n > r->high_water) __atomic_store_n(&r->high_water, n, __ATOMIC_RELAXED);
+    for (uint32_t done = 0; done < n; ) {
+        uint32_t off = (tail + done) & r->mask;
+        uint32_t k = n - done;
+        if (k > AGG_BATCH) k = AGG_BATCH;
+        if (k > r->mask + 1 - off) k = r->mask + 1 - off;   // up to the wrap
+        ipacct_update_batch(ic, &r->slots[off], (int)k);
+        done += k;
+        __atomic_store_n(&r->tail, tail + done, __ATOMIC_RELEASE);
+    }
+    return n;
+}
 
 static void packet_handler(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes) {
-    (void)user;
+    struct capture *c = (struct capture *)user;
+    struct iface_counters *ic = c->ic;
+    uint64_t ts = (uint64_t)h->ts.tv_sec * 1000000 + (uint64_t)h->ts.tv_usec;
+    if (ts < __atomic_load_n(&c->from_us, __ATOMIC_RELAXED) ||
+        ts >= __atomic_load_n(&c->until_us, __ATOMIC_RELAXED))
+        return;   // the other side of a handover counts it
+    if (c->sample_below) {
+        // the kernel filter could not sample: drop 1 - 1/N here, before any parsing
+        c->rng ^= c->rng << 13;
+        c->rng ^= c->rng >> 17;
+        c->rng ^= c->rng << 5;
+        if (c->rng >= c->sample_below) return;
+    }
+    HISTO_BEGIN_SAMPLED(t0);
     if (h->caplen < sizeof(struct ether_header)) return;
 
     const struct ether_header *eth = (const struct ether_header*)bytes;
@@ -25,39 +146,270 @@ static void packet_handler(u_char *user, const struct pcap_pkthdr *h, const u_ch
     // ensure ip header length fits
     if ((const u_char*)iph + sizeof(struct ip) > bytes + h->caplen) return;
 
-    uint32_t src = iph->ip_src.s_addr;
-    uint32_t dst = iph->ip_dst.s_addr;
-    uint32_t len = ntohs(iph->ip_len);
+    uint16_t len = ntohs(iph->ip_len);
 
-    // Update tx/rx for local IPs if present
-    ipacct_update_tx(g_iface, src, len);
-    ipacct_update_rx(g_iface, dst, len);
+    // flow classes: the remote end of a sent packet is its destination
+    int tx_cls = -1, rx_cls = -1;
+    // unlocked peek: only decides whether to classify, ipacct rechecks
+    if (__atomic_load_n(&ic->flows[0].buckets, __ATOMIC_RELAXED)) {
+        const u_char *l4 = (const u_char *)iph + iph->ip_hl * 4;
+        int has_ports = (iph->ip_p == IPPROTO_TCP || iph->ip_p == IPPROTO_UDP) &&
+                        (ntohs(iph->ip_off) & IP_OFFMASK) == 0 &&
+                        l4 + 4 <= bytes + h->caplen;
+        if (has_ports || (iph->ip_p != IPPROTO_TCP && iph->ip_p != IPPROTO_UDP)) {
+            uint16_t sport = has_ports ? (uint16_t)(l4[0] << 8 | l4[1]) : 0;
+            uint16_t dport = has_ports ? (uint16_t)(l4[2] << 8 | l4[3]) : 0;
+            tx_cls = flow_classify(iph->ip_p, dport);
+            rx_cls = flow_classify(iph->ip_p, sport);
+        } else {
+            tx_cls = rx_cls = FLOW_OTHER;   // later fragment or truncated
+        }
+    }
+
+    struct pkt_tuple tx = { iph->ip_src.s_addr, len, PKT_TX, (int8_t)tx_cls };
+    struct pkt_tuple rx = { iph->ip_dst.s_addr, len, PKT_RX, (int8_t)rx_cls };
+    ring_push2(&c->ring, tx, rx);
+    HISTO_END(HISTO_PACKET, t0);
 }
 
-int pcap_start_for_iface_threaded(const char *iface) {
-    g_iface = iface;
+static void *capture_thread_fn(void *arg) {
+    struct capture *c = arg;
+    // blocking loop; returns on pcap_breakloop() or error
+    int rc = pcap_loop(c->handle, 0, packet_handler, (u_char *)c);
+    if (rc == -1) {
+        fprintf(stderr, "[pcap] %s: %s\n", c->iface, pcap_geterr(c->handle));
+        return NULL;
+    }
+    if (rc != PCAP_ERROR_BREAK) return NULL;
+
+    // stopped: count what the kernel buffer already holds, for a while
     char errbuf[PCAP_ERRBUF_SIZE];
-    pcap_handle = pcap_open_live(iface, 65536, 0, 1000, errbuf);
-    if (!pcap_handle) {
-        fprintf(stderr, "pcap_open_live(%s) failed: %s\n", iface, errbuf);
-        return -1;
+    if (pcap_setnonblock(c->handle, 1, errbuf) != 0) return NULL;
+    uint64_t deadline = histo_now() + (uint64_t)CAPTURE_DRAIN_MS * 1000000;
+    while (histo_now() < deadline &&
+           pcap_dispatch(c->handle, -1, packet_handler, (u_char *)c) > 0) {
     }
+    return NULL;
+}
+
+/* Drain c's ring until capture_stop() says the capture thread is gone,
+ * then once more, so nothing queued is lost. */
+static void *aggregator_thread_fn(void *arg) {
+    struct capture *c = arg;
+    useconds_t idle = AGG_IDLE_MIN_US;
+    for (;;) {
+        int last = __atomic_load_n(&c->drain_and_exit, __ATOMIC_ACQUIRE);
+        if (ring_drain(&c->ring, c->ic)) {
+            idle = AGG_IDLE_MIN_US;
+            continue;
+        }
+        if (last) break;
+        usleep(idle);
+        if (idle < AGG_IDLE_MAX_US) idle *= 2;
+    }
+    return NULL;
+}
+
+/* Install prog behind a prefix that passes a packet with probability
+ * 1/rate:
+ *     ld  rand
+ *     jgt #(2^32/rate - 1), drop, prog
+ *   drop:
+ *     ret #0
+ * Only Linux has the random load, and only in the kernel: the filter
+ * goes straight onto the capture socket. pcap_setfilter() would accept
+ * a program the kernel refuses and run it in user space, where the
+ * random load fails and every packet is dropped. Elsewhere, or if the
+ * kernel rejects it, returns -1 and the caller samples in user space. */
+static int set_sampled_filter(pcap_t *p, const struct bpf_program *prog, int rate) {
+#ifdef __linux__
+    struct bpf_insn pre[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SAMPLE_AD_RANDOM),
+        BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, (uint32_t)(0x100000000ULL / rate - 1), 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    size_t npre = sizeof(pre) / sizeof(pre[0]);
     struct bpf_program fp;
-    if (pcap_compile(pcap_handle, &fp, "ip", 1, PCAP_NETMASK_UNKNOWN) == -1) {
+    fp.bf_len = prog->bf_len + npre;
+    fp.bf_insns = malloc(sizeof(*fp.bf_insns) * fp.bf_len);
+    if (!fp.bf_insns) return -1;
+    memcpy(fp.bf_insns, pre, sizeof(pre));
+    memcpy(fp.bf_insns + npre, prog->bf_insns, sizeof(*fp.bf_insns) * prog->bf_len);
+    struct sample_fprog sf = { (unsigned short)fp.bf_len, fp.bf_insns };
+    int fd = pcap_fileno(p);
+    int rc = fd >= 0 && fp.bf_len <= 0xffff ?
+             setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &sf, sizeof(sf)) : -1;
+    free(fp.bf_insns);
+    return rc == 0 ? 0 : -1;
+#else
+    (void)p; (void)prog; (void)rate;
+    return -1;
+#endif
+}
+
+static pcap_t *open_handle(const char *iface, int ring_size, int sample_rate, int *kernel_sampled) {
+    char errbuf[PCAP_ERRBUF_SIZE];
+    pcap_t *p = pcap_create(iface, errbuf);
+    if (!p) {
+        fprintf(stderr, "pcap_create(%s) failed: %s\n", iface, errbuf);
+        return NULL;
+    }
+    pcap_set_snaplen(p, 65536);
+    pcap_set_promisc(p, 0);
+    pcap_set_timeout(p, 1000);
+    if (ring_size > 0) pcap_set_buffer_size(p, ring_size);
+    int rc = pcap_activate(p);
+    if (rc < 0) {
+        fprintf(stderr, "pcap_activate(%s) failed: %s\n", iface, pcap_statustostr(rc));
+        pcap_close(p);
+        return NULL;
+    }
+
+    struct bpf_program fp;
+    if (pcap_compile(p, &fp, "ip", 1, PCAP_NETMASK_UNKNOWN) == -1) {
         fprintf(stderr, "pcap_compile failed\n");
-        pcap_close(pcap_handle);
-        return -1;
+        pcap_close(p);
+        return NULL;
     }
-    if (pcap_setfilter(pcap_handle, &fp) == -1) {
+    *kernel_sampled = sample_rate > 1 && set_sampled_filter(p, &fp, sample_rate) == 0;
+    if (!*kernel_sampled && pcap_setfilter(p, &fp) == -1) {
         fprintf(stderr, "pcap_setfilter failed\n");
         pcap_freecode(&fp);
-        pcap_close(pcap_handle);
-        return -1;
+        pcap_close(p);
+        return NULL;
     }
     pcap_freecode(&fp);
+    return p;
+}
 
-    // blocking loop; should run in its own thread
-    pcap_loop(pcap_handle, 0, packet_handler, NULL);
+/* Open a capture handle on ic->name and start counting into ic, through
+ * a queue of queue_size tuples (rounded up to a power of two), from two
+ * threads of its own. With sample_rate > 1 only about 1 in sample_rate
+ * packets reach the callback, picked at random by the kernel filter
+ * where possible; the flush scales the counts back up. */
+int capture_start(struct iface_counters *ic, int ring_size, int sample_rate, int queue_size) {
+    int kernel_sampled = 0;
+    pcap_t *p = open_handle(ic->name, ring_size, sample_rate, &kernel_sampled);
+    if (!p) return -1;
+    if (sample_rate > 1)
+        fprintf(stderr, "[pcap] %s: sampling 1 in %d %s\n", ic->name, sample_rate,
+                kernel_sampled ? "in the kernel filter" : "in user space");
+
+    pthread_mutex_lock(&captures_lock);
+    struct capture *c = NULL;
+    for (int i = 0; i < MAX_IFACES && !c; i++)
+        if (!captures[i].active && !captures[i].stopping) c = &captures[i];
+    if (!c) {
+        pthread_mutex_unlock(&captures_lock);
+        pcap_close(p);
+        return -1;
+    }
+    memset(c, 0, sizeof(*c));
+    if (ring_init(&c->ring, queue_size > 0 ? queue_size : QUEUE_SIZE_DEFAULT) != 0) {
+        pthread_mutex_unlock(&captures_lock);
+        pcap_close(p);
+        return -1;
+    }
+    snprintf(c->iface, sizeof(c->iface), "%s", ic->name);
+    c->handle = p;
+    c->ic = ic;
+    c->sample_rate = sample_rate > 1 ? sample_rate : 1;
+    if (c->sample_rate > 1 && !kernel_sampled)
+        c->sample_below = (uint32_t)(0x100000000ULL / c->sample_rate);
+    c->rng = (uint32_t)(uintptr_t)c ^ (uint32_t)time(NULL) ^ 0x9e3779b9U;
+    if (!c->rng) c->rng = 1;
+    c->from_us = window_from;
+    c->until_us = window_until;
+    ipacct_set_sample_rate(ic, c->sample_rate);
+    if (pthread_create(&c->aggregator, NULL, aggregator_thread_fn, c) != 0) {
+        free(c->ring.slots);
+        memset(c, 0, sizeof(*c));
+        pthread_mutex_unlock(&captures_lock);
+        pcap_close(p);
+        return -1;
+    }
+    if (pthread_create(&c->thread, NULL, capture_thread_fn, c) != 0) {
+        __atomic_store_n(&c->drain_and_exit, 1, __ATOMIC_RELEASE);
+        pthread_join(c->aggregator, NULL);
+        free(c->ring.slots);
+        memset(c, 0, sizeof(*c));
+        pthread_mutex_unlock(&captures_lock);
+        pcap_close(p);
+        return -1;
+    }
+    c->active = 1;
+    pthread_mutex_unlock(&captures_lock);
     return 0;
 }
 
+/* Break the capture loop on iface, count what the kernel buffer (for up
+ * to CAPTURE_DRAIN_MS) and the queue still hold and close the handle.
+ * Counters stay in the iface_counters slot until the next flush. */
+void capture_stop(const char *iface) {
+    pthread_mutex_lock(&captures_lock);
+    struct capture *c = NULL;
+    for (int i = 0; i < MAX_IFACES && !c; i++)
+        if (captures[i].active && strcmp(captures[i].iface, iface) == 0) c = &captures[i];
+    if (!c) {
+        pthread_mutex_unlock(&captures_lock);
+        return;
+    }
+    c->active = 0;
+    c->stopping = 1;
+    pcap_breakloop(c->handle);
+    pthread_mutex_unlock(&captures_lock);
+
+    // the loop notices the break at the next packet or read timeout
+    pthread_join(c->thread, NULL);
+    __atomic_store_n(&c->drain_and_exit, 1, __ATOMIC_RELEASE);
+    pthread_join(c->aggregator, NULL);
+
+    pthread_mutex_lock(&captures_lock);
+    pcap_close(c->handle);
+    free(c->ring.slots);
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_unlock(&captures_lock);
+}
+
+/* Count only packets stamped in [from_us, until_us) (microseconds since
+ * the epoch, as pcap stamps them) on every capture, open or opened
+ * later. A handover splits the traffic at one instant this way: the old
+ * daemon counts up to it, the new one from it. [0, CAPTURE_NEVER) counts
+ * everything, [CAPTURE_NEVER, CAPTURE_NEVER) nothing. */
+void capture_set_window(uint64_t from_us, uint64_t until_us) {
+    pthread_mutex_lock(&captures_lock);
+    window_from = from_us;
+    window_until = until_us;
+    for (int i = 0; i < MAX_IFACES; i++) {
+        if (!captures[i].active) continue;
+        __atomic_store_n(&captures[i].from_us, from_us, __ATOMIC_RELAXED);
+        __atomic_store_n(&captures[i].until_us, until_us, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&captures_lock);
+}
+
+/* Cumulative capture and queue counters of one interface. libpcap
+ * reports its counters as 32-bit values that wrap on busy links; widen
+ * them here. Counting starts over when the handle is reopened. */
+int pcap_if_stats(const char *iface, struct capture_stats *out) {
+    int rc = -1;
+    pthread_mutex_lock(&captures_lock);
+    for (int i = 0; i < MAX_IFACES; i++) {
+        struct capture *c = &captures[i];
+        if (!c->active || strcmp(c->iface, iface) != 0) continue;
+        struct pcap_stat ps;
+        if (pcap_stats(c->handle, &ps) != 0) break;
+        c->acc.received += (uint32_t)(ps.ps_recv - c->last.ps_recv);
+        c->acc.dropped += (uint32_t)(ps.ps_drop - c->last.ps_drop);
+        c->acc.if_dropped += (uint32_t)(ps.ps_ifdrop - c->last.ps_ifdrop);
+        c->last = ps;
+        *out = c->acc;
+        out->queue_size = (uint64_t)c->ring.mask + 1;
+        out->queue_high_water = __atomic_load_n(&c->ring.high_water, __ATOMIC_RELAXED);
+        out->queue_overflows = __atomic_load_n(&c->ring.overflows, __ATOMIC_RELAXED);
+        rc = 0;
+        break;
+    }
+    pthread_mutex_unlock(&captures_lock);
+    return rc;
+}
@@ -98,51 +98,96 @@ static int read_u64_file(const char *path,uint64_t *out) {
     fclose(f); *out=(uint64_t)v; return 0;
 }
 
-extern int ipacct_accumulate_kernel_delta(uint64_t rx,uint64_t tx);
-
 /* ---------- Poller thread ---------- */
 
-void *poller_thread_fn(void *arg) {
-    struct cfg *cfg=(struct cfg*)arg;
-    char rxpath[256],txpath[256];
-    snprintf(rxpath,sizeof(rxpath),"/sys/class/net/%s/statistics/rx_bytes",cfg->iface);
-    snprintf(txpath,sizeof(txpath),"/sys/class/net/%s/statistics/tx_bytes",cfg->iface);
+/* Per-interface poll state, matched by name each round so that slots
+ * added or dropped by a reload are picked up without restarting. */
+struct poll_state {
+    char name[MAX_IFACE_NAME];
+    uint64_t last_rx, last_tx;
+    int have_last;
+    int seen;
+};
 
-    uint64_t last_rx=0,last_tx=0; int have_last=0;
+static struct poll_state states[MAX_IFACES];
 
-    // --- Startup checks ---
+static struct poll_state *state_for(const char *iface, const char *root_dir) {
+    struct poll_state *free_st = NULL;
+    for (int i = 0; i < MAX_IFACES; i++) {
+        if (states[i].name[0] && strcmp(states[i].name, iface) == 0) return &states[i];
+        if (!states[i].name[0] && !free_st) free_st = &states[i];
+    }
+    if (!free_st) return NULL;
+
+    struct poll_state *st = free_st;
+    memset(st, 0, sizeof(*st));
+    snprintf(st->name, sizeof(st->name), "%s", iface);
+
+    // --- First sight: startup checks ---
     struct sysinfo si; sysinfo(&si);
     uint64_t cur_boot=(uint64_t)si.uptime;
-    uint32_t cur_ifidx=if_nametoindex(cfg->iface);
+    uint32_t cur_ifidx=if_nametoindex(iface);
 
     struct meta_persist m;
-    if (load_meta(cfg->root_dir,cfg->iface,&m)==0) {
+    if (load_meta(root_dir,iface,&m)==0) {
         if (m.boot_uptime > cur_boot || m.ifindex!=cur_ifidx) {
-            fprintf(stderr,"[poller] Meta mismatch (boot/ifindex), reset state\n");
-        } else if (load_last_counts(cfg->root_dir,cfg->iface,&last_rx,&last_tx)==0) {
-            have_last=1;
+            fprintf(stderr,"[poller] %s: meta mismatch (boot/ifindex), reset state\n",iface);
+        } else if (load_last_counts(root_dir,iface,&st->last_rx,&st->last_tx)==0) {
+            st->have_last=1;
         }
     }
     // always refresh meta to current values
-    save_meta(cfg->root_dir,cfg->iface);
+    save_meta(root_dir,iface);
+    return st;
+}
 
+static void poll_iface(struct iface_counters *ic, const char *iface, const char *root_dir) {
+    struct poll_state *st = state_for(iface, root_dir);
+    if (!st) return;
+    st->seen = 1;
+
+    char rxpath[256],txpath[256];
+    snprintf(rxpath,sizeof(rxpath),"/sys/class/net/%s/statistics/rx_bytes",iface);
+    snprintf(txpath,sizeof(txpath),"/sys/class/net/%s/statistics/tx_bytes",iface);
+
+    uint64_t cur_rx=0,cur_tx=0;
+    if(read_u64_file(rxpath,&cur_rx)!=0 || read_u64_file(txpath,&cur_tx)!=0) return;
+    if(st->have_last) {
+        uint64_t d_rx=compute_delta(cur_rx,st->last_rx);
+        uint64_t d_tx=compute_delta(cur_tx,st->last_tx);
+        if(d_rx||d_tx) ipacct_accumulate_kernel_delta(ic,d_rx,d_tx);
+    }
+    st->last_rx=cur_rx; st->last_tx=cur_tx; st->have_last=1;
+    save_last_counts(root_dir,iface,st->last_rx,st->last_tx);
+}
+
+void *poller_thread_fn(void *arg) {
+    (void)arg;
     // --- Main loop ---
     while(1) {
-        uint64_t cur_rx=0,cur_tx=0;
-        if(read_u64_file(rxpath,&cur_rx)!=0 || read_u64_file(txpath,&cur_tx)!=0) {
-            sleep(cfg->poll_interval); continue;
+        // a handover stops this thread between rounds, never between
+        // counting a delta and saving the counters it came from
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE,NULL);
+        char root_dir[256];
+        collector_root_dir(root_dir,sizeof(root_dir));
+
+        for (int i=0;i<MAX_IFACES;i++) states[i].seen=0;
+        for (int i=0;i<MAX_IFACES;i++) {
+            struct iface_counters *ic=&g_ifaces[i];
+            char name[MAX_IFACE_NAME];
+            pthread_mutex_lock(&ic->lock);
+            int in_use=ic->in_use;
+            memcpy(name,ic->name,sizeof(name));
+            pthread_mutex_unlock(&ic->lock);
+            if (in_use) poll_iface(ic,name,root_dir);
         }
-        if(!have_last) {
-            last_rx=cur_rx; last_tx=cur_tx; have_last=1;
-            save_last_counts(cfg->root_dir,cfg->iface,last_rx,last_tx);
-        } else {
-            uint64_t d_rx=compute_delta(cur_rx,last_rx);
-            uint64_t d_tx=compute_delta(cur_tx,last_tx);
-            if(d_rx||d_tx) ipacct_accumulate_kernel_delta(d_rx,d_tx);
-            last_rx=cur_rx; last_tx=cur_tx;
-            save_last_counts(cfg->root_dir,cfg->iface,last_rx,last_tx);
-        }
-        sleep(cfg->poll_interval);
+        // forget interfaces dropped by a reload; re-adding one re-reads its state
+        for (int i=0;i<MAX_IFACES;i++)
+            if (states[i].name[0] && !states[i].seen) states[i].name[0]='\0';
+
+        int interval=collector_poll_interval();
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE,NULL);
+        sleep(interval);
     }
     return NULL;
 }
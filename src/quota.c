@@ -0,0 +1,482 @@
+// src/quota.c - incremental per-client quotas
+//
+// Day-to-date and month-to-date rx/tx per client are kept in an iptable
+// and advanced by every flush with the same records that go to the daily
+// files, so checking a client against its quota is one lookup and a
+// compare against precomputed trip points. Rules (most specific prefix,
+// else the default) are resolved once per client and again after a
+// reload.
+//
+// After each flush round the table is checkpointed to <root>/.quota with
+// the timestamp of the newest record it includes. At startup the
+// checkpoint is loaded and only daily records newer than that are
+// replayed (the whole month when there is no checkpoint yet), so a
+// restart reads at most the tail of today's files.
+//
+// Crossing a threshold (default 80% and 100%) logs the event, queues it
+// for control socket subscribers and, if quota_hook is set, runs
+//   <hook> <ip> <day|month> <percent> <used_bytes> <limit_bytes>
+// without waiting for it. At most QUOTA_MAX_HOOKS run at once; past that
+// the hook is skipped for the event (it is still logged and queued), as
+// the flush thread never waits on a hook while it holds quota_lock.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "netacct.h"
+
+#define QUOTA_MAX_HOOKS 16   // hook processes running at once
+
+extern char **environ;
+
+struct quota_state {
+    uint32_t ip;
+    uint32_t rule_gen;                 // rules resolved against
+    uint64_t rx[QUOTA_NPERIODS];
+    uint64_t tx[QUOTA_NPERIODS];
+    int16_t rule[QUOTA_NPERIODS];      // index into rules, -1 = none
+    uint8_t level[QUOTA_NPERIODS];     // thresholds already reported
+};
+
+struct quota_ckpt_header {
+    char magic[4];                     // "NQT1"
+    uint32_t last_ts;
+    uint32_t day_start;
+    uint32_t month_start;
+    uint32_t count;
+} __attribute__((packed));
+
+struct quota_ckpt_entry {
+    uint32_t ip;
+    uint8_t level[QUOTA_NPERIODS];
+    uint16_t pad;
+    uint64_t rx[QUOTA_NPERIODS];
+    uint64_t tx[QUOTA_NPERIODS];
+} __attribute__((packed));
+
+static const char *period_names[QUOTA_NPERIODS] = { "day", "month" };
+
+static pthread_mutex_t quota_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct quota_rule rules[MAX_QUOTAS];
+static uint64_t trips[MAX_QUOTAS][MAX_QUOTA_THRESHOLDS];   // bytes per threshold
+static int nrules;
+static int thresholds[MAX_QUOTA_THRESHOLDS];
+static int nthresholds;
+static char hook[256];
+static uint32_t rule_gen = 1;
+
+static struct iptable states;
+static int states_ready;
+static uint32_t period_start[QUOTA_NPERIODS];
+static uint32_t last_ts;     // newest record accounted
+static int dirty;
+static pid_t hook_pids[QUOTA_MAX_HOOKS];   // hooks not reaped yet
+static int hooks_running;
+
+static uint32_t month_start(uint32_t ts) {
+    time_t t = ts;
+    struct tm gm;
+    gmtime_r(&t, &gm);
+    gm.tm_mday = 1;
+    gm.tm_hour = gm.tm_min = gm.tm_sec = 0;
+    return (uint32_t)timegm(&gm);
+}
+
+static int prefix_bits(uint32_t mask) {
+    return __builtin_popcount(mask);
+}
+
+/* ---------- Events ---------- */
+
+/* Collect the hooks that have exited. Only our own PIDs are waited on,
+ * so children spawned elsewhere in the daemon are left to their owners. */
+static void reap_hooks(void) {
+    for (int i = 0; i < hooks_running; ) {
+        pid_t r = waitpid(hook_pids[i], NULL, WNOHANG);
+        if (r == hook_pids[i] || (r < 0 && errno == ECHILD)) {
+            hook_pids[i] = hook_pids[--hooks_running];
+        } else {
+            i++;
+        }
+    }
+}
+
+static void fire(const struct quota_state *st, int p, int k, uint32_t ts) {
+    char ipbuf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &st->ip, ipbuf, sizeof(ipbuf));
+    uint64_t used = st->rx[p] + st->tx[p];
+    uint64_t limit = rules[st->rule[p]].limit;
+
+    fprintf(stderr, "[quota] %s reached %d%% of its %s quota (%" PRIu64 " of %" PRIu64 " bytes)\n",
+            ipbuf, thresholds[k], period_names[p], used, limit);
+
+    char line[256];
+    snprintf(line, sizeof(line),
+             "{\"event\":\"quota\",\"ip\":\"%s\",\"period\":\"%s\",\"threshold\":%d"
+             ",\"used\":%" PRIu64 ",\"limit\":%" PRIu64 ",\"ts\":%" PRIu32 "}",
+             ipbuf, period_names[p], thresholds[k], used, limit, ts);
+    control_notify(line);
+
+    if (!hook[0]) return;
+    if (hooks_running >= QUOTA_MAX_HOOKS) reap_hooks();
+    if (hooks_running >= QUOTA_MAX_HOOKS) {
+        fprintf(stderr, "[quota] %d hooks still running, not running %s for %s\n",
+                hooks_running, hook, ipbuf);
+        return;
+    }
+    char pct[16], used_s[32], limit_s[32];
+    snprintf(pct, sizeof(pct), "%d", thresholds[k]);
+    snprintf(used_s, sizeof(used_s), "%" PRIu64, used);
+    snprintf(limit_s, sizeof(limit_s), "%" PRIu64, limit);
+    char *argv[] = { hook, ipbuf, (char *)period_names[p], pct, used_s, limit_s, NULL };
+    pid_t pid;
+    if (posix_spawn(&pid, hook, NULL, NULL, argv, environ) == 0) hook_pids[hooks_running++] = pid;
+    else fprintf(stderr, "[quota] cannot run %s\n", hook);
+}
+
+/* ---------- Accounting ---------- */
+
+static void resolve(struct quota_state *st) {
+    for (int p = 0; p < QUOTA_NPERIODS; p++) {
+        int best = -1, best_bits = -2;
+        for (int r = 0; r < nrules; r++) {
+            if (rules[r].period != p) continue;
+            int bits;
+            if (rules[r].is_default) bits = -1;
+            else if ((st->ip & rules[r].match.mask) == rules[r].match.net)
+                bits = prefix_bits(rules[r].match.mask);
+            else continue;
+            if (bits > best_bits) {
+                best = r;
+                best_bits = bits;
+            }
+        }
+        st->rule[p] = (int16_t)best;
+    }
+    st->rule_gen = rule_gen;
+}
+
+/* Report thresholds newly crossed; a raised limit lowers the level
+ * silently so the client is reported again when it gets there. */
+static void evaluate(struct quota_state *st, int p, uint32_t ts) {
+    if (st->rule[p] < 0) return;
+    const uint64_t *t = trips[st->rule[p]];
+    uint64_t used = st->rx[p] + st->tx[p];
+    while (st->level[p] > 0 && used < t[st->level[p] - 1]) st->level[p]--;
+    while (st->level[p] < nthresholds && used >= t[st->level[p]]) {
+        fire(st, p, st->level[p], ts);
+        st->level[p]++;
+    }
+}
+
+/* Move the day/month windows forward to ts. */
+static void roll(uint32_t ts) {
+    uint32_t month = month_start(ts);
+    if (month > period_start[QUOTA_MONTH]) {
+        iptable_reset(&states);
+        period_start[QUOTA_MONTH] = month;
+        period_start[QUOTA_DAY] = ts - ts % 86400;
+        return;
+    }
+    uint32_t day = ts - ts % 86400;
+    if (day > period_start[QUOTA_DAY]) {
+        uint32_t pos = 0;
+        struct quota_state *st;
+        while ((st = iptable_next(&states, &pos))) {
+            st->rx[QUOTA_DAY] = st->tx[QUOTA_DAY] = 0;
+            st->level[QUOTA_DAY] = 0;
+        }
+        period_start[QUOTA_DAY] = day;
+    }
+}
+
+static struct quota_state *get_state(uint32_t ip) {
+    int created;
+    struct quota_state *st = iptable_get(&states, ip, &created);
+    if (!st) return NULL;
+    if (created) {
+        st->ip = ip;
+        st->rule_gen = 0;
+    }
+    if (st->rule_gen != rule_gen) resolve(st);
+    return st;
+}
+
+/* Add one record; called with quota_lock held. */
+static void account_locked(uint32_t ts, const struct ip_record *ips, int n) {
+    roll(ts);
+    for (int i = 0; i < n; i++) {
+        struct quota_state *st = get_state(ips[i].ip);
+        if (!st) {
+            fprintf(stderr, "[quota] out of memory\n");
+            return;
+        }
+        for (int p = 0; p < QUOTA_NPERIODS; p++) {
+            // replayed records of other interfaces may be older than the window
+            if (ts < period_start[p]) continue;
+            st->rx[p] += ips[i].rx;
+            st->tx[p] += ips[i].tx;
+            evaluate(st, p, ts);
+        }
+    }
+    if (ts > last_ts) last_ts = ts;
+    dirty = 1;
+}
+
+/* Count one flushed record. Called by the flush thread right after the
+ * record reached the daily file. */
+void quota_account(uint32_t ts, const struct ip_record *ips, int n) {
+    pthread_mutex_lock(&quota_lock);
+    if (nrules && states_ready) account_locked(ts, ips, n);
+    reap_hooks();
+    pthread_mutex_unlock(&quota_lock);
+}
+
+/* ---------- Configuration ---------- */
+
+/* Take rules, thresholds and hook from cfg. Clients are re-resolved
+ * lazily at their next record. */
+void quota_configure(const struct cfg *cfg) {
+    pthread_mutex_lock(&quota_lock);
+    memcpy(rules, cfg->quotas, sizeof(rules));
+    nrules = cfg->quota_count;
+    memcpy(thresholds, cfg->quota_thresholds, sizeof(thresholds));
+    nthresholds = cfg->quota_threshold_count;
+    for (int r = 0; r < nrules; r++)
+        for (int k = 0; k < nthresholds; k++)
+            trips[r][k] = rules[r].limit / 100 * (uint64_t)thresholds[k] +
+                          rules[r].limit % 100 * (uint64_t)thresholds[k] / 100;
+    snprintf(hook, sizeof(hook), "%s", cfg->quota_hook);
+    if (++rule_gen == 0) rule_gen = 1;
+
+    // re-check everyone now, so a lowered limit reports within this call
+    if (states_ready) {
+        uint32_t pos = 0;
+        struct quota_state *st;
+        while ((st = iptable_next(&states, &pos))) {
+            resolve(st);
+            for (int p = 0; p < QUOTA_NPERIODS; p++) evaluate(st, p, last_ts);
+        }
+    }
+    pthread_mutex_unlock(&quota_lock);
+}
+
+/* ---------- Checkpoint ---------- */
+
+int quota_checkpoint(const char *root_dir) {
+    pthread_mutex_lock(&quota_lock);
+    if (!dirty || !states_ready) {
+        pthread_mutex_unlock(&quota_lock);
+        return 0;
+    }
+    char tmp[1024], path[1024];
+    snprintf(tmp, sizeof(tmp), "%s/.quota.tmp.%d", root_dir, getpid());
+    snprintf(path, sizeof(path), "%s/.quota", root_dir);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        pthread_mutex_unlock(&quota_lock);
+        return -1;
+    }
+
+    struct quota_ckpt_header h = {
+        .magic = { 'N', 'Q', 'T', '1' },
+        .last_ts = last_ts,
+        .day_start = period_start[QUOTA_DAY],
+        .month_start = period_start[QUOTA_MONTH],
+        .count = states.count,
+    };
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    uint32_t pos = 0;
+    struct quota_state *st;
+    while (ok && (st = iptable_next(&states, &pos))) {
+        struct quota_ckpt_entry e = { .ip = st->ip };
+        memcpy(e.level, st->level, sizeof(e.level));
+        memcpy(e.rx, st->rx, sizeof(e.rx));
+        memcpy(e.tx, st->tx, sizeof(e.tx));
+        ok = fwrite(&e, sizeof(e), 1, f) == 1;
+    }
+    ok = fflush(f) == 0 && ok;
+    if (ok) storage_sync(fileno(f));
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        pthread_mutex_unlock(&quota_lock);
+        return -1;
+    }
+    dirty = 0;
+    pthread_mutex_unlock(&quota_lock);
+    return 0;
+}
+
+static int load_checkpoint(const char *root_dir, uint32_t now) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/.quota", root_dir);
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+
+    struct quota_ckpt_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || memcmp(h.magic, "NQT1", 4) != 0 ||
+        h.month_start != month_start(now)) {
+        // unreadable, or from an earlier month: start the month over
+        fclose(f);
+        return -1;
+    }
+    last_ts = h.last_ts;
+    period_start[QUOTA_DAY] = h.day_start;
+    period_start[QUOTA_MONTH] = h.month_start;
+    for (uint32_t i = 0; i < h.count; i++) {
+        struct quota_ckpt_entry e;
+        if (fread(&e, sizeof(e), 1, f) != 1) break;
+        int created;
+        struct quota_state *st = iptable_get(&states, e.ip, &created);
+        if (!st) break;
+        st->ip = e.ip;
+        st->rule_gen = 0;
+        memcpy(st->level, e.level, sizeof(e.level));
+        memcpy(st->rx, e.rx, sizeof(e.rx));
+        memcpy(st->tx, e.tx, sizeof(e.tx));
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Account records of one daily file newer than since. gzread() reads
+ * plain files as-is, so .bin and .bin.gz share this path. */
+static long replay_file(const char *path, uint32_t since) {
+    gzFile gz = gzopen(path, "rb");
+    if (!gz) return -1;
+    struct ip_record *ips = malloc(sizeof(*ips) * MAX_FLUSH_ENTRIES);
+    if (!ips) {
+        gzclose(gz);
+        return -1;
+    }
+
+    long n = 0;
+    struct __attribute__((packed)) {
+        uint32_t ts;
+        uint64_t rx, tx;
+        uint16_t ip_count;
+    } h;
+    while (gzread(gz, &h, sizeof(h)) == (int)sizeof(h)) {
+        int cnt = 0;
+        for (int i = 0; i < h.ip_count; i++) {
+            struct ip_entry_on_disk e;
+            if (gzread(gz, &e, sizeof(e)) != (int)sizeof(e)) break;
+            if (e.ipv != 4) continue;
+            ips[cnt].ip = e.addr;
+            ips[cnt].rx = e.rx_delta;
+            ips[cnt].tx = e.tx_delta;
+            cnt++;
+        }
+        if (h.ts <= since) continue;
+        account_locked(h.ts, ips, cnt);
+        n++;
+    }
+    free(ips);
+    gzclose(gz);
+    return n;
+}
+
+/* Restore the checkpoint and replay newer daily records of every
+ * configured interface. Safe to call again, e.g. when a reload turns
+ * quotas on. */
+int quota_load(const char *root_dir, const struct cfg *cfg) {
+    pthread_mutex_lock(&quota_lock);
+    if (!nrules) {
+        pthread_mutex_unlock(&quota_lock);
+        return 0;
+    }
+    if (!states_ready) {
+        if (iptable_init(&states, sizeof(struct quota_state), 1024) != 0) {
+            pthread_mutex_unlock(&quota_lock);
+            return -1;
+        }
+        states_ready = 1;
+    }
+    iptable_reset(&states);
+
+    uint32_t now = (uint32_t)time(NULL);
+    if (load_checkpoint(root_dir, now) != 0) {
+        iptable_reset(&states);
+        period_start[QUOTA_MONTH] = month_start(now);
+        period_start[QUOTA_DAY] = now - now % 86400;
+        last_ts = period_start[QUOTA_MONTH] - 1;
+    }
+
+    uint32_t since = last_ts;
+    long replayed = 0;
+    for (int i = 0; i < cfg->iface_count; i++) {
+        for (uint32_t day = since - since % 86400; day <= now; day += 86400) {
+            char date[32], path[1280];
+            time_t t = day;
+            struct tm gm;
+            gmtime_r(&t, &gm);
+            strftime(date, sizeof(date), "%Y-%m-%d", &gm);
+            snprintf(path, sizeof(path), "%s/%s/daily/%s.bin", root_dir, cfg->ifaces[i], date);
+            long n = replay_file(path, since);
+            if (n < 0) {
+                strcat(path, ".gz");
+                n = replay_file(path, since);
+            }
+            if (n > 0) replayed += n;
+        }
+    }
+    for (uint32_t pos = 0; ; ) {
+        struct quota_state *st = iptable_next(&states, &pos);
+        if (!st) break;
+        if (st->rule_gen != rule_gen) resolve(st);
+    }
+    dirty = 1;
+    fprintf(stderr, "[quota] %u clients month-to-date, %ld records replayed\n",
+            states.count, replayed);
+    pthread_mutex_unlock(&quota_lock);
+    return 0;
+}
+
+/* ---------- Queries ---------- */
+
+/* Copy every tracked client into a caller-owned buffer grown as needed.
+ * period_start receives the start of the current day and month. */
+int quota_view_alloc(struct quota_view **buf, int *cap, uint32_t *period_start_out) {
+    pthread_mutex_lock(&quota_lock);
+    if (period_start_out) memcpy(period_start_out, period_start, sizeof(period_start));
+    if (!states_ready || !nrules) {
+        pthread_mutex_unlock(&quota_lock);
+        return 0;
+    }
+    if ((int)states.count > *cap) {
+        int ncap = (int)states.count + (int)states.count / 4 + 16;
+        struct quota_view *nb = realloc(*buf, sizeof(*nb) * ncap);
+        if (!nb) {
+            pthread_mutex_unlock(&quota_lock);
+            return -1;
+        }
+        *buf = nb;
+        *cap = ncap;
+    }
+    int n = 0;
+    uint32_t pos = 0;
+    struct quota_state *st;
+    while ((st = iptable_next(&states, &pos))) {
+        if (st->rule_gen != rule_gen) resolve(st);
+        struct quota_view *v = &(*buf)[n++];
+        v->ip = st->ip;
+        for (int p = 0; p < QUOTA_NPERIODS; p++) {
+            v->used[p] = st->rx[p] + st->tx[p];
+            v->limit[p] = st->rule[p] >= 0 ? rules[st->rule[p]].limit : 0;
+        }
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return n;
+}
@@ -11,67 +11,78 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
+#include <getopt.h>
 
 #include "netacct.h"
 
-#define HASH_SIZE 256
-
-struct record_header {
-    uint32_t ts;          // epoch seconds
-    uint64_t total_rx;
-    uint64_t total_tx;
-    uint16_t ip_count;
-} __attribute__((packed));
-
 struct ip_total {
     uint32_t ip;
     uint64_t rx;
     uint64_t tx;
-    struct ip_total *next;
 };
 
-static struct ip_total *totals[HASH_SIZE];
+// --ip values; series keeps a row of buckets per IP for the whole range
+#define MAX_REPORT_IPS 64
+#define MAX_REPORT_ROOTS 1024
+
+struct report_opts {
+    time_t from;          // inclusive
+    time_t to;            // inclusive
+    const char *iface;
+    uint32_t ips[MAX_REPORT_IPS];
+    int nips;
+    char *roots[MAX_REPORT_ROOTS];
+    int nroots;
+    int top;
+    int format;
+    int no_index;         // always read the daily files
+};
+
+static struct report_opts opts;
+static struct iptable totals;
+static struct iptable class_totals[FLOW_NCLASSES];   // "classes" report only
+static int by_class;
 static uint64_t kernel_rx_total = 0;
 static uint64_t kernel_tx_total = 0;
+static uint32_t first_ts = 0, last_ts = 0;   // span of the records summed
+static struct export_writer writer;
+static struct merge *merged;   // --root: records come from here, not dirpath
+static int merge_failed;
+
+/* Per-IP time series: one preallocated row of buckets per --ip, sized
+ * from the query range before any file is read. */
+struct series_bucket {
+    uint64_t rx;
+    uint64_t tx;
+    uint64_t peak_bps;
+};
 
-static struct ip_total *get_total(uint32_t ip) {
-    unsigned h = ip % HASH_SIZE;
-    for (struct ip_total *e = totals[h]; e; e = e->next) {
-        if (e->ip == ip) return e;
+static struct {
+    time_t start;                 // aligned to step
+    uint32_t step;
+    size_t nbuckets;
+    struct series_bucket *b;      // opts.nips * nbuckets
+    uint32_t prev_ts;             // previous record, for per-flush rates
+} series;
+
+static struct ip_total *get_total(struct iptable *t, uint32_t ip) {
+    int created;
+    struct ip_total *e = iptable_get(t, ip, &created);
+    if (!e) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
     }
-    struct ip_total *e = calloc(1, sizeof(*e));
-    e->ip = ip;
-    e->next = totals[h];
-    totals[h] = e;
+    if (created) e->ip = ip;
     return e;
 }
 
-static void clear_totals() {
-    for (int i = 0; i < HASH_SIZE; i++) {
-        struct ip_total *e = totals[i];
-        while (e) {
-            struct ip_total *n = e->next;
-            free(e);
-            e = n;
-        }
-        totals[i] = NULL;
-    }
+static void clear_totals(void) {
+    iptable_reset(&totals);
 }
 
-static void *open_daily_file(const char *path, int *is_gzip) {
-    FILE *f = fopen(path, "rb");
-    if (f) {
-        *is_gzip = 0;
-        return f;
-    }
-    char gzpath[1024];
-    snprintf(gzpath, sizeof(gzpath), "%s.gz", path);
-    gzFile gzf = gzopen(gzpath, "rb");
-    if (gzf) {
-        *is_gzip = 1;
-        return gzf;
-    }
-    return NULL;
+static void *open_daily_file(const char *path, int is_gzip) {
+    if (is_gzip) return gzopen(path, "rb");
+    return fopen(path, "rb");
 }
 
 static size_t daily_read(void *fh, int is_gzip, void *buf, size_t len) {
@@ -88,137 +99,547 @@ static void daily_close(void *fh, int is_gzip) {
     else fclose((FILE*)fh);
 }
 
-static void process_file(const char *path) {
-    int is_gzip = 0;
-    void *fh = open_daily_file(path, &is_gzip);
+static int ip_index(uint32_t ip) {
+    for (int i = 0; i < opts.nips; i++) {
+        if (opts.ips[i] == ip) return i;
+    }
+    return -1;
+}
+
+static int ip_selected(uint32_t ip) {
+    if (opts.nips == 0) return 1;
+    for (int i = 0; i < opts.nips; i++) {
+        if (opts.ips[i] == ip) return 1;
+    }
+    return 0;
+}
+
+/* Add one record to whatever the running report sums. prev_ts is the
+ * previous record of the same source, for per-flush rates in series. */
+static void account_record(const struct record_header *h, const struct ip_entry_on_disk *ents,
+                           int in_range, uint32_t prev_ts) {
+    if (in_range) {
+        kernel_rx_total += h->total_rx;
+        kernel_tx_total += h->total_tx;
+        if (!first_ts || h->ts < first_ts) first_ts = h->ts;
+        if (h->ts > last_ts) last_ts = h->ts;
+    }
+
+    // series: bucket of this record and the flush interval it covers
+    struct series_bucket *row = NULL;
+    uint32_t dt = 0;
+    if (series.b && in_range && h->ts >= series.start) {
+        size_t k = (size_t)(h->ts - series.start) / series.step;
+        if (k < series.nbuckets) row = &series.b[k];
+        if (prev_ts && h->ts > prev_ts) dt = h->ts - prev_ts;
+    }
+
+    for (int i = 0; i < h->ip_count; i++) {
+        const struct ip_entry_on_disk *rec = &ents[i];
+        if (row && rec->ipv == 4) {
+            int idx = ip_index(rec->addr);
+            if (idx < 0) continue;
+            struct series_bucket *b = row + (size_t)idx * series.nbuckets;
+            b->rx += rec->rx_delta;
+            b->tx += rec->tx_delta;
+            if (dt) {
+                uint64_t bps = (rec->rx_delta + rec->tx_delta) / dt;
+                if (bps > b->peak_bps) b->peak_bps = bps;
+            }
+        } else if (!series.b && !by_class && in_range && rec->ipv == 4 &&
+                   ip_selected(rec->addr)) {
+            struct ip_total *t = get_total(&totals, rec->addr);
+            t->rx += rec->rx_delta;
+            t->tx += rec->tx_delta;
+        } else if (by_class && in_range && rec->ipv == STORAGE_IPV_FLOW &&
+                   rec->pad < FLOW_NCLASSES && ip_selected(rec->addr)) {
+            struct ip_total *t = get_total(&class_totals[rec->pad], rec->addr);
+            t->rx += rec->rx_delta;
+            t->tx += rec->tx_delta;
+        }
+    }
+}
+
+static void process_file(const char *path, const struct datafile *df) {
+    static struct ip_entry_on_disk ents[MAX_FLUSH_ENTRIES];
+    int is_gzip = df->is_gzip;
+    void *fh = open_daily_file(path, is_gzip);
     if (!fh) return;
 
+    // only the files straddling --from/--to need per-record checks
+    int check_ts = (df->day < opts.from || df->day + 86400 - 1 > opts.to);
+
     struct record_header h;
     while (daily_read(fh, is_gzip, &h, sizeof(h)) == sizeof(h)) {
-        kernel_rx_total += h.total_rx;
-        kernel_tx_total += h.total_tx;
-
-        for (int i = 0; i < h.ip_count; i++) {
-            struct ip_entry_on_disk rec;
-            if (daily_read(fh, is_gzip, &rec, sizeof(rec)) != sizeof(rec)) break;
-            if (rec.ipv == 4) {
-                struct ip_total *t = get_total(rec.addr);
-                t->rx += rec.rx_delta;
-                t->tx += rec.tx_delta;
-            }
-        }
+        size_t len = (size_t)h.ip_count * sizeof(ents[0]);
+        if (daily_read(fh, is_gzip, ents, len) != len) break;   // truncated tail
+        int in_range = !check_ts || (h.ts >= opts.from && h.ts <= opts.to);
+        account_record(&h, ents, in_range, series.prev_ts);
+        if (series.b && in_range && h.ts >= series.start) series.prev_ts = h.ts;
     }
 
     daily_close(fh, is_gzip);
 }
 
-static void print_totals(const char *label) {
-    uint64_t grand_rx = 0, grand_tx = 0;
+/* Answer df from its day index (dayindex.c) when the report sums per-IP
+ * totals and --from/--to cut the day, if at all, on whole hours. Returns
+ * 0 if it did; otherwise the file has to be read. */
+static int index_file(const char *dirpath, const struct datafile *df) {
+    if (opts.no_index || by_class || series.b) return -1;
+    time_t end = df->day + 86400;
+    time_t from = opts.from > df->day ? opts.from : df->day;
+    time_t to = opts.to < end - 1 ? opts.to + 1 : end;   // exclusive
+    if ((from - df->day) % 3600 || (to - df->day) % 3600) return -1;
+    struct dayindex *x = dayindex_open(dirpath, df);
+    if (!x) return -1;
+
+    int h0 = (int)((from - df->day) / 3600), h1 = (int)((to - df->day) / 3600);
+    uint64_t krx, ktx, rx, tx;
+    uint32_t t0, t1;
+    if (dayindex_span(x, h0, h1, &krx, &ktx, &t0, &t1)) {
+        kernel_rx_total += krx;
+        kernel_tx_total += ktx;
+        if (!first_ts || t0 < first_ts) first_ts = t0;
+        if (t1 > last_ts) last_ts = t1;
+    }
+    if (opts.nips) {
+        // a binary search per IP: a few cache lines of the index each
+        for (int i = 0; i < opts.nips; i++) {
+            if (!dayindex_lookup(x, opts.ips[i], h0, h1, &rx, &tx)) continue;
+            struct ip_total *t = get_total(&totals, opts.ips[i]);
+            t->rx += rx;
+            t->tx += tx;
+        }
+    } else {
+        uint32_t n = dayindex_count(x), ip;
+        for (uint32_t k = 0; k < n; k++) {
+            if (!dayindex_entry(x, k, h0, h1, &ip, &rx, &tx)) continue;
+            struct ip_total *t = get_total(&totals, ip);
+            t->rx += rx;
+            t->tx += tx;
+        }
+    }
+    dayindex_close(x);
+    return 0;
+}
+
+/* ---------- Top-N ---------- */
+
+static uint64_t ip_sum(const struct ip_total *e) { return e->rx + e->tx; }
+
+static void heap_sift_down(struct ip_total **heap, int n, int i) {
+    for (;;) {
+        int l = 2*i + 1, r = l + 1, m = i;
+        if (l < n && ip_sum(heap[l]) < ip_sum(heap[m])) m = l;
+        if (r < n && ip_sum(heap[r]) < ip_sum(heap[m])) m = r;
+        if (m == i) return;
+        struct ip_total *t = heap[i]; heap[i] = heap[m]; heap[m] = t;
+        i = m;
+    }
+}
 
-    for (int i = 0; i < HASH_SIZE; i++) {
-        for (struct ip_total *e = totals[i]; e; e = e->next) {
-            grand_rx += e->rx;
-            grand_tx += e->tx;
+static void heap_sift_up(struct ip_total **heap, int i) {
+    while (i > 0) {
+        int p = (i - 1) / 2;
+        if (ip_sum(heap[p]) <= ip_sum(heap[i])) return;
+        struct ip_total *t = heap[i]; heap[i] = heap[p]; heap[p] = t;
+        i = p;
+    }
+}
+
+/* Keep the N heaviest IPs in a min-heap of size N: each candidate costs
+ * O(log N) and only beats the root if it is heavier than the current N-th.
+ * Returns the number of entries, written heaviest first into out[]. */
+static int top_totals(const struct iptable *t, struct ip_total **out, int n_max) {
+    int n = 0;
+    uint32_t pos = 0;
+    struct ip_total *e;
+    while ((e = iptable_next(t, &pos)) != NULL) {
+        if (n < n_max) {
+            out[n] = e;
+            heap_sift_up(out, n++);
+        } else if (ip_sum(e) > ip_sum(out[0])) {
+            out[0] = e;
+            heap_sift_down(out, n, 0);
         }
     }
+    // pop the heap back to front so the array ends up sorted descending
+    for (int k = n - 1; k > 0; k--) {
+        struct ip_total *t = out[0]; out[0] = out[k]; out[k] = t;
+        heap_sift_down(out, k, 0);
+    }
+    return n;
+}
 
-    double kernel_mb = (double)(kernel_rx_total + kernel_tx_total) / (1024.0*1024.0);
+/* Stream the totals in t as one period of the report. */
+static void emit_totals(const struct iptable *t, const char *label) {
+    uint64_t grand_rx = 0, grand_tx = 0;
 
-    printf("=== %s ===\n", label);
-    for (int i = 0; i < HASH_SIZE; i++) {
-        for (struct ip_total *e = totals[i]; e; e = e->next) {
-            struct in_addr a = { .s_addr = e->ip };
-            double mb = (double)(e->rx + e->tx) / (1024.0*1024.0);
-            double pct = kernel_mb > 0 ? (mb / kernel_mb) * 100.0 : 0.0;
+    uint32_t pos = 0;
+    struct ip_total *e;
+    while ((e = iptable_next(t, &pos)) != NULL) {
+        grand_rx += e->rx;
+        grand_tx += e->tx;
+    }
 
-            printf("  %-15s  RX: %.2f MB  TX: %.2f MB  Total: %.2f MB (%.1f%%)\n",
-                   inet_ntoa(a),
-                   (double)e->rx / (1024.0*1024.0),
-                   (double)e->tx / (1024.0*1024.0),
-                   mb, pct);
+    export_period_begin(&writer, label, first_ts, last_ts, kernel_rx_total, kernel_tx_total);
+    if (opts.top > 0) {
+        struct ip_total **top = malloc(sizeof(*top) * opts.top);
+        if (top) {
+            int n = top_totals(t, top, opts.top);
+            for (int i = 0; i < n; i++) export_ip(&writer, top[i]->ip, top[i]->rx, top[i]->tx);
+            free(top);
+        }
+    } else {
+        pos = 0;
+        while ((e = iptable_next(t, &pos)) != NULL) {
+            export_ip(&writer, e->ip, e->rx, e->tx);
         }
     }
-    double grand_mb = (double)(grand_rx+grand_tx) / (1024.0*1024.0);
-    double pct = kernel_mb > 0 ? ( grand_mb/ kernel_mb) * 100.0 : 0.0;
-    printf("  %-15s  RX: %.2f MB  TX: %.2f MB  Total: %.2f MB (%.1f%%)\n",
-           "ALL (per-IP)",
-           (double)grand_rx / (1024.0*1024.0),
-           (double)grand_tx / (1024.0*1024.0),
-           (double)(grand_rx+grand_tx)/(1024.0*1024.0), pct);
-    printf("  %-15s  RX: %.2f MB  TX: %.2f MB  Total: %.2f MB (100%% kernel)\n",
-           "KERNEL",
-           (double)kernel_rx_total / (1024.0*1024.0),
-           (double)kernel_tx_total / (1024.0*1024.0),
-           kernel_mb);
+    export_period_end(&writer, grand_rx, grand_tx);
+}
+
+static void reset_period(void) {
+    clear_totals();
+    kernel_rx_total = kernel_tx_total = 0;
+    first_ts = last_ts = 0;
+}
+
+/* ---------- File selection ---------- */
+
+/* The daily files of dirpath that can hold records inside [opts.from,
+ * opts.to], oldest first; out-of-range days are never opened. */
+static int list_datafiles(const char *dirpath, struct datafile **out) {
+    int n = util_list_datafiles(dirpath, opts.from, opts.to, out);
+    if (n < 0) perror("opendir");
+    return n;
+}
+
+static void emit_day(time_t day) {
+    char label[16];
+    struct tm gm;
+    gmtime_r(&day, &gm);
+    strftime(label, sizeof(label), "%Y-%m-%d", &gm);
+    emit_totals(&totals, label);
 }
 
-static int is_datafile(const char *name) {
-    return (strstr(name, ".bin") || strstr(name, ".bin.gz"));
+/* --root: every record of the merged roots, in time order. With daily
+ * set, a period is emitted whenever the UTC day changes. */
+static int merged_pass(int daily) {
+    struct merge_record r;
+    time_t day = -1;
+    int rc;
+    while ((rc = merge_next(merged, &r)) > 0) {
+        time_t d = (time_t)r.h.ts - r.h.ts % 86400;
+        if (daily && d != day) {
+            if (day >= 0) emit_day(day);
+            reset_period();
+            day = d;
+        }
+        account_record(&r.h, r.entries, 1, r.prev_ts);
+    }
+    if (daily && day >= 0) emit_day(day);
+    if (rc < 0) merge_failed = 1;
+    return rc < 0 ? 1 : 0;
 }
 
 static void daily_report(const char *dirpath) {
-    DIR *d = opendir(dirpath);
-    if (!d) {
-        perror("opendir");
+    if (merged) {
+        merged_pass(1);
         return;
     }
+    struct datafile *files;
+    int n = list_datafiles(dirpath, &files);
+    if (n < 0) return;
 
-    struct dirent *de;
-    while ((de = readdir(d)) != NULL) {
-        if (!is_datafile(de->d_name)) continue;
-
-        char path[1024];
-        snprintf(path, sizeof(path), "%s/%s", dirpath, de->d_name);
+    for (int i = 0; i < n; i++) {
+        char path[1280];
+        snprintf(path, sizeof(path), "%s/%s", dirpath, files[i].name);
 
         // reset totals for each file/day
-        clear_totals();
-        process_file(path);
+        reset_period();
+        if (index_file(dirpath, &files[i]) != 0) process_file(path, &files[i]);
+
+        // label by filename prefix (YYYY-MM-DD)
+        char day[11];
+        memcpy(day, files[i].name, 10);
+        day[10] = '\0';
+        emit_totals(&totals, day);
+    }
+    free(files);
+}
 
-        // label by filename prefix (YYYYMMDD)
-        char day[257] = {0};
-        strncpy(day, de->d_name, 256);
-        print_totals(day);
+/* Sum every selected file into one period. */
+static void monthly_totals(const char *dirpath) {
+    if (merged) {
+        reset_period();
+        merged_pass(0);
+        return;
+    }
+    struct datafile *files;
+    int n = list_datafiles(dirpath, &files);
+    if (n < 0) return;
+
+    reset_period();
+
+    for (int i = 0; i < n; i++) {
+        char path[1280];
+        snprintf(path, sizeof(path), "%s/%s", dirpath, files[i].name);
+        if (index_file(dirpath, &files[i]) != 0) process_file(path, &files[i]);
     }
-    closedir(d);
+    free(files);
 }
 
 static void monthly_report(const char *dirpath) {
-    DIR *d = opendir(dirpath);
-    if (!d) {
-        perror("opendir");
-        return;
+    monthly_totals(dirpath);
+    emit_totals(&totals, "Monthly");
+}
+
+/* Totals of the whole range split by flow class, one period per class
+ * that saw traffic. Needs daily files written with flow_entries set;
+ * address 0.0.0.0 carries bytes whose flow entry was evicted. */
+static int classes_report(const char *dirpath) {
+    for (int c = 0; c < FLOW_NCLASSES; c++) {
+        if (iptable_init(&class_totals[c], sizeof(struct ip_total), 64) != 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+    monthly_totals(dirpath);
+    for (int c = 0; c < FLOW_NCLASSES; c++) {
+        if (class_totals[c].count) emit_totals(&class_totals[c], flow_class_name(c));
+        iptable_free(&class_totals[c]);
     }
+    return 0;
+}
 
-    clear_totals();
+/* Single pass over the pruned files, accumulating straight into the
+ * bucket arrays; open-ended ranges are bounded by the first/last file. */
+static int series_report(const char *dirpath) {
+    struct datafile *files = NULL;
+    time_t first_day = 0, last_day = 0;
+    int n = 0;
+    if (merged) {
+        if (merge_span(merged, &first_day, &last_day) == 0) n = 1;
+    } else {
+        n = list_datafiles(dirpath, &files);
+        if (n < 0) return 1;
+        if (n) {
+            first_day = files[0].day;
+            last_day = files[n-1].day;
+        }
+    }
+    if (n == 0) {
+        free(files);
+        export_series_begin(&writer, stdout, opts.format, opts.iface, series.step);
+        export_series_end(&writer);
+        return 0;
+    }
 
-    struct dirent *de;
-    while ((de = readdir(d)) != NULL) {
-        if (!is_datafile(de->d_name)) continue;
+    time_t from = opts.from > first_day ? opts.from : first_day;
+    time_t to = last_day + 86400 - 1;
+    if (opts.to < to) to = opts.to;
 
-        char path[1024];
-        snprintf(path, sizeof(path), "%s/%s", dirpath, de->d_name);
-        process_file(path);
+    series.start = from - from % series.step;
+    series.nbuckets = (size_t)((to - series.start) / series.step) + 1;
+    series.b = calloc((size_t)opts.nips * series.nbuckets, sizeof(*series.b));
+    if (!series.b) {
+        fprintf(stderr, "Cannot allocate %zu buckets for %d IPs\n", series.nbuckets, opts.nips);
+        free(files);
+        return 1;
+    }
+
+    int rc = 0;
+    if (merged) rc = merged_pass(0);
+    for (int i = 0; !merged && i < n; i++) {
+        char path[1280];
+        snprintf(path, sizeof(path), "%s/%s", dirpath, files[i].name);
+        process_file(path, &files[i]);
+    }
+    free(files);
+
+    export_series_begin(&writer, stdout, opts.format, opts.iface, series.step);
+    for (int ip = 0; ip < opts.nips; ip++) {
+        const struct series_bucket *row = series.b + (size_t)ip * series.nbuckets;
+        for (size_t k = 0; k < series.nbuckets; k++) {
+            export_series_row(&writer, opts.ips[ip],
+                              (uint32_t)(series.start + (time_t)k * series.step),
+                              row[k].rx, row[k].tx, row[k].peak_bps);
+        }
     }
-    closedir(d);
+    export_series_end(&writer);
 
-    print_totals("Monthly");
+    free(series.b);
+    series.b = NULL;
+    return rc;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <directory> <daily|monthly|classes> [options]\n"
+            "       %s series <directory> --ip <a.b.c.d> [--ip ...] --step <5m|1h|1d> [options]\n"
+            "       %s <daily|monthly|classes|series> --root [HOST=]DIR [--root ...] [options]\n"
+            "  --from <when>     first day/time to include (YYYY-MM-DD[THH:MM[:SS]], UTC)\n"
+            "  --to <when>       last day/time to include (a bare date includes the whole day)\n"
+            "  --iface <name>    <directory> is the storage root; read <directory>/<name>/daily\n"
+            "  --root <dir>      storage root copied from one host, instead of <directory>;\n"
+            "                    repeat to sum several hosts (all interfaces unless --iface)\n"
+            "  --ip <a.b.c.d>    only report this IP (may be repeated, up to %d)\n"
+            "  --top <N>         only print the N heaviest IPs, heaviest first\n"
+            "  --format <fmt>    text (default), csv, json or ndjson; byte counts are raw\n"
+            "                    in the machine-readable formats\n"
+            "  --step <N[smhd]>  series bucket width; series holds 24 bytes per --ip per\n"
+            "                    bucket in memory (64 IPs at 5m over a year: about 160 MB)\n"
+            "  --no-index        read every daily file, not the day indexes the\n"
+            "                    daemon writes for closed days\n",
+            prog, prog, prog, MAX_REPORT_IPS);
 }
 
 int reporter_run(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <directory> <daily|monthly>\n", argv[0]);
+    static const struct option longopts[] = {
+        { "from",  required_argument, NULL, 'f' },
+        { "to",    required_argument, NULL, 't' },
+        { "iface", required_argument, NULL, 'i' },
+        { "ip",    required_argument, NULL, 'a' },
+        { "top",   required_argument, NULL, 'n' },
+        { "format", required_argument, NULL, 'o' },
+        { "step",  required_argument, NULL, 's' },
+        { "root",  required_argument, NULL, 'r' },
+        { "no-index", no_argument,     NULL, 'x' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    memset(&opts, 0, sizeof(opts));
+    memset(&series, 0, sizeof(series));
+    opts.from = 0;
+    opts.to = (time_t)INT64_MAX;
+
+    optind = 1;
+    int c;
+    while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+        switch (c) {
+        case 'f':
+            if (util_parse_time(optarg, 0, &opts.from) != 0) {
+                fprintf(stderr, "Invalid --from: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            if (util_parse_time(optarg, 1, &opts.to) != 0) {
+                fprintf(stderr, "Invalid --to: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'i':
+            opts.iface = optarg;
+            break;
+        case 'a': {
+            struct in_addr a;
+            if (inet_aton(optarg, &a) == 0) {
+                fprintf(stderr, "Invalid --ip: %s\n", optarg);
+                return 1;
+            }
+            if (opts.nips == MAX_REPORT_IPS) {
+                fprintf(stderr, "Too many --ip (max %d)\n", MAX_REPORT_IPS);
+                return 1;
+            }
+            opts.ips[opts.nips++] = a.s_addr;
+            break;
+        }
+        case 'n':
+            opts.top = atoi(optarg);
+            if (opts.top <= 0) {
+                fprintf(stderr, "Invalid --top: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            series.step = util_parse_step(optarg);
+            if (series.step == 0) {
+                fprintf(stderr, "Invalid --step: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            if (opts.nroots == MAX_REPORT_ROOTS) {
+                fprintf(stderr, "Too many --root (max %d)\n", MAX_REPORT_ROOTS);
+                return 1;
+            }
+            opts.roots[opts.nroots++] = optarg;
+            break;
+        case 'x':
+            opts.no_index = 1;
+            break;
+        case 'o':
+            opts.format = export_parse_format(optarg);
+            if (opts.format < 0) {
+                fprintf(stderr, "Unknown --format: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // with --root the only positional argument is the report type
+    int npos = opts.nroots ? 1 : 2;
+    if (argc - optind != npos) {
+        usage(argv[0]);
         return 1;
     }
+    int is_series = strcmp(argv[optind], "series") == 0;
+    const char *dir = opts.nroots ? NULL : argv[optind + is_series];
+    const char *type = is_series ? "series" : argv[optind + npos - 1];
 
-    if (strcmp(argv[2], "daily") == 0) {
-        daily_report(argv[1]);
-    } else if (strcmp(argv[2], "monthly") == 0) {
-        monthly_report(argv[1]);
-    } else {
-        fprintf(stderr, "Unknown report type: %s\n", argv[2]);
+    char dirpath[1024] = "";
+    if (dir && opts.iface) snprintf(dirpath, sizeof(dirpath), "%s/%s/daily", dir, opts.iface);
+    else if (dir) snprintf(dirpath, sizeof(dirpath), "%s", dir);
+
+    by_class = strcmp(type, "classes") == 0;
+    if (!is_series && !by_class && strcmp(type, "daily") != 0 && strcmp(type, "monthly") != 0) {
+        fprintf(stderr, "Unknown report type: %s\n", type);
         return 1;
     }
 
-    return 0;
-}
+    // rows are written as each period completes: keep stdout block-buffered
+    static char outbuf[1 << 16];
+    setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+    if (is_series && (opts.nips == 0 || series.step == 0)) {
+        fprintf(stderr, "series needs at least one --ip and a --step\n");
+        return 1;
+    }
+    if (iptable_init(&totals, sizeof(struct ip_total), 1024) != 0) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if (opts.nroots) {
+        merged = merge_open(opts.roots, opts.nroots, opts.iface, opts.from, opts.to);
+        if (!merged) {
+            iptable_free(&totals);
+            return 1;
+        }
+    }
 
+    if (is_series) {
+        int rc = series_report(dirpath);
+        iptable_free(&totals);
+        merge_close(merged);
+        merged = NULL;
+        return rc;
+    }
+
+    int rc = 0;
+    export_begin(&writer, stdout, opts.format, opts.iface);
+    if (by_class) rc = classes_report(dirpath);
+    else if (strcmp(type, "daily") == 0) daily_report(dirpath);
+    else monthly_report(dirpath);
+    export_end(&writer);
+    iptable_free(&totals);
+    merge_close(merged);
+    merged = NULL;
+
+    return rc || merge_failed;
+}
@@ -0,0 +1,417 @@
+// src/retention.c - tiered retention and disk budget
+//
+// Daily files of the last retain_full days keep every flush. Older days
+// are rewritten with one record per hour, and past retain_hourly days
+// with a single record for the whole day. Kernel, per-IP and per-class
+// bytes are summed (storage_sum_*) per clock hour or day, and each new
+// record is stamped with the newest flush it replaces, so a record stays
+// in its hour and its file and every report over whole hours or days
+// gives the same totals as before. A rewrite goes to a temporary file
+// renamed over the day's .bin.gz: readers see the old or the new file,
+// never a mix.
+//
+// <root>/<iface>/.retention holds the newest day rewritten at each tier,
+// so a pass only opens files that have aged into a new tier. Losing it
+// costs one slow pass: rewriting a file to the tier it is already at
+// gives back the same records.
+//
+// With disk_budget set and the daily files over it, the oldest days still
+// at full resolution (over all interfaces) are downsampled to hourly
+// ahead of time, and if that is not enough the oldest days are deleted.
+// Today's and yesterday's files, which the collector still writes and
+// compresses, are never touched.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "netacct.h"
+
+enum { TIER_FULL, TIER_HOURLY, TIER_DAILY };
+
+static const char *tier_names[] = { "full", "hourly", "daily" };
+
+struct retention_mark {
+    uint32_t hourly_through;   // newest day rewritten to hourly or coarser
+    uint32_t daily_through;    // newest day rewritten to daily
+};
+
+static void load_mark(const char *root_dir, const char *iface, struct retention_mark *m) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s/.retention", root_dir, iface);
+    memset(m, 0, sizeof(*m));
+    FILE *f = fopen(path, "rb");
+    if (!f) return;
+    if (fread(m, sizeof(*m), 1, f) != 1) memset(m, 0, sizeof(*m));
+    fclose(f);
+}
+
+static int save_mark(const char *root_dir, const char *iface, const struct retention_mark *m) {
+    char tmp[1100], path[1100];
+    snprintf(tmp, sizeof(tmp), "%s/%s/.retention.tmp.%d", root_dir, iface, getpid());
+    snprintf(path, sizeof(path), "%s/%s/.retention", root_dir, iface);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    if (write(fd, m, sizeof(*m)) != (ssize_t)sizeof(*m)) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    fsync(fd);
+    close(fd);
+    if (rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Write the summed records as one, stamped with the newest of them but
+ * no later than last, the final second of its bucket. */
+static int write_sum(gzFile out, struct storage_sum *sum, uint32_t last) {
+    const char *buf;
+    long len = storage_sum_encode(sum, sum->last_ts < last ? sum->last_ts : last, &buf);
+    if (len < 0) return -1;
+    return gzwrite(out, buf, (unsigned)len) == (int)len ? 0 : -1;
+}
+
+/* Final second of a rewritten record's bucket. */
+static uint32_t bucket_last(int tier, uint32_t bucket, const struct datafile *df) {
+    return tier == TIER_HOURLY ? bucket * 3600 + 3599 : (uint32_t)df->day + 86399;
+}
+
+/* Rewrite one day at tier into <daily_dir>/YYYY-MM-DD.bin.gz through a
+ * temporary file; the plain source of an interrupted compression is
+ * removed afterwards. Records are summed per clock hour, by their own
+ * stamp (the flush at 01:00:00 belongs to 01:00-02:00, as a report cut
+ * at 01:00 counts it), or over the whole day. */
+static int rewrite_day(const char *daily_dir, const struct datafile *df, int tier,
+                       struct storage_sum *sum, struct ip_entry_on_disk *ents, int64_t *freed) {
+    char src[1100], dst[1100], tmp[1100];
+    snprintf(src, sizeof(src), "%s/%s", daily_dir, df->name);
+    snprintf(dst, sizeof(dst), "%s/%.10s.bin.gz", daily_dir, df->name);
+    snprintf(tmp, sizeof(tmp), "%s/.retention.%d.tmp", daily_dir, getpid());
+
+    struct stat st;
+    off_t before = stat(src, &st) == 0 ? st.st_size : 0;
+    gzFile in = gzopen(src, "rb");
+    if (!in) {
+        fprintf(stderr, "[retention] cannot open %s\n", src);
+        return -1;
+    }
+    gzFile out = gzopen(tmp, "wb9");
+    if (!out) {
+        fprintf(stderr, "[retention] cannot create %s\n", tmp);
+        gzclose(in);
+        return -1;
+    }
+
+    storage_sum_reset(sum);
+    long records = 0, written = 0;
+    uint32_t bucket = 0;
+    int rc = 0;
+    struct record_header h;
+    while (gzread(in, &h, sizeof(h)) == (int)sizeof(h)) {
+        int len = (int)(h.ip_count * sizeof(*ents));
+        if (gzread(in, ents, (unsigned)len) != len) break;   // truncated tail
+        uint32_t b = tier == TIER_HOURLY ? h.ts / 3600 : 0;
+        if (sum->records && b != bucket) {
+            if (write_sum(out, sum, bucket_last(tier, bucket, df)) != 0) {
+                rc = -1;
+                break;
+            }
+            written++;
+        }
+        bucket = b;
+        if (storage_sum_add(sum, &h, ents) != 0) {
+            rc = -1;
+            break;
+        }
+        records++;
+    }
+    int err;
+    gzerror(in, &err);
+    if (err != Z_OK && err != Z_BUF_ERROR) rc = -1;   // BUF_ERROR: truncated gzip tail
+    gzclose(in);
+    if (rc == 0 && sum->records) {
+        rc = write_sum(out, sum, bucket_last(tier, bucket, df));
+        written++;
+    }
+    if (gzclose(out) != Z_OK) rc = -1;
+    if (rc == 0) {
+        // gzclose() does not sync; the rename must not land before the data
+        int fd = open(tmp, O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+        if (rename(tmp, dst) != 0) rc = -1;
+    }
+    if (rc != 0) {
+        fprintf(stderr, "[retention] rewriting %s failed, kept as is\n", src);
+        unlink(tmp);
+        storage_sum_reset(sum);
+        return -1;
+    }
+    if (!df->is_gzip) unlink(src);
+
+    off_t after = stat(dst, &st) == 0 ? st.st_size : 0;
+    if (freed) *freed = (int64_t)before - (int64_t)after;
+    fprintf(stderr, "[retention] %s: %s, %ld records -> %ld, %lld -> %lld bytes\n",
+            src, tier_names[tier], records, written, (long long)before, (long long)after);
+    return 0;
+}
+
+/* Move the days of one interface that have aged into a new tier. */
+static int downsample_iface(const char *root_dir, const char *iface, time_t today,
+                            int full_days, int hourly_days, struct storage_sum *sum,
+                            struct ip_entry_on_disk *ents, const volatile int *running) {
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s/%s/daily", root_dir, iface);
+    time_t hourly_cut = full_days ? today - (time_t)full_days * 86400 : -1;
+    time_t daily_cut = hourly_days ? today - (time_t)hourly_days * 86400 : -1;
+    time_t cut = hourly_cut > daily_cut ? hourly_cut : daily_cut;
+    if (cut < 0) return 0;
+
+    struct datafile *files;
+    int n = util_list_datafiles(dir, 0, cut, &files);
+    if (n < 0) return 0;
+
+    struct retention_mark mark;
+    load_mark(root_dir, iface, &mark);
+    int rc = 0;
+    for (int i = 0; i < n && *running; i++) {
+        const struct datafile *df = &files[i];
+        int tier = df->day <= daily_cut ? TIER_DAILY : TIER_HOURLY;
+        uint32_t day = (uint32_t)df->day;
+        if (tier == TIER_DAILY ? day <= mark.daily_through : day <= mark.hourly_through)
+            continue;
+        if (rewrite_day(dir, df, tier, sum, ents, NULL) != 0) {
+            // later days must not pass over this one in the mark
+            rc = -1;
+            break;
+        }
+        if (day > mark.hourly_through) mark.hourly_through = day;
+        if (tier == TIER_DAILY && day > mark.daily_through) mark.daily_through = day;
+        if (save_mark(root_dir, iface, &mark) != 0)
+            fprintf(stderr, "[retention] cannot write %s/%s/.retention\n", root_dir, iface);
+    }
+    free(files);
+    return rc;
+}
+
+struct budget_file {
+    time_t day;
+    off_t size;                   // with its index, if any
+    char path[1300];
+};
+
+/* <daily>/YYYY-MM-DD.idx of the daily file at path. */
+static void index_path(const char *path, char *buf, size_t n) {
+    const char *name = strrchr(path, '/');
+    snprintf(buf, n, "%.*s.idx", name ? (int)(name - path) + 11 : 10, path);
+}
+
+static int budget_cmp(const void *a, const void *b) {
+    const struct budget_file *x = a, *y = b;
+    if (x->day != y->day) return x->day < y->day ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+/* Every daily file under root_dir, oldest first, and their total size
+ * (day indexes included). */
+static int scan_budget(const char *root_dir, struct budget_file **out, uint64_t *total) {
+    DIR *d = opendir(root_dir);
+    if (!d) return -1;
+    struct budget_file *files = NULL;
+    int n = 0, cap = 0;
+    *total = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char dir[1024];
+        snprintf(dir, sizeof(dir), "%s/%s/daily", root_dir, de->d_name);
+        DIR *dd = opendir(dir);
+        if (!dd) continue;
+        struct dirent *fe;
+        while ((fe = readdir(dd)) != NULL) {
+            struct budget_file f;
+            struct stat st;
+            if (util_parse_datafile_name(fe->d_name, &f.day, NULL) != 0) continue;
+            snprintf(f.path, sizeof(f.path), "%s/%s", dir, fe->d_name);
+            if (stat(f.path, &st) != 0) continue;
+            f.size = st.st_size;
+            char idx[1310];
+            index_path(f.path, idx, sizeof(idx));
+            if (stat(idx, &st) == 0) f.size += st.st_size;
+            *total += (uint64_t)f.size;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 256;
+                struct budget_file *nf = realloc(files, sizeof(*nf) * cap);
+                if (!nf) {
+                    closedir(dd);
+                    closedir(d);
+                    free(files);
+                    return -1;
+                }
+                files = nf;
+            }
+            files[n++] = f;
+        }
+        closedir(dd);
+    }
+    closedir(d);
+    qsort(files, n, sizeof(*files), budget_cmp);
+    *out = files;
+    return n;
+}
+
+struct budget_day {
+    char iface[256];
+    struct datafile df;
+};
+
+static int budget_day_cmp(const void *a, const void *b) {
+    const struct budget_day *x = a, *y = b;
+    if (x->df.day != y->df.day) return x->df.day < y->df.day ? -1 : 1;
+    return strcmp(x->iface, y->iface);
+}
+
+/* Over budget, resolution goes before history: rewrite the oldest days
+ * still at full resolution (over all interfaces) to hourly until the
+ * total fits. Stops at the first failure so that no mark passes over a
+ * day left at full resolution. Returns the new total. */
+static uint64_t shrink_to_hourly(const char *root_dir, uint64_t budget, uint64_t total,
+                                 time_t today, struct storage_sum *sum,
+                                 struct ip_entry_on_disk *ents, const volatile int *running) {
+    DIR *d = opendir(root_dir);
+    if (!d) return total;
+    struct budget_day *days = NULL;
+    int n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.' || strlen(de->d_name) >= sizeof(days->iface)) continue;
+        char dir[1024];
+        snprintf(dir, sizeof(dir), "%s/%s/daily", root_dir, de->d_name);
+        struct retention_mark mark;
+        load_mark(root_dir, de->d_name, &mark);
+        struct datafile *files;
+        int m = util_list_datafiles(dir, (time_t)mark.hourly_through + 86400,
+                                    today - 2 * 86400, &files);
+        if (m <= 0) continue;
+        if (n + m > cap) {
+            cap = (n + m) * 2;
+            struct budget_day *nd = realloc(days, sizeof(*nd) * cap);
+            if (!nd) {
+                free(files);
+                break;
+            }
+            days = nd;
+        }
+        for (int i = 0; i < m; i++) {
+            snprintf(days[n].iface, sizeof(days[n].iface), "%s", de->d_name);
+            days[n++].df = files[i];
+        }
+        free(files);
+    }
+    closedir(d);
+    qsort(days, n, sizeof(*days), budget_day_cmp);
+
+    for (int i = 0; i < n && total > budget && *running; i++) {
+        char dir[1024];
+        snprintf(dir, sizeof(dir), "%s/%s/daily", root_dir, days[i].iface);
+        int64_t freed = 0;
+        if (rewrite_day(dir, &days[i].df, TIER_HOURLY, sum, ents, &freed) != 0) break;
+        total = (int64_t)total > freed ? (uint64_t)((int64_t)total - freed) : 0;
+        struct retention_mark mark;
+        load_mark(root_dir, days[i].iface, &mark);
+        if ((uint32_t)days[i].df.day > mark.hourly_through)
+            mark.hourly_through = (uint32_t)days[i].df.day;
+        if (save_mark(root_dir, days[i].iface, &mark) != 0)
+            fprintf(stderr, "[retention] cannot write %s/%s/.retention\n",
+                    root_dir, days[i].iface);
+    }
+    free(days);
+    return total;
+}
+
+/* Bring the daily files of every interface within budget: downsample
+ * first, then delete the oldest days. */
+static int enforce_budget(const char *root_dir, uint64_t budget, time_t today,
+                          struct storage_sum *sum, struct ip_entry_on_disk *ents,
+                          const volatile int *running) {
+    struct budget_file *files;
+    uint64_t total;
+    int n = scan_budget(root_dir, &files, &total);
+    if (n < 0) return -1;
+    free(files);
+    if (total <= budget) return 0;
+
+    if (shrink_to_hourly(root_dir, budget, total, today, sum, ents, running) <= budget ||
+        !*running)
+        return 0;
+    n = scan_budget(root_dir, &files, &total);
+    if (n < 0) return -1;
+
+    for (int i = 0; i < n && total > budget; i++) {
+        if (files[i].day >= today - 86400) break;
+        if (unlink(files[i].path) != 0) continue;
+        char idx[1310];
+        index_path(files[i].path, idx, sizeof(idx));
+        unlink(idx);
+        total -= (uint64_t)files[i].size;
+        fprintf(stderr, "[retention] disk budget: removed %s\n", files[i].path);
+    }
+    if (total > budget) {
+        fprintf(stderr, "[retention] %s: %llu bytes of daily files, over disk_budget "
+                "with only today's and yesterday's left\n", root_dir, (unsigned long long)total);
+    }
+    free(files);
+    return 0;
+}
+
+/* One pass over every interface under root_dir: downsample what has aged
+ * into a new tier, then enforce the budget. Stops between files once
+ * *running drops. Returns -1 if some file could not be rewritten. */
+int retention_run(const char *root_dir, int full_days, int hourly_days, uint64_t budget,
+                  const volatile int *running) {
+    if (!full_days && !hourly_days && !budget) return 0;
+    time_t now = time(NULL);
+    time_t today = now - now % 86400;
+    int rc = 0;
+
+    struct storage_sum sum;
+    struct ip_entry_on_disk *ents = malloc(sizeof(*ents) * MAX_FLUSH_ENTRIES);
+    if (!ents || storage_sum_init(&sum) != 0) {
+        fprintf(stderr, "[retention] out of memory\n");
+        free(ents);
+        return -1;
+    }
+    if (full_days || hourly_days) {
+        DIR *d = opendir(root_dir);
+        struct dirent *de;
+        while (d && *running && (de = readdir(d)) != NULL) {
+            if (de->d_name[0] == '.') continue;
+            if (downsample_iface(root_dir, de->d_name, today, full_days, hourly_days,
+                                 &sum, ents, running) != 0)
+                rc = -1;
+        }
+        if (d) closedir(d);
+    }
+    if (budget && *running &&
+        enforce_budget(root_dir, budget, today, &sum, ents, running) != 0) {
+        fprintf(stderr, "[retention] cannot scan %s for disk_budget\n", root_dir);
+        rc = -1;
+    }
+    storage_sum_free(&sum);
+    free(ents);
+    return rc;
+}
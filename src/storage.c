@@ -25,6 +25,12 @@
 //   uint32_t addr; // network order
 //   uint64_t rx_delta;
 //   uint64_t tx_delta;
+//
+// With the flow breakdown on, each record is followed by extension
+// records with the same ts, zero totals and entries whose ipv is
+// STORAGE_IPV_FLOW and pad the FLOW_* class (address 0.0.0.0 = bytes of
+// evicted flow entries). They are written in the same append as the
+// record they break down.
 
 int ensure_dir(const char *path) {
     struct stat st;
@@ -101,9 +107,118 @@ static int compress_old_file(const char *root, uint32_t ts) {
     return 0;
 }
 
+size_t storage_record_size(uint16_t ip_count) {
+    return sizeof(uint32_t) + 2 * sizeof(uint64_t) + sizeof(uint16_t) +
+           (size_t)ip_count * sizeof(struct ip_entry_on_disk);
+}
+
+/* Serialize one daily record into buf (storage_record_size() bytes);
+ * the layout is described at the top of this file. */
+size_t storage_encode_record(void *buf, uint32_t ts, uint64_t rx_delta, uint64_t tx_delta,
+                             uint16_t ip_count, const struct ip_record *ips) {
+    char *p = buf;
+    memcpy(p, &ts, sizeof(ts)); p += sizeof(ts);
+    memcpy(p, &rx_delta, sizeof(rx_delta)); p += sizeof(rx_delta);
+    memcpy(p, &tx_delta, sizeof(tx_delta)); p += sizeof(tx_delta);
+    memcpy(p, &ip_count, sizeof(ip_count)); p += sizeof(ip_count);
+
+    // transform to on-disk structure
+    for (int i = 0; i < ip_count; ++i) {
+        struct ip_entry_on_disk e;
+        e.ipv = 4;
+        e.pad = 0;
+        e.addr = ips[i].ip; // network order already
+        e.rx_delta = ips[i].rx;
+        e.tx_delta = ips[i].tx;
+        memcpy(p, &e, sizeof(e)); p += sizeof(e);
+    }
+    return (size_t)(p - (char *)buf);
+}
+
+/* Bytes of the extension records holding n flow entries. */
+size_t storage_flows_size(int n) {
+    size_t records = ((size_t)n + MAX_FLUSH_ENTRIES - 1) / MAX_FLUSH_ENTRIES;
+    return records * storage_record_size(0) + (size_t)n * sizeof(struct ip_entry_on_disk);
+}
+
+size_t storage_encode_flows(void *buf, uint32_t ts, int n, const struct flow_record *flows) {
+    char *p = buf;
+    for (int off = 0; off < n; off += MAX_FLUSH_ENTRIES) {
+        uint16_t cnt = (uint16_t)(n - off < MAX_FLUSH_ENTRIES ? n - off : MAX_FLUSH_ENTRIES);
+        uint64_t zero = 0;
+        memcpy(p, &ts, sizeof(ts)); p += sizeof(ts);
+        memcpy(p, &zero, sizeof(zero)); p += sizeof(zero);
+        memcpy(p, &zero, sizeof(zero)); p += sizeof(zero);
+        memcpy(p, &cnt, sizeof(cnt)); p += sizeof(cnt);
+        for (int i = off; i < off + cnt; i++) {
+            struct ip_entry_on_disk e;
+            e.ipv = STORAGE_IPV_FLOW;
+            e.pad = flows[i].cls;
+            e.addr = flows[i].ip;
+            e.rx_delta = flows[i].rx;
+            e.tx_delta = flows[i].tx;
+            memcpy(p, &e, sizeof(e)); p += sizeof(e);
+        }
+    }
+    return (size_t)(p - (char *)buf);
+}
+
+static int fsync_mode = FSYNC_ALWAYS;
+
+/* always: fsync journal and daily file (survives power loss);
+ * data: fdatasync only, file size updates may lag on some filesystems;
+ * never: leave write-back to the kernel, a crash can lose recent flushes. */
+void storage_set_fsync(int mode) {
+    __atomic_store_n(&fsync_mode, mode, __ATOMIC_RELAXED);
+}
+
+/* Sync fd as the fsync policy asks; for side files such as the quota
+ * checkpoint, which should be no more durable than the data. */
+void storage_sync(int fd) {
+    int mode = __atomic_load_n(&fsync_mode, __ATOMIC_RELAXED);
+    if (mode == FSYNC_NEVER) return;
+    if (mode == FSYNC_DATA) fdatasync(fd);
+    else fsync(fd);
+}
+
+static void timed_fsync(int fd) {
+    if (__atomic_load_n(&fsync_mode, __ATOMIC_RELAXED) == FSYNC_NEVER) return;
+    HISTO_BEGIN(t0);
+    storage_sync(fd);
+    HISTO_END(HISTO_FSYNC, t0);
+}
+
+static int append_daily(const char *root_dir, const char *iface,
+                        uint32_t ts, uint64_t rx_delta, uint64_t tx_delta,
+                        uint16_t ip_count, const void *ip_entries_void, size_t ip_entries_len,
+                        int nflows, const struct flow_record *flows);
+
 int storage_append_daily(const char *root_dir, const char *iface,
                          uint32_t ts, uint64_t rx_delta, uint64_t tx_delta,
                          uint16_t ip_count, const void *ip_entries_void, size_t ip_entries_len)
+{
+    return storage_append_daily_flows(root_dir, iface, ts, rx_delta, tx_delta,
+                                      ip_count, ip_entries_void, ip_entries_len, 0, NULL);
+}
+
+/* storage_append_daily() plus the flow extension records of the same
+ * flush, appended together. */
+int storage_append_daily_flows(const char *root_dir, const char *iface,
+                               uint32_t ts, uint64_t rx_delta, uint64_t tx_delta,
+                               uint16_t ip_count, const void *ip_entries_void, size_t ip_entries_len,
+                               int nflows, const struct flow_record *flows)
+{
+    HISTO_BEGIN(t0);
+    int rc = append_daily(root_dir, iface, ts, rx_delta, tx_delta,
+                          ip_count, ip_entries_void, ip_entries_len, nflows, flows);
+    HISTO_END(HISTO_STORAGE, t0);
+    return rc;
+}
+
+static int append_daily(const char *root_dir, const char *iface,
+                        uint32_t ts, uint64_t rx_delta, uint64_t tx_delta,
+                        uint16_t ip_count, const void *ip_entries_void, size_t ip_entries_len,
+                        int nflows, const struct flow_record *flows)
 {
     char daily_dir[512];
     char date[32];
@@ -128,25 +243,19 @@ int storage_append_daily(const char *root_dir, const char *iface,
     int tfd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (tfd < 0) return -1;
 
-    // prepare header
-    if (write(tfd, &ts, sizeof(ts)) != sizeof(ts)) { close(tfd); unlink(tmpfile); return -1; }
-    if (write(tfd, &rx_delta, sizeof(rx_delta)) != sizeof(rx_delta)) { close(tfd); unlink(tmpfile); return -1; }
-    if (write(tfd, &tx_delta, sizeof(tx_delta)) != sizeof(tx_delta)) { close(tfd); unlink(tmpfile); return -1; }
-    if (write(tfd, &ip_count, sizeof(ip_count)) != sizeof(ip_count)) { close(tfd); unlink(tmpfile); return -1; }
-
-    // write ip entries (we transform to on-disk structure)
-    const struct ip_record *ip_entries = (const struct ip_record*)ip_entries_void;
-    for (int i = 0; i < ip_count; ++i) {
-        struct ip_entry_on_disk e;
-        e.ipv = 4;
-        e.pad = 0;
-        e.addr = ip_entries[i].ip; // network order already
-        e.rx_delta = ip_entries[i].rx;
-        e.tx_delta = ip_entries[i].tx;
-        if (write(tfd, &e, sizeof(e)) != sizeof(e)) { close(tfd); unlink(tmpfile); return -1; }
-    }
+    // prepare the record in memory and write it in one go
+    size_t len = storage_record_size(ip_count) + (nflows ? storage_flows_size(nflows) : 0);
+    char stackbuf[8192];
+    char *rec = len <= sizeof(stackbuf) ? stackbuf : malloc(len);
+    if (!rec) { close(tfd); unlink(tmpfile); return -1; }
+    size_t off = storage_encode_record(rec, ts, rx_delta, tx_delta, ip_count,
+                                       (const struct ip_record*)ip_entries_void);
+    if (nflows) storage_encode_flows(rec + off, ts, nflows, flows);
+    ssize_t wr = write(tfd, rec, len);
+    if (rec != stackbuf) free(rec);
+    if (wr != (ssize_t)len) { close(tfd); unlink(tmpfile); return -1; }
 
-    fsync(tfd); close(tfd);
+    timed_fsync(tfd); close(tfd);
 
     // now append tmpfile to final daily file atomically
     int fd = open(filepath, O_WRONLY | O_CREAT | O_APPEND, 0644);
@@ -161,9 +270,141 @@ int storage_append_daily(const char *root_dir, const char *iface,
         ssize_t w = write(fd, buf, r);
         if (w != r) { close(tf); close(fd); unlink(tmpfile); return -1; }
     }
-    fsync(fd);
+    timed_fsync(fd);
     close(tf);
     close(fd);
     unlink(tmpfile);
     return 0;
 }
+
+/* ---------- Summing records ---------- */
+
+struct class_sum {
+    uint32_t ip;
+    uint64_t rx[FLOW_NCLASSES];
+    uint64_t tx[FLOW_NCLASSES];
+};
+
+int storage_sum_init(struct storage_sum *s) {
+    memset(s, 0, sizeof(*s));
+    if (iptable_init(&s->ips, sizeof(struct ip_record), 1024) != 0) return -1;
+    if (iptable_init(&s->classes, sizeof(struct class_sum), 64) != 0) {
+        iptable_free(&s->ips);
+        return -1;
+    }
+    return 0;
+}
+
+/* Add one decoded record: kernel totals, IPv4 entries and flow entries;
+ * anything else is dropped, as readers would skip it. */
+int storage_sum_add(struct storage_sum *s, const struct record_header *h,
+                    const struct ip_entry_on_disk *entries) {
+    if (h->ts > s->last_ts) s->last_ts = h->ts;
+    s->kernel_rx += h->total_rx;
+    s->kernel_tx += h->total_tx;
+    s->records++;
+    for (int i = 0; i < h->ip_count; i++) {
+        const struct ip_entry_on_disk *e = &entries[i];
+        int created;
+        if (e->ipv == 4) {
+            struct ip_record *t = iptable_get(&s->ips, e->addr, &created);
+            if (!t) return -1;
+            if (created) t->ip = e->addr;
+            t->rx += e->rx_delta;
+            t->tx += e->tx_delta;
+        } else if (e->ipv == STORAGE_IPV_FLOW && e->pad < FLOW_NCLASSES) {
+            struct class_sum *t = iptable_get(&s->classes, e->addr, &created);
+            if (!t) return -1;
+            if (created) t->ip = e->addr;
+            t->rx[e->pad] += e->rx_delta;
+            t->tx[e->pad] += e->tx_delta;
+        }
+    }
+    return 0;
+}
+
+static int sum_reserve(struct storage_sum *s, size_t len) {
+    if (len <= s->buf_cap) return 0;
+    char *nb = realloc(s->buf, len);
+    if (!nb) return -1;
+    s->buf = nb;
+    s->buf_cap = len;
+    return 0;
+}
+
+/* Encode the sum as records stamped ts: one carrying the kernel totals,
+ * continuation records of zero totals if there are more clients than
+ * fit in one, then the flow extension records. *out points into the
+ * sum's buffer; the sum is reset. Returns the length, 0 if nothing was
+ * added, -1 when out of memory. */
+long storage_sum_encode(struct storage_sum *s, uint32_t ts, const char **out) {
+    if (!s->records) return 0;
+    int n = (int)s->ips.count;
+    if (n > s->recs_cap) {
+        struct ip_record *nr = realloc(s->recs, sizeof(*nr) * n);
+        if (!nr) return -1;
+        s->recs = nr;
+        s->recs_cap = n;
+    }
+    int nf = 0;
+    uint32_t pos = 0;
+    struct ip_record *e;
+    n = 0;
+    while ((e = iptable_next(&s->ips, &pos)) != NULL) s->recs[n++] = *e;
+
+    size_t need = (size_t)s->classes.count * FLOW_NCLASSES;
+    if (need > (size_t)s->flows_cap) {
+        struct flow_record *nfl = realloc(s->flows, sizeof(*nfl) * need);
+        if (!nfl) return -1;
+        s->flows = nfl;
+        s->flows_cap = (int)need;
+    }
+    pos = 0;
+    struct class_sum *cs;
+    while ((cs = iptable_next(&s->classes, &pos)) != NULL) {
+        for (int k = 0; k < FLOW_NCLASSES; k++) {
+            if (!cs->rx[k] && !cs->tx[k]) continue;
+            s->flows[nf].ip = cs->ip;
+            s->flows[nf].cls = (uint8_t)k;
+            s->flows[nf].rx = cs->rx[k];
+            s->flows[nf].tx = cs->tx[k];
+            nf++;
+        }
+    }
+
+    size_t records = n ? ((size_t)n + MAX_FLUSH_ENTRIES - 1) / MAX_FLUSH_ENTRIES : 1;
+    size_t len = records * storage_record_size(0) + (size_t)n * sizeof(struct ip_entry_on_disk);
+    if (nf) len += storage_flows_size(nf);
+    if (sum_reserve(s, len) != 0) return -1;
+
+    char *p = s->buf;
+    int off = 0;
+    do {
+        int cnt = n - off < MAX_FLUSH_ENTRIES ? n - off : MAX_FLUSH_ENTRIES;
+        p += storage_encode_record(p, ts, off ? 0 : s->kernel_rx, off ? 0 : s->kernel_tx,
+                                   (uint16_t)cnt, s->recs + off);
+        off += cnt;
+    } while (off < n);
+    if (nf) p += storage_encode_flows(p, ts, nf, s->flows);
+
+    storage_sum_reset(s);
+    *out = s->buf;
+    return (long)(p - s->buf);
+}
+
+void storage_sum_reset(struct storage_sum *s) {
+    s->last_ts = 0;
+    s->kernel_rx = s->kernel_tx = 0;
+    s->records = 0;
+    iptable_reset(&s->ips);
+    iptable_reset(&s->classes);
+}
+
+void storage_sum_free(struct storage_sum *s) {
+    iptable_free(&s->ips);
+    iptable_free(&s->classes);
+    free(s->recs);
+    free(s->flows);
+    free(s->buf);
+    memset(s, 0, sizeof(*s));
+}
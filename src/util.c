@@ -1,2 +1,142 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <time.h>
+
 #include "netacct.h"
-// Placeholder for helpers
+
+/* Parse "YYYY-MM-DD", "YYYY-MM-DDTHH:MM[:SS]" (a space works as well as 'T')
+ * or a plain epoch number. All dates are UTC, like the daily file names.
+ * A date without a time of day is expanded to the end of that day when
+ * end_of_day is set, so "--to 2025-09-07" includes the whole of the 7th.
+ * Returns 0 on success, -1 on malformed input. */
+int util_parse_time(const char *s, int end_of_day, time_t *out) {
+    if (!s || !*s) return -1;
+
+    const char *p = s;
+    while (isdigit((unsigned char)*p)) p++;
+    if (*p == '\0' && p - s > 8) {
+        *out = (time_t)strtoll(s, NULL, 10);
+        return 0;
+    }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    int y, mo, d, h = 0, mi = 0, sec = 0;
+    char sep = 0, trail = 0;
+    int n = sscanf(s, "%4d-%2d-%2d%c%2d:%2d:%2d%c", &y, &mo, &d, &sep, &h, &mi, &sec, &trail);
+    if (n < 3 || n == 4 || n == 5 || n == 8) return -1;
+    if (n > 3 && sep != 'T' && sep != ' ') return -1;
+    if (mo < 1 || mo > 12 || d < 1 || d > 31 || h > 23 || mi > 59 || sec > 60) return -1;
+
+    tm.tm_year = y - 1900;
+    tm.tm_mon = mo - 1;
+    tm.tm_mday = d;
+    tm.tm_hour = h;
+    tm.tm_min = mi;
+    tm.tm_sec = sec;
+    time_t t = timegm(&tm);
+    if (t == (time_t)-1) return -1;
+    if (n == 3 && end_of_day) t += 86400 - 1;
+    *out = t;
+    return 0;
+}
+
+/* Strictly match "YYYY-MM-DD.bin" / "YYYY-MM-DD.bin.gz" as written by
+ * storage_append_daily(). On match, stores the UTC start of that day and
+ * whether the file is compressed; returns 0, or -1 for anything else
+ * (journals, .last_counts, editor backups, ...). */
+int util_parse_datafile_name(const char *name, time_t *day_start, int *is_gzip) {
+    if (strlen(name) < 14) return -1;
+    for (int i = 0; i < 10; i++) {
+        if (i == 4 || i == 7) {
+            if (name[i] != '-') return -1;
+        } else if (!isdigit((unsigned char)name[i])) {
+            return -1;
+        }
+    }
+
+    int gz;
+    if (strcmp(name + 10, ".bin") == 0) gz = 0;
+    else if (strcmp(name + 10, ".bin.gz") == 0) gz = 1;
+    else return -1;
+
+    char date[11];
+    memcpy(date, name, 10);
+    date[10] = '\0';
+    time_t t;
+    if (util_parse_time(date, 0, &t) != 0) return -1;
+
+    if (day_start) *day_start = t;
+    if (is_gzip) *is_gzip = gz;
+    return 0;
+}
+
+static int datafile_cmp(const void *a, const void *b) {
+    const struct datafile *x = a, *y = b;
+    if (x->day != y->day) return x->day < y->day ? -1 : 1;
+    return x->is_gzip - y->is_gzip;
+}
+
+/* List the daily files of dir that can hold records inside [from, to],
+ * oldest first, into a malloc'd *out. The decision is made from the file
+ * name alone. If a day exists both as .bin and .bin.gz (compression
+ * interrupted before the unlink), only the plain file is kept: it is the
+ * complete source of the pair. Returns the count, -1 if dir cannot be
+ * read (errno set). */
+int util_list_datafiles(const char *dir, time_t from, time_t to, struct datafile **out) {
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+
+    struct datafile *files = NULL;
+    int n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        struct datafile df;
+        if (util_parse_datafile_name(de->d_name, &df.day, &df.is_gzip) != 0) continue;
+        if (df.day + 86400 - 1 < from || df.day > to) continue;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            struct datafile *nf = realloc(files, sizeof(*files) * cap);
+            if (!nf) {
+                free(files);
+                closedir(d);
+                return -1;
+            }
+            files = nf;
+        }
+        memcpy(df.name, de->d_name, strlen(de->d_name) + 1);  // validated: <= 17 chars
+        files[n++] = df;
+    }
+    closedir(d);
+
+    qsort(files, n, sizeof(*files), datafile_cmp);
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (m > 0 && files[m-1].day == files[i].day) continue;
+        files[m++] = files[i];
+    }
+
+    *out = files;
+    return m;
+}
+
+/* Parse "300", "30s", "5m", "1h" or "1d" into seconds; 0 if malformed. */
+uint32_t util_parse_step(const char *s) {
+    char *end;
+    unsigned long v = strtoul(s, &end, 10);
+    if (end == s || v == 0) return 0;
+    unsigned long mul = 1;
+    if (*end == 's') mul = 1;
+    else if (*end == 'm') mul = 60;
+    else if (*end == 'h') mul = 3600;
+    else if (*end == 'd') mul = 86400;
+    else if (*end != '\0') return 0;
+    if (*end && end[1] != '\0') return 0;
+    if (v > UINT32_MAX / mul) return 0;
+    return (uint32_t)(v * mul);
+}
@@ -0,0 +1,737 @@
+// tests/tests.c - unit tests for the storage-side modules (make test)
+//
+// Links against the daemon objects (everything but main.o), like the
+// benchmarks, and checks:
+//   report     --from/--to cut days and hours, skip out-of-range files
+//              unread, and --top/--ip pick the right IPs
+//   iptable    get/find/next/reset of the open-addressing table
+//   histo      percentiles stay within a bucket of the recorded values
+//   retention  hourly and daily rewrites keep every hour's bytes, and
+//              stamp each record inside the hour (or day) it sums
+//   dayindex   lookups over hour ranges match a full read of the file
+//   quota      each threshold runs the hook once, with the usage that
+//              crossed it
+//   merge      --out keeps each day's totals in that day's file
+// Every case prints "ok NAME" or its failed checks; the exit status is
+// the number of failed cases, whose scratch files are kept. Library
+// chatter goes to /dev/null.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "netacct.h"
+
+#define TEST_IPS 50               // clients in the generated days
+#define TEST_IP_BASE 0x0a000001u  // 10.0.0.1
+
+static char scratch[512];
+static int case_failed;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        printf("  %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+        case_failed = 1; \
+    } \
+} while (0)
+
+/* Silence stderr around calls that log. */
+static int saved_stderr = -1;
+
+static void quiet(int on) {
+    fflush(stderr);
+    if (on) {
+        saved_stderr = dup(STDERR_FILENO);
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+    } else if (saved_stderr >= 0) {
+        dup2(saved_stderr, STDERR_FILENO);
+        close(saved_stderr);
+        saved_stderr = -1;
+    }
+}
+
+static uint32_t xorshift(uint32_t *s) {
+    uint32_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *s = x;
+}
+
+static void remove_tree(const char *path) {
+    DIR *d = opendir(path);
+    if (!d) {
+        unlink(path);
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(d))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char sub[1024];
+        snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name);
+        remove_tree(sub);
+    }
+    closedir(d);
+    rmdir(path);
+}
+
+/* ---------- Daily files ---------- */
+
+/* Bytes of one day by clock hour, as a full read of its file sees them. */
+struct day_sums {
+    uint32_t first_ts[24], last_ts[24];
+    long records[24];
+    uint64_t kernel_rx[24], kernel_tx[24];
+    uint64_t rx[TEST_IPS][24], tx[TEST_IPS][24];
+};
+
+static time_t test_day(int days_ago) {
+    time_t now = time(NULL);
+    return now - now % 86400 - (time_t)days_ago * 86400;
+}
+
+static void day_name(time_t day, char *buf, size_t n) {
+    struct tm gm;
+    gmtime_r(&day, &gm);
+    strftime(buf, n, "%Y-%m-%d", &gm);
+}
+
+/* Write <root>/<iface>/daily/<day>.bin: a record every step seconds
+ * (some on hour boundaries) plus one in the day's last second. */
+static int write_day(const char *root, const char *iface, time_t day, uint32_t step,
+                     uint32_t seed) {
+    char dir[1024], date[32], path[1100];
+    snprintf(dir, sizeof(dir), "%s/%s/daily", root, iface);
+    if (ensure_dir(dir) != 0) return -1;
+    day_name(day, date, sizeof(date));
+    snprintf(path, sizeof(path), "%s/%s.bin", dir, date);
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+
+    struct ip_record ips[TEST_IPS];
+    char buf[sizeof(struct record_header) + sizeof(struct ip_entry_on_disk) * TEST_IPS];
+    int ok = 1;
+    for (uint32_t off = step; ok && off <= 86400; off += step) {
+        uint32_t ts = (uint32_t)day + (off < 86400 ? off : 86399);
+        uint64_t krx = 0, ktx = 0;
+        int n = 0;
+        for (int i = 0; i < TEST_IPS; i++) {
+            if (xorshift(&seed) % 4 == 0) continue;   // idle this interval
+            ips[n].ip = htonl(TEST_IP_BASE + (uint32_t)i);
+            ips[n].rx = xorshift(&seed) % 1000000;
+            ips[n].tx = xorshift(&seed) % 100000;
+            krx += ips[n].rx;
+            ktx += ips[n].tx;
+            n++;
+        }
+        size_t len = storage_encode_record(buf, ts, krx + 4096, ktx + 512, (uint16_t)n, ips);
+        ok = fwrite(buf, len, 1, f) == 1;
+    }
+    return fclose(f) == 0 && ok ? 0 : -1;
+}
+
+/* Sum the one day file of <root>/<iface>/daily by clock hour. Returns
+ * the number of records, -1 if the file cannot be read or a record lies
+ * outside its day. */
+static long read_day(const char *root, const char *iface, struct day_sums *s, time_t *day) {
+    char dir[1024], path[1100];
+    snprintf(dir, sizeof(dir), "%s/%s/daily", root, iface);
+    struct datafile *files;
+    int nfiles = util_list_datafiles(dir, 0, (time_t)UINT32_MAX, &files);
+    if (nfiles != 1) {
+        if (nfiles > 0) free(files);
+        return -1;
+    }
+    *day = files[0].day;
+    snprintf(path, sizeof(path), "%s/%s", dir, files[0].name);
+    free(files);
+
+    gzFile in = gzopen(path, "rb");
+    if (!in) return -1;
+    memset(s, 0, sizeof(*s));
+    struct ip_entry_on_disk ents[TEST_IPS];
+    struct record_header h;
+    long records = 0;
+    while (gzread(in, &h, sizeof(h)) == (int)sizeof(h)) {
+        int len = (int)(h.ip_count * sizeof(ents[0]));
+        if (h.ip_count > TEST_IPS || gzread(in, ents, (unsigned)len) != len ||
+            h.ts < *day || h.ts - *day >= 86400) {
+            records = -1;
+            break;
+        }
+        int hr = (int)((h.ts - *day) / 3600);
+        if (!s->first_ts[hr]) s->first_ts[hr] = h.ts;
+        s->last_ts[hr] = h.ts;
+        s->records[hr]++;
+        s->kernel_rx[hr] += h.total_rx;
+        s->kernel_tx[hr] += h.total_tx;
+        for (int i = 0; i < h.ip_count; i++) {
+            uint32_t k = ntohl(ents[i].addr) - TEST_IP_BASE;
+            if (ents[i].ipv != 4 || k >= TEST_IPS) continue;
+            s->rx[k][hr] += ents[i].rx_delta;
+            s->tx[k][hr] += ents[i].tx_delta;
+        }
+        records++;
+    }
+    gzclose(in);
+    return records;
+}
+
+/* Compare the bytes of hours [h0, h1) of a and b. */
+static int same_hours(const struct day_sums *a, const struct day_sums *b, int h0, int h1) {
+    uint64_t x[2 + 2 * TEST_IPS], y[2 + 2 * TEST_IPS];
+    memset(x, 0, sizeof(x));
+    memset(y, 0, sizeof(y));
+    for (int hr = h0; hr < h1; hr++) {
+        x[0] += a->kernel_rx[hr]; y[0] += b->kernel_rx[hr];
+        x[1] += a->kernel_tx[hr]; y[1] += b->kernel_tx[hr];
+        for (int k = 0; k < TEST_IPS; k++) {
+            x[2 + 2 * k] += a->rx[k][hr]; y[2 + 2 * k] += b->rx[k][hr];
+            x[3 + 2 * k] += a->tx[k][hr]; y[3 + 2 * k] += b->tx[k][hr];
+        }
+    }
+    return memcmp(x, y, sizeof(x)) == 0;
+}
+
+/* ---------- Cases ---------- */
+
+/* One row of a CSV report. */
+struct report_row {
+    char period[16], kind[8], ip[16];
+    uint32_t start, end;
+    uint64_t rx, tx;
+};
+
+/* Run reporter_run() with stdout sent to a scratch file and parse its
+ * CSV rows. Returns the number of rows, -1 if the report failed. */
+static int run_report(int argc, char **argv, struct report_row *rows, int max) {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/report.csv", scratch);
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (saved < 0 || fd < 0) return -1;
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    quiet(1);
+    int rc = reporter_run(argc, argv);
+    fflush(stdout);
+    quiet(0);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    if (rc != 0) return -1;
+
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char line[256];
+    int n = 0;
+    if (!fgets(line, sizeof(line), f)) n = -1;   // header
+    while (n >= 0 && n < max && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *s = line, *field[8];
+        int nf = 0;
+        while (nf < 8 && s) field[nf++] = strsep(&s, ",");
+        if (nf != 8) {
+            n = -1;
+            break;
+        }
+        struct report_row *r = &rows[n++];
+        snprintf(r->period, sizeof(r->period), "%s", field[0]);
+        r->start = (uint32_t)strtoul(field[1], NULL, 10);
+        r->end = (uint32_t)strtoul(field[2], NULL, 10);
+        snprintf(r->kind, sizeof(r->kind), "%s", field[4]);
+        snprintf(r->ip, sizeof(r->ip), "%s", field[5]);
+        r->rx = strtoull(field[6], NULL, 10);
+        r->tx = strtoull(field[7], NULL, 10);
+    }
+    fclose(f);
+    return n;
+}
+
+static void test_report(void) {
+    char root[600], dir[700], path[800], from[32], to[32], date[2][16];
+    snprintf(root, sizeof(root), "%s/report", scratch);
+    remove_tree(root);
+    snprintf(dir, sizeof(dir), "%s/eth0/daily", root);
+
+    // D-5..D-2 in the report root; D-4 and D-3 also alone, to sum them
+    time_t day[2] = { test_day(4), test_day(3) };
+    struct day_sums s[2];
+    for (int d = 5; d >= 2; d--) CHECK(write_day(root, "eth0", test_day(d), 300, 10 + d) == 0);
+    for (int d = 0; d < 2; d++) {
+        char one[700];
+        time_t got;
+        snprintf(one, sizeof(one), "%s/day%d", root, d);
+        CHECK(write_day(one, "eth0", day[d], 300, 14 - d) == 0);
+        CHECK(read_day(one, "eth0", &s[d], &got) == 288 && got == day[d]);
+        day_name(day[d], date[d], sizeof(date[d]));
+    }
+
+    // a D-6 file holding a record inside the range: only read if the
+    // reporter failed to prune files by name
+    day_name(test_day(6), from, sizeof(from));
+    snprintf(path, sizeof(path), "%s/%s.bin", dir, from);
+    struct ip_record decoy = { .ip = htonl(TEST_IP_BASE), .rx = 1ull << 40, .tx = 1ull << 40 };
+    char rec[sizeof(struct record_header) + sizeof(struct ip_entry_on_disk)];
+    size_t len = storage_encode_record(rec, (uint32_t)day[0] + 43200, 1ull << 41, 1ull << 41,
+                                       1, &decoy);
+    FILE *f = fopen(path, "wb");
+    CHECK(f && fwrite(rec, len, 1, f) == 1);
+    if (f) fclose(f);
+
+    // hours 6-23 of D-4 and 0-17 of D-3; both cuts fall on records
+    const int h0[2] = { 6, 0 }, h1[2] = { 24, 18 };
+    uint64_t rx[2][TEST_IPS], tx[2][TEST_IPS], krx[2] = { 0, 0 }, ktx[2] = { 0, 0 };
+    memset(rx, 0, sizeof(rx));
+    memset(tx, 0, sizeof(tx));
+    for (int d = 0; d < 2; d++) {
+        for (int hr = h0[d]; hr < h1[d]; hr++) {
+            krx[d] += s[d].kernel_rx[hr];
+            ktx[d] += s[d].kernel_tx[hr];
+            for (int k = 0; k < TEST_IPS; k++) {
+                rx[d][k] += s[d].rx[k][hr];
+                tx[d][k] += s[d].tx[k][hr];
+            }
+        }
+    }
+    snprintf(from, sizeof(from), "%sT06:00", date[0]);
+    snprintf(to, sizeof(to), "%sT17:59:59", date[1]);
+
+    // monthly --top 5: the five heaviest IPs, then all IPs and the kernel
+    struct report_row rows[16];
+    char *argv[] = { "report", root, "monthly", "--iface", "eth0", "--from", from, "--to", to,
+                     "--top", "5", "--format", "csv", NULL };
+    int n = run_report(13, argv, rows, 16);
+    CHECK(n == 7);
+    uint64_t sum[TEST_IPS], all_rx = 0, all_tx = 0;
+    int order[TEST_IPS];
+    for (int k = 0; k < TEST_IPS; k++) {
+        sum[k] = rx[0][k] + tx[0][k] + rx[1][k] + tx[1][k];
+        all_rx += rx[0][k] + rx[1][k];
+        all_tx += tx[0][k] + tx[1][k];
+        int j = k;
+        for (; j > 0 && sum[order[j - 1]] < sum[k]; j--) order[j] = order[j - 1];
+        order[j] = k;
+    }
+    for (int i = 0; i < 7 && i < n; i++) {
+        CHECK(rows[i].start == (uint32_t)day[0] + 6 * 3600);
+        CHECK(rows[i].end == s[1].last_ts[17]);
+    }
+    for (int i = 0; i < 5 && i < n; i++) {
+        int k = order[i];
+        char ip[24];
+        snprintf(ip, sizeof(ip), "10.0.0.%d", k + 1);
+        CHECK(strcmp(rows[i].kind, "ip") == 0 && strcmp(rows[i].ip, ip) == 0);
+        CHECK(rows[i].rx == rx[0][k] + rx[1][k] && rows[i].tx == tx[0][k] + tx[1][k]);
+    }
+    if (n == 7) {
+        CHECK(strcmp(rows[5].kind, "all") == 0);
+        CHECK(rows[5].rx == all_rx && rows[5].tx == all_tx);
+        CHECK(strcmp(rows[6].kind, "kernel") == 0);
+        CHECK(rows[6].rx == krx[0] + krx[1] && rows[6].tx == ktx[0] + ktx[1]);
+    }
+
+    // daily --ip: one period per day, only the IPs asked for
+    char *argv_ip[] = { "report", root, "daily", "--iface", "eth0", "--from", from, "--to", to,
+                        "--ip", "10.0.0.3", "--ip", "10.0.0.17", "--format", "csv", NULL };
+    n = run_report(15, argv_ip, rows, 16);
+    CHECK(n == 8);
+    for (int d = 0; d < 2 && n == 8; d++) {
+        const struct report_row *r = &rows[4 * d];
+        uint64_t ip_rx = 0, ip_tx = 0;
+        for (int i = 0; i < 4; i++) {
+            CHECK(strcmp(r[i].period, date[d]) == 0);
+            CHECK(r[i].start == s[d].first_ts[h0[d]] && r[i].end == s[d].last_ts[h1[d] - 1]);
+        }
+        for (int i = 0; i < 2; i++) {
+            int k = strcmp(r[i].ip, "10.0.0.3") == 0 ? 2 : 16;
+            CHECK(strcmp(r[i].kind, "ip") == 0);
+            CHECK(k == 2 || strcmp(r[i].ip, "10.0.0.17") == 0);
+            CHECK(r[i].rx == rx[d][k] && r[i].tx == tx[d][k]);
+            ip_rx += r[i].rx;
+            ip_tx += r[i].tx;
+        }
+        CHECK(strcmp(r[0].ip, r[1].ip) != 0);
+        CHECK(strcmp(r[2].kind, "all") == 0 && r[2].rx == ip_rx && r[2].tx == ip_tx);
+        CHECK(strcmp(r[3].kind, "kernel") == 0 && r[3].rx == krx[d] && r[3].tx == ktx[d]);
+    }
+}
+
+struct test_val {
+    uint32_t ip;
+    uint64_t n;
+};
+
+static void test_iptable(void) {
+    struct iptable t;
+    CHECK(iptable_init(&t, sizeof(struct test_val), 16) == 0);
+    int created;
+    for (uint32_t i = 0; i < 5000; i++) {
+        struct test_val *v = iptable_get(&t, htonl(TEST_IP_BASE + i), &created);
+        CHECK(v && created && v->ip == 0 && v->n == 0);
+        if (!v) return;
+        v->ip = htonl(TEST_IP_BASE + i);
+        v->n = i;
+    }
+    CHECK(t.count == 5000);
+    struct test_val *v = iptable_get(&t, htonl(TEST_IP_BASE + 1234), &created);
+    CHECK(v && !created && v->n == 1234);
+    CHECK(iptable_find(&t, htonl(TEST_IP_BASE + 4999)) != NULL);
+    CHECK(iptable_find(&t, htonl(TEST_IP_BASE + 5000)) == NULL);
+
+    uint32_t pos = 0, seen = 0;
+    uint64_t sum = 0;
+    while ((v = iptable_next(&t, &pos)) != NULL) {
+        CHECK(v == iptable_find(&t, v->ip));
+        sum += v->n;
+        seen++;
+    }
+    CHECK(seen == 5000 && sum == 4999ull * 5000 / 2);
+
+    iptable_reset(&t);
+    CHECK(t.count == 0);
+    CHECK(iptable_find(&t, htonl(TEST_IP_BASE)) == NULL);
+    pos = 0;
+    CHECK(iptable_next(&t, &pos) == NULL);
+    v = iptable_get(&t, htonl(TEST_IP_BASE), &created);
+    CHECK(v && created && v->n == 0);
+    iptable_free(&t);
+}
+
+static void test_histo(void) {
+    // a stage the test binary never times itself
+    for (uint64_t ns = 1; ns <= 10000; ns++) histo_record(HISTO_FSYNC, ns);
+    struct histo_summary hs;
+    histo_summary(HISTO_FSYNC, &hs);
+    CHECK(hs.count == 10000);
+    CHECK(hs.max == 10000);
+    // each figure is the top of its bucket: at most 1/16 above the value
+    CHECK(hs.p50 >= 5000 && hs.p50 <= 5000 + 5000 / 16);
+    CHECK(hs.p90 >= 9000 && hs.p90 <= 9000 + 9000 / 16);
+    CHECK(hs.p99 >= 9900 && hs.p99 <= 10000);
+    CHECK(hs.p999 >= 9990 && hs.p999 <= 10000);
+    CHECK(hs.p50 <= hs.p90 && hs.p90 <= hs.p99 && hs.p99 <= hs.p999);
+}
+
+static void test_retention(void) {
+    char root[600];
+    snprintf(root, sizeof(root), "%s/retention", scratch);
+    remove_tree(root);
+    time_t day = test_day(10), got;
+    CHECK(write_day(root, "eth0", day, 300, 1) == 0);
+    struct day_sums before, after;
+    CHECK(read_day(root, "eth0", &before, &got) == 288);
+
+    // older than one day: hourly
+    int running = 1;
+    quiet(1);
+    int rc = retention_run(root, 1, 0, 0, &running);
+    quiet(0);
+    CHECK(rc == 0);
+    CHECK(read_day(root, "eth0", &after, &got) == 24 && got == day);
+    CHECK(same_hours(&before, &after, 0, 24));
+    for (int hr = 0; hr < 24; hr++) {
+        CHECK(same_hours(&before, &after, hr, hr + 1));
+        CHECK(after.records[hr] == 1);
+        // stamped with the newest flush it replaces, inside its hour
+        CHECK(after.last_ts[hr] == before.last_ts[hr]);
+    }
+
+    // older than two days: one record for the day
+    quiet(1);
+    rc = retention_run(root, 1, 2, 0, &running);
+    quiet(0);
+    CHECK(rc == 0);
+    CHECK(read_day(root, "eth0", &after, &got) == 1 && got == day);
+    CHECK(same_hours(&before, &after, 0, 24));
+    CHECK(after.records[23] == 1 && after.last_ts[23] == (uint32_t)day + 86399);
+}
+
+static void test_dayindex(void) {
+    char root[600], dir[700];
+    snprintf(root, sizeof(root), "%s/dayindex", scratch);
+    remove_tree(root);
+    snprintf(dir, sizeof(dir), "%s/eth0/daily", root);
+    time_t day = test_day(3), got;
+    CHECK(write_day(root, "eth0", day, 60, 2) == 0);
+    struct day_sums s;
+    CHECK(read_day(root, "eth0", &s, &got) == 1440);
+
+    struct datafile *files;
+    CHECK(util_list_datafiles(dir, 0, (time_t)UINT32_MAX, &files) == 1);
+    CHECK(dayindex_build(dir, &files[0]) == 0);
+    struct dayindex *x = dayindex_open(dir, &files[0]);
+    CHECK(x != NULL);
+    if (!x) {
+        free(files);
+        return;
+    }
+    CHECK(dayindex_count(x) == TEST_IPS);
+
+    static const int ranges[][2] = { { 0, 24 }, { 0, 1 }, { 3, 7 }, { 12, 13 }, { 23, 24 } };
+    for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); r++) {
+        int h0 = ranges[r][0], h1 = ranges[r][1];
+        uint64_t want_krx = 0, want_ktx = 0;
+        for (int hr = h0; hr < h1; hr++) {
+            want_krx += s.kernel_rx[hr];
+            want_ktx += s.kernel_tx[hr];
+        }
+        uint64_t krx, ktx;
+        uint32_t first, last;
+        CHECK(dayindex_span(x, h0, h1, &krx, &ktx, &first, &last) == 1);
+        CHECK(krx == want_krx && ktx == want_ktx);
+        CHECK(first == s.first_ts[h0] && last == s.last_ts[h1 - 1]);
+
+        for (uint32_t k = 0; k < TEST_IPS; k++) {
+            uint64_t want_rx = 0, want_tx = 0, rx, tx;
+            for (int hr = h0; hr < h1; hr++) {
+                want_rx += s.rx[k][hr];
+                want_tx += s.tx[k][hr];
+            }
+            uint32_t ip;
+            CHECK(dayindex_lookup(x, htonl(TEST_IP_BASE + k), h0, h1, &rx, &tx) == 1);
+            CHECK(rx == want_rx && tx == want_tx);
+            // ips[] is sorted in stored (network) order, not by k
+            CHECK(dayindex_entry(x, k, h0, h1, &ip, &rx, &tx) == 1);
+            uint32_t j = ntohl(ip) - TEST_IP_BASE;
+            CHECK(j < TEST_IPS);
+            uint64_t jrx = 0, jtx = 0;
+            for (int hr = h0; hr < h1 && j < TEST_IPS; hr++) {
+                jrx += s.rx[j][hr];
+                jtx += s.tx[j][hr];
+            }
+            CHECK(rx == jrx && tx == jtx);
+        }
+    }
+    uint64_t rx, tx;
+    CHECK(dayindex_lookup(x, htonl(TEST_IP_BASE + TEST_IPS), 0, 24, &rx, &tx) == 0);
+    dayindex_close(x);
+
+    // the file changed since: the index no longer applies
+    char path[1100];
+    snprintf(path, sizeof(path), "%s/%s", dir, files[0].name);
+    FILE *f = fopen(path, "ab");
+    char rec[sizeof(struct record_header)];
+    size_t len = storage_encode_record(rec, (uint32_t)day + 86399, 1, 1, 0, NULL);
+    CHECK(f && fwrite(rec, len, 1, f) == 1);
+    if (f) fclose(f);
+    x = dayindex_open(dir, &files[0]);
+    CHECK(x == NULL);
+    dayindex_close(x);
+    free(files);
+}
+
+static int count_lines(const char *path, char lines[][128], int max) {
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    int n = 0;
+    char buf[128];
+    while (n < max && fgets(buf, sizeof(buf), f)) {
+        buf[strcspn(buf, "\n")] = '\0';
+        snprintf(lines[n++], 128, "%s", buf);
+    }
+    fclose(f);
+    return n;
+}
+
+static void test_quota(void) {
+    static struct cfg cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    char root[600], out_path[700];
+    snprintf(root, sizeof(root), "%s/quota", scratch);
+    snprintf(out_path, sizeof(out_path), "%s/hook.out", scratch);
+    remove_tree(root);
+    unlink(out_path);
+    snprintf(cfg.quota_hook, sizeof(cfg.quota_hook), "%.200s/hook.sh", scratch);
+    CHECK(ensure_dir(root) == 0);
+    FILE *f = fopen(cfg.quota_hook, "w");
+    CHECK(f != NULL);
+    if (!f) return;
+    fprintf(f, "#!/bin/sh\necho \"$*\" >> '%s'\n", out_path);
+    fclose(f);
+    chmod(cfg.quota_hook, 0755);
+
+    cfg.quotas[0].is_default = 1;
+    cfg.quotas[0].period = QUOTA_DAY;
+    cfg.quotas[0].limit = 1000;
+    cfg.quota_count = 1;
+    cfg.quota_thresholds[0] = 80;
+    cfg.quota_thresholds[1] = 100;
+    cfg.quota_threshold_count = 2;
+
+    quiet(1);
+    quota_configure(&cfg);
+    int rc = quota_load(root, &cfg);
+    uint32_t ts = (uint32_t)time(NULL);
+    struct ip_record r = { .ip = htonl(TEST_IP_BASE), .rx = 500, .tx = 0 };
+    quota_account(ts, &r, 1);           //  500: below 80%
+    r.rx = 300;
+    r.tx = 50;
+    quota_account(ts, &r, 1);           //  850: 80%
+    r.rx = 100;
+    r.tx = 0;
+    quota_account(ts, &r, 1);           //  950: nothing new
+    quota_account(ts, &r, 1);           // 1050: 100%
+    quota_account(ts, &r, 1);           // 1150: reported already
+    quiet(0);
+    CHECK(rc == 0);
+
+    struct quota_view *qv = NULL;
+    int cap = 0;
+    uint32_t start[QUOTA_NPERIODS];
+    int n = quota_view_alloc(&qv, &cap, start);
+    CHECK(n == 1);
+    CHECK(start[QUOTA_DAY] == ts - ts % 86400);
+    if (n == 1) {
+        CHECK(qv[0].used[QUOTA_DAY] == 1150 && qv[0].limit[QUOTA_DAY] == 1000);
+        CHECK(qv[0].limit[QUOTA_MONTH] == 0);
+    }
+    free(qv);
+
+    // hooks run detached; give them a moment to append
+    char lines[4][128];
+    int nl = 0;
+    for (int i = 0; i < 100 && (nl = count_lines(out_path, lines, 4)) < 2; i++) usleep(20000);
+    usleep(50000);
+    nl = count_lines(out_path, lines, 4);
+    CHECK(nl == 2);
+    if (nl == 2) {
+        // concurrent hooks may append in either order
+        int k = strcmp(lines[0], "10.0.0.1 day 80 850 1000") == 0 ? 0 : 1;
+        CHECK(strcmp(lines[k], "10.0.0.1 day 80 850 1000") == 0);
+        CHECK(strcmp(lines[1 - k], "10.0.0.1 day 100 1050 1000") == 0);
+    }
+}
+
+/* Sum every record merge_open() yields for one day of root. */
+static int merge_day_totals(char *root, time_t day, uint64_t *kernel, uint64_t *ip_bytes,
+                            long *records) {
+    char *roots[] = { root };
+    struct merge *m = merge_open(roots, 1, NULL, day, day + 86399);
+    if (!m) return -1;
+    struct merge_record r;
+    int rc;
+    *kernel = *ip_bytes = 0;
+    *records = 0;
+    while ((rc = merge_next(m, &r)) > 0) {
+        if (r.h.ts < day || r.h.ts > day + 86399) rc = -1;
+        *kernel += r.h.total_rx + r.h.total_tx;
+        for (int i = 0; i < r.h.ip_count; i++)
+            *ip_bytes += r.entries[i].rx_delta + r.entries[i].tx_delta;
+        (*records)++;
+    }
+    merge_close(m);
+    return rc;
+}
+
+static void test_merge(void) {
+    char a[600], b[600], out[600];
+    snprintf(a, sizeof(a), "%s/merge/a", scratch);
+    snprintf(b, sizeof(b), "%s/merge/b", scratch);
+    snprintf(out, sizeof(out), "%s/merge/out", scratch);
+    remove_tree(a);
+    remove_tree(b);
+    remove_tree(out);
+    time_t day0 = test_day(5), day1 = test_day(4);
+    CHECK(write_day(a, "eth0", day0, 300, 3) == 0);
+    CHECK(write_day(a, "eth0", day1, 300, 4) == 0);
+    CHECK(write_day(b, "eth0", day0, 600, 5) == 0);
+    CHECK(write_day(b, "eth0", day1, 600, 6) == 0);
+
+    char *argv[] = { "merge", "--out", out, "--step", "1h", a, b, NULL };
+    optind = 1;
+    quiet(1);
+    int rc = merge_run(7, argv);
+    quiet(0);
+    CHECK(rc == 0);
+
+    time_t days[] = { day0, day1 };
+    for (int d = 0; d < 2; d++) {
+        uint64_t ka, ia, kb, ib, km, im;
+        long na, nb, nm;
+        CHECK(merge_day_totals(a, days[d], &ka, &ia, &na) == 0);
+        CHECK(merge_day_totals(b, days[d], &kb, &ib, &nb) == 0);
+        CHECK(merge_day_totals(out, days[d], &km, &im, &nm) == 0);
+        CHECK(km == ka + kb && im == ia + ib);
+        CHECK(na == 288 && nb == 144 && nm == 24);
+    }
+}
+
+/* ---------- Main ---------- */
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} cases[] = {
+    { "report", test_report },
+    { "iptable", test_iptable },
+    { "histo", test_histo },
+    { "retention", test_retention },
+    { "dayindex", test_dayindex },
+    { "quota", test_quota },
+    { "merge", test_merge },
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-d DIR] [CASE...]\n"
+            "  -d  scratch directory (default: a new one under /tmp)\n"
+            "  CASE  run only these: report iptable histo retention dayindex quota merge\n", prog);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "d:")) != -1) {
+        switch (c) {
+        case 'd': dir = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (dir) {
+        snprintf(scratch, sizeof(scratch), "%s", dir);
+        mkdir(scratch, 0755);
+    } else {
+        snprintf(scratch, sizeof(scratch), "/tmp/netacct-test.XXXXXX");
+        if (!mkdtemp(scratch)) {
+            perror("mkdtemp");
+            return 1;
+        }
+    }
+    storage_set_fsync(FSYNC_NEVER);
+
+    int first = optind, failed = 0, ran = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        int want = first == argc;
+        for (int k = first; k < argc; k++) want |= strcmp(argv[k], cases[i].name) == 0;
+        if (!want) continue;
+        case_failed = 0;
+        cases[i].fn();
+        printf("%s %s\n", case_failed ? "FAIL" : "ok", cases[i].name);
+        fflush(stdout);
+        failed += case_failed;
+        ran++;
+    }
+    if (!ran) {
+        usage(argv[0]);
+        return 1;
+    }
+    printf("%d of %d cases passed\n", ran - failed, ran);
+    // a failed run keeps its files for a look
+    if (failed) printf("scratch files kept in %s\n", scratch);
+    else if (!dir) remove_tree(scratch);
+    return failed;
+}